@@ -1,12 +1,296 @@
 from utils import *
 
+# Lines end with \x00 (it is the sentinel for the DFA, there are no bounds
+# checks), so no expression may match it
+ANY_CHAR = "[^\\x00]"
+
+# Characters of POSIX character classes as (low, high) ranges
+POSIX_CLASSES = {
+    "alpha": [(0x41, 0x5A), (0x61, 0x7A)],
+    "digit": [(0x30, 0x39)],
+    "alnum": [(0x30, 0x39), (0x41, 0x5A), (0x61, 0x7A)],
+    "upper": [(0x41, 0x5A)],
+    "lower": [(0x61, 0x7A)],
+    "space": [(0x09, 0x0D), (0x20, 0x20)],
+    "blank": [(0x09, 0x09), (0x20, 0x20)],
+    "punct": [(0x21, 0x2F), (0x3A, 0x40), (0x5B, 0x60), (0x7B, 0x7E)],
+    "xdigit": [(0x30, 0x39), (0x41, 0x46), (0x61, 0x66)],
+    "cntrl": [(0x01, 0x1F), (0x7F, 0x7F)],
+    "print": [(0x20, 0x7E)],
+    "graph": [(0x21, 0x7E)],
+}
+
+# the GNU escapes that stand for a class, the upper-case ones are complements
+BACKSLASH_CLASSES = {
+    "s": POSIX_CLASSES["space"],
+    "w": POSIX_CLASSES["alnum"] + [(0x5F, 0x5F)],
+}
+
+
+def _re2c_char(c):
+    if c.isascii() and c.isalnum():
+        return c
+    return f"\\x{ord(c):02x}"
+
+
+def _re2c_string(chars):
+    return '"' + "".join(_re2c_char(c) for c in chars) + '"'
+
+
+def _complement(ranges):
+    chars = set(range(1, 256))
+    for lo, hi in ranges:
+        chars -= set(range(lo, hi + 1))
+    return [(c, c) for c in chars]
+
+
+def _re2c_class(ranges):
+    """Character class from (low, high) ranges, \\x00 is never included"""
+    merged = []
+    for lo, hi in sorted((max(lo, 1), hi) for lo, hi in ranges if hi >= 1):
+        if merged and lo <= merged[-1][1] + 1:
+            merged[-1] = (merged[-1][0], max(merged[-1][1], hi))
+        else:
+            merged.append((lo, hi))
+    if not merged:
+        raise ValueError("empty bracket expression")
+
+    out = []
+    for lo, hi in merged:
+        out.append(_re2c_char(chr(lo)))
+        if hi > lo:
+            out.append("-" + _re2c_char(chr(hi)))
+    return "[" + "".join(out) + "]"
+
+
+class _EreTranslator:
+    """Translate POSIX extended regular expression to re2c syntax"""
+
+    def __init__(self, regex):
+        self.regex = regex
+        self.items = []
+        self.groups = 0
+        self.anchored_start = False
+        self.anchored_end = False
+
+    def _lit(self, c):
+        self.items.append(("lit", c))
+
+    def _raw(self, text):
+        self.items.append(("raw", text))
+
+    def _quant(self, text):
+        if not self.items or self.items[-1][0] == "quant":
+            raise ValueError(f"misplaced '{text}'")
+        if self.items[-1] in (("raw", "("), ("raw", "|")):
+            raise ValueError(f"'{text}' does not follow an expression")
+        self.items.append(("quant", text))
+
+    def _bracket(self, s, i):
+        """Parse the bracket expression that starts after '[' at `i`"""
+        negate = i < len(s) and s[i] == "^"
+        if negate:
+            i += 1
+        ranges = []
+        first = True
+        while True:
+            if i >= len(s):
+                raise ValueError("unterminated bracket expression")
+            c = s[i]
+            if c == "]" and not first:
+                i += 1
+                break
+            first = False
+            if c == "[" and i + 1 < len(s) and s[i + 1] in ":.=":
+                kind = s[i + 1]
+                close = s.find(kind + "]", i + 2)
+                if close < 0:
+                    raise ValueError(f"unterminated '[{kind}'")
+                name = s[i + 2 : close]
+                i = close + 2
+                if kind == ":":
+                    if name not in POSIX_CLASSES:
+                        raise ValueError(f"unknown class '[:{name}:]'")
+                    ranges.extend(POSIX_CLASSES[name])
+                    continue
+                if kind == "=" or len(name) != 1:
+                    raise ValueError(f"'[{kind}{name}{kind}]' is not supported")
+                c = name
+            else:
+                i += 1
+
+            if i + 1 < len(s) and s[i] == "-" and s[i + 1] != "]":
+                hi = s[i + 1]
+                i += 2
+                if ord(hi) < ord(c):
+                    raise ValueError(f"invalid range '{c}-{hi}'")
+                ranges.append((ord(c), ord(hi)))
+            else:
+                ranges.append((ord(c), ord(c)))
+
+        if negate:
+            ranges = _complement(ranges)
+        return _re2c_class(ranges), i
+
+    def _bound(self, s, i):
+        """Parse the bound that starts after '{' at `i`, None if it is not
+        a bound (then '{' is a literal)"""
+        close = s.find("}", i)
+        if close < 0:
+            return None, i
+        parts = s[i:close].split(",")
+        if len(parts) > 2 or not all(p.isdigit() or p == "" for p in parts):
+            return None, i
+        if parts[0] == "" and (len(parts) == 1 or parts[1] == ""):
+            return None, i
+        lo = parts[0] or "0"
+        if len(parts) == 1:
+            return f"{{{lo}}}", close + 1
+        if parts[1] and int(parts[1]) < int(lo):
+            raise ValueError(f"invalid bound '{{{s[i:close]}}}'")
+        return f"{{{lo},{parts[1]}}}", close + 1
+
+    def translate(self):
+        s = self.regex
+        i, end = 0, len(s)
+        if s.startswith("^"):
+            self.anchored_start = True
+            i = 1
+        if end > i and s.endswith("$"):
+            backslashes = len(s[:-1]) - len(s[:-1].rstrip("\\"))
+            if backslashes % 2 == 0:
+                self.anchored_end = True
+                end -= 1
+        s = s[:end]
+
+        depth = 0
+        toplevel_alternation = False
+        while i < end:
+            c = s[i]
+            i += 1
+            if c == "\\":
+                if i >= end:
+                    raise ValueError("trailing backslash")
+                c = s[i]
+                i += 1
+                if c.lower() in BACKSLASH_CLASSES:
+                    ranges = BACKSLASH_CLASSES[c.lower()]
+                    if c.isupper():
+                        ranges = _complement(ranges)
+                    self._raw(_re2c_class(ranges))
+                elif (c.isascii() and c.isalnum()) or c in "<>`'":
+                    # back-references, word boundaries and other GNU escapes
+                    # would silently match a literal character
+                    raise ValueError(f"unsupported escape '\\{c}'")
+                else:
+                    self._lit(c)
+            elif c == ".":
+                self._raw(ANY_CHAR)
+            elif c == "[":
+                cls, i = self._bracket(s, i)
+                self._raw(cls)
+            elif c == "(":
+                depth += 1
+                self.groups += 1
+                self._raw("(")
+                if i < end and s[i] == ")":
+                    self._raw('""')
+            elif c == ")":
+                depth -= 1
+                if depth < 0:
+                    raise ValueError("unbalanced ')'")
+                self._raw(")")
+            elif c == "|":
+                toplevel_alternation |= depth == 0
+                self._raw("|")
+            elif c in "*+?":
+                self._quant(c)
+            elif c == "{":
+                bound, i = self._bound(s, i)
+                if bound:
+                    self._quant(bound)
+                else:
+                    self._lit(c)
+            elif c in "^$":
+                raise ValueError("'^' and '$' are supported only at the start "
+                                 "and the end of the expression")
+            else:
+                self._lit(c)
+
+        if depth != 0:
+            raise ValueError("unbalanced '('")
+        if toplevel_alternation and (self.anchored_start or self.anchored_end):
+            raise ValueError("anchors with top-level '|' are not supported")
+        return self._join()
+
+    def _join(self):
+        """Join the items, consecutive literals become one string unless
+        a quantifier follows the last of them"""
+        out = []
+        lits = []
+        for n, (kind, text) in enumerate(self.items):
+            if kind == "lit":
+                quantified = (
+                    n + 1 < len(self.items) and self.items[n + 1][0] == "quant"
+                )
+                if quantified and lits:
+                    out.append(_re2c_string(lits))
+                    lits = []
+                lits.append(text)
+                if quantified:
+                    out.append(_re2c_string(lits))
+                    lits = []
+                continue
+            if lits:
+                out.append(_re2c_string(lits))
+                lits = []
+            out.append(text)
+        if lits:
+            out.append(_re2c_string(lits))
+        return " ".join(out) if out else '""'
+
 
 def adjust_regex(regex):
-    """Transform regex from POSIX syntax to RE2C syntax"""
-    return regex
+    """
+    Transform regex from POSIX syntax to RE2C syntax.
+
+    Returns the rule that matches the whole line (up to and including the
+    terminating \\x00) iff `regex` matches a part of it, and the number
+    of groups in `regex`. The expression itself is the group 1 of the rule,
+    the groups of the expression are shifted by one. re2c applies the POSIX
+    disambiguation to the groups, so the group 1 is the leftmost-longest
+    match as with regexec().
+    """
+    t = _EreTranslator(regex)
+    body = t.translate()
+    prefix = "" if t.anchored_start else f"{ANY_CHAR}* "
+    suffix = '"\\x00"' if t.anchored_end else f'{ANY_CHAR}* "\\x00"'
+    return f"{prefix}({body}) {suffix}", t.groups
+
+
+def c_string(s):
+    out = []
+    for c in s:
+        if c in '"\\':
+            out.append("\\" + c)
+        elif c.isprintable() and c.isascii():
+            out.append(c)
+        else:
+            out.append(f"\\{ord(c):03o}")
+    return '"' + "".join(out) + '"'
 
 
 class SourceGenerator:
+    # the types of the numeric arguments and how to parse them
+    NUMERIC_ARGS = {
+        "s": ("short", "parse_long"),
+        "i": ("int", "parse_long"),
+        "l": ("long", "parse_long"),
+        "p": ("unsigned long", "parse_ulong"),
+        "f": ("float", "parse_double"),
+        "d": ("double", "parse_double"),
+    }
+
     def __init__(self, template, output, shmkey, events):
         self.template = template
         if template.endswith(".in"):
@@ -19,128 +303,146 @@ class SourceGenerator:
         self.infile = open(self.template, "r")
         self.tmpfile = open(self.tmpoutput, "w")
 
-    def _gen_push_simple_arg(self, write, n, c):
-        fmt = c
-        if c == "i":
-            fmt = "d"
-        elif c == "l":
-            fmt = "ld"
-        elif c == "d":
-            fmt = "lf"
-
-        write(
-            f"""
-         tmp_c = *yypmatch[{n}];
-         *yypmatch[{n}] = 0;
-         sscanf(yypmatch[{n-1}], \"%@FMT\", &op.@ARG);
-         *yypmatch[{n}] = tmp_c;
-         addr = buffer_partial_push(shm, addr, &op.@ARG, sizeof(op.@ARG));
-         """.replace(
-                "@FMT", fmt
-            ).replace(
-                "@ARG", c
-            )
-        )
+    def events_num(self):
+        return len(self.events) // 3
 
-    def gen_push_event(self, sig):
+    def emit_push_start(self, ev_idx):
+        """Reserve the slot and push the base info about the event"""
+        return f"""
+        size_t waited = 0;
+        while (!(addr = vms_shm_buffer_start_push(shm))) {{
+            ++waited;
+        }}
+        if (waited > 0) {{
+            waiting_for_buffer += waited;
+            vsrc_stats_add(stream, VSRC_STATS_WAITS, waited);
+        }}
+        ++ev.base.id;
+        ev.base.kind = events[{ev_idx}].kind;
+        addr = vms_shm_buffer_partial_push(shm, addr, &ev, sizeof(ev));
+        """
+
+    def emit_push_finish(self, ev_idx):
+        return """
+        vms_shm_buffer_finish_push(shm);
+        vsrc_stats_published(stream, observed);
+        """
+
+    def gen_push_event(self, sig, groups):
+        """
+        Generate the push of the arguments. As in src/regex.c, the n-th
+        letter of the signature takes the n-th group of the expression
+        (which is the group n + 1 of the rule), 'L' is the whole line and
+        'M' the whole match.
+        """
         write = self.tmpfile.write
         for n, c in enumerate(sig, start=1):
-            idx_begin = 2 * n
-            idx_end = 2 * n + 1
-            if c in ("i", "l", "f", "d"):
-                self._gen_push_simple_arg(write, idx_end, c)
+            if c == "L":
+                write(
+                    "addr = vms_shm_buffer_partial_push_str(shm, addr, "
+                    "ev.base.id, line);\n"
+                )
+                continue
+
+            group = 1 if c == "M" else n + 1
+            if c != "M" and n > groups:
+                raise ValueError(
+                    f"signature '{sig}' has more arguments than the expression "
+                    "has groups"
+                )
+            begin, end = f"yypmatch[{2 * group}]", f"yypmatch[{2 * group + 1}]"
+            if c in self.NUMERIC_ARGS:
+                ty, parse = self.NUMERIC_ARGS[c]
+                write(
+                    f"{{ {ty} arg = ({ty}){parse}({begin}, {end});\n"
+                    "addr = vms_shm_buffer_partial_push(shm, addr, &arg, "
+                    "sizeof(arg)); }\n"
+                )
             elif c == "c":
                 write(
-                    "addr = buffer_partial_push(shm, addr, "
-                    f"yypmatch[{idx_begin}], sizeof(op.c));\n"
+                    f"{{ char arg = {begin} ? *{begin} : 0;\n"
+                    "addr = vms_shm_buffer_partial_push(shm, addr, &arg, "
+                    "sizeof(arg)); }\n"
                 )
-            elif c == "l":
-                write(f"tmp_c = *yypmatch[{idx_end}];\n")
-                write(f"*yypmatch[{idx_end}] = 0;\n")
-                write(f'sscanf(yypmatch[{idx_begin}], "%l", &op.l);\n')
-                write(f"*yypmatch[{idx_end}] = tmp_c;\n")
-                write("addr = buffer_partial_push(shm, addr, &op.l, sizeof(op.k));\n")
-            elif c == "L":
-                write("addr = buffer_partial_push_str(shm, addr, ev.base.id, line);\n")
-            elif c == "M":
+            elif c in ("S", "M"):
                 write(
-                    "addr = buffer_partial_push_str_n(shm, addr, ev.base.id, "
-                    "yypmatch[0], yypmatch[1] - yypmatch[0]);\n"
+                    "addr = vms_shm_buffer_partial_push_str_n(shm, addr, "
+                    f"ev.base.id, {begin} ? {begin} : \"\", "
+                    f"match_len({begin}, {end}));\n"
                 )
             else:
-                raise NotImplementedError(f"Not implemented yet: {sig}")
+                raise ValueError(f"unknown type '{c}' in signature '{sig}'")
 
     def gen_parse_and_push(self):
+        """
+        All expressions are compiled into one DFA. Every rule matches the
+        whole line, so if more expressions match, the DFA picks the first one.
+        To push every matching event (as src/regex.c does), there is a DFA
+        for every suffix of the events and after pushing the event `k`
+        we continue with the DFA of events k+1, k+2, ... Lines that match
+        at most one event go through at most two DFAs.
+        """
         events = self.events
-
+        write = self.tmpfile.write
+        rules = []
         for i in range(0, len(events), 3):
-            ev_idx = int(i / 3)
-            ev_name = events[i]
-            ev_regex = adjust_regex(events[i + 1])
-            ev_sig = events[i + 2]
-
-            parse_start = f"""
-            YYCURSOR = line;
-            YYLIMIT = line + len;
-
-            /*!re2c
-               .*{ev_regex}.* {{
-                   while (!(out = buffer_start_push(shm))) {{
-                       ++waiting_for_buffer;
-                   }}
-                   out->base.kind = events[{ev_idx}].kind; // FIXME: cache these
-                   out->base.id = ++ev.base.id;
-                   addr = out->args;
-
-                   char tmp_c;
-            """
-            parse_end = f"""
-                   buffer_finish_push(shm);
-                   continue;
-                }}
-                *      {{ printf("NO match\\n"); goto next{ev_idx + 1}; }}
-              */
-            """
-
-            write = self.tmpfile.write
-            write(f"/* parsing event {ev_idx}: {ev_name}:{ev_sig} -> {ev_regex} */\n")
+            ev_name, ev_regex, ev_sig = events[i : i + 3]
+            try:
+                rule, groups = adjust_regex(ev_regex)
+            except ValueError as e:
+                msg_and_exit(f"Cannot translate '{ev_regex}' ({ev_name}): {e}")
+            rules.append((ev_name, ev_regex, ev_sig, rule, groups))
+
+        for start in range(len(rules)):
+            if start > 0:
+                write(f"match_from_{start}:\n")
+            write("YYCURSOR = line;\n")
+            write("/*!re2c\n")
+            write("re2c:yyfill:enable = 0;\n")
+            write('re2c:define:YYCTYPE = "unsigned char";\n')
+            for ev_idx in range(start, len(rules)):
+                write(f"{rules[ev_idx][3]} {{ goto push_{ev_idx}; }}\n")
+            write("* { continue; }\n")
+            write("*/\n")
+
+        for ev_idx, (ev_name, ev_regex, ev_sig, _, groups) in enumerate(rules):
+            comment = f"{ev_name}:{ev_sig} -> {ev_regex}".replace("*/", "*\\/")
+            write(f"/* {comment} */\n")
+            write(f"push_{ev_idx}:\n")
             write(f"if (events[{ev_idx}].kind != 0) {{")
-            write(parse_start)
-            self.gen_push_event(ev_sig)
-            write(parse_end)
-            write("}")
-            write(f"next{ev_idx + 1}: ;")
+            write(self.emit_push_start(ev_idx))
+            try:
+                self.gen_push_event(ev_sig, groups)
+            except ValueError as e:
+                msg_and_exit(f"Event '{ev_name}': {e}")
+            write(self.emit_push_finish(ev_idx))
+            write("}\n")
+            if ev_idx + 1 < len(rules):
+                write(f"goto match_from_{ev_idx + 1};\n")
+            else:
+                write("continue;\n")
 
     def source_control_src(self):
         events = self.events
         evs = ", ".join(
-            f'"{events[i]}", "{events[i+2]}"' for i in range(0, len(events), 3)
+            f"{c_string(events[i])}, {c_string(events[i + 2])}"
+            for i in range(0, len(events), 3)
         )
         return f"""
         /* Initialize the info about this source */
-        struct source_control *control
-            = source_control_define({len(events)/3}, {evs});
+        struct vms_source_control *control
+            = vms_source_control_define({self.events_num()}, {evs});
         assert(control);
         """
 
-    def create_shared_buffer_src(self):
-        return f"""
-        /* Create the shared buffer */
-        create_shared_buffer(
-            \"{self.shmkey}\",
-            source_control_max_event_size(control),
-            control);
-        free(control);
-        """
-
     def emit_declarations(self):
         return None
 
     def gen(self):
         subs = [
-            ("@EVENTS_NUM", str(int(len(self.events) / 3))),
+            ("@EVENTS_NUM", str(self.events_num())),
             ("@SOURCE_CONTROL", self.source_control_src()),
-            ("@CREATE_SHARED_BUFFER", self.create_shared_buffer_src()),
+            ("@SHMKEY", c_string(self.shmkey)),
         ]
 
         decl = self.emit_declarations()
@@ -7,18 +7,6 @@ from gen_drio import gen_drio
 from utils import *
 
 
-def usage_and_exit(msg=None):
-    if msg:
-        print(msg, file=stderr)
-    print(
-        f"Usage: {argv[0]} source-type shmkey "
-        "event-name data-descr event-signature ",
-        "[event-name data-descr event-signature] ...",
-        file=stderr,
-    )
-    exit(1)
-
-
 def usage_and_exit(msg=None):
     if msg:
         print(msg, file=stderr)
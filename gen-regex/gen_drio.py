@@ -6,29 +6,47 @@ class DRioSourceGenerator(SourceGenerator):
         super().__init__(template, output, shmkey, events)
 
     def emit_declarations(self):
-        return
-        """
+        return """
         static _Atomic(bool) _write_lock = false;
-        
+
         static inline void write_lock() {
             _Atomic bool *l = &_write_lock;
             bool unlocked;
             do {
                 unlocked = false;
-            } while (atomic_compare_exchange_weak(l, &unlocked, true));
+            } while (!atomic_compare_exchange_weak_explicit(
+                l, &unlocked, true, memory_order_acquire,
+                memory_order_relaxed));
         }
-        
+
         static inline void write_unlock() {
-            /* FIXME: use explicit memory ordering, seq_cnt is not needed here */
-            _write_lock = false;
+            atomic_store_explicit(&_write_lock, false, memory_order_release);
         }
         """
 
-    def gen_push_event(self, sig):
-        # FIXME: the locked code is too big
-        self.tmpfile.write("write_lock(); /*FIXME: lock only the push */\n")
-        super().gen_push_event(sig)
-        self.tmpfile.write("write_unlock();\n")
+    # the shared buffer has a single writer, but there may be more threads
+    # writing to stdout, so the whole push is done under the lock
+    def emit_push_start(self, ev_idx):
+        return f"""
+        write_lock();
+        while (!(addr = vms_shm_buffer_start_push(shm))) {{
+            ++waiting_for_buffer;
+        }}
+        ++ev.base.id;
+        ev.base.kind = events[{ev_idx}].kind;
+        #ifndef DRREGEX_ONLY_ARGS
+        ev.write = iswrite;
+        ev.fd = data->fd;
+        ev.thread = data->thread;
+        #endif
+        addr = vms_shm_buffer_partial_push(shm, addr, &ev, sizeof(ev));
+        """
+
+    def emit_push_finish(self, ev_idx):
+        return """
+        vms_shm_buffer_finish_push(shm);
+        write_unlock();
+        """
 
 
 def gen_drio(evtype, shmkey, events):
@@ -1,7 +1,10 @@
-from sys import argv as cmdargs, stderr
+import sys
+from sys import stderr
 from subprocess import run as _run
 from os.path import dirname, abspath, join as joinpath
 
+TOP_DIR = abspath(joinpath(dirname(__file__), ".."))
+
 
 def run(cmd, *args, **kwargs):
     print("\033[32m>", " ".join(cmd), "\033[0m", file=stderr)
@@ -17,24 +20,25 @@ def run_clang_format(infile):
 
 
 def run_clang(src, out):
-    top_dir = abspath(joinpath(dirname(cmdargs[0]), "../.."))
-    core_dir = joinpath(top_dir, "core")
-    shmbuf_dir = joinpath(top_dir, "shmbuf")
-
-    include_dirs = [top_dir, core_dir]
-    link_dirs = [core_dir, shmbuf_dir]
-    cflags = ["-Wall", "-g"]
-    ldflags = [
-        "-lshamon-source",
-        "-lshamon-shmbuf",
-        "-lshamon-signature",
-        "-lshamon-utils",
+    sys.path.append(TOP_DIR)
+    import config
+
+    libs_dir = config.vamos_buffers_LIBRARIES_DIRS_core
+    shmbuf_dir = config.vamos_buffers_LIBRARIES_DIRS_shmbuf
+    libraries = [
+        f"{libs_dir}/libvamos-buffers-source.a",
+        f"{shmbuf_dir}/libvamos-buffers-shmbuf.a",
+        f"{libs_dir}/libvamos-buffers-list.a",
+        f"{libs_dir}/libvamos-buffers-signature.a",
+        f"{libs_dir}/libvamos-buffers-event.a",
+        f"{libs_dir}/libvamos-buffers-utils.a",
     ]
-    libraries = []
+    include_dirs = [config.vamos_buffers_INCLUDE_DIR, joinpath(TOP_DIR, "src")]
+    cflags = ["-Wall", "-g", "-O3", "-std=c11", "-D_POSIX_C_SOURCE=200809L"]
+    ldflags = ["-lrt", "-pthread"]
     run(
-        ["clang", src, "-o", out]
+        ["clang", src, joinpath(TOP_DIR, "src/stats/stats.c"), "-o", out]
         + [f"-I{d}" for d in include_dirs]
-        + [f"-L{d}" for d in link_dirs]
         + cflags
         + libraries
         + ldflags
@@ -0,0 +1,308 @@
+#include "bpfsrc.h"
+
+#include <assert.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define warn(...) fprintf(stderr, __VA_ARGS__)
+
+/* How many times we try to consume the ring buffer without getting any data
+ * before we block in ring_buffer__poll */
+#define BUSY_ROUNDS 1000
+
+static const int CAN_CONTINUE = 0xbee;
+
+int bpfsrc_open_opts(struct bpf_object_open_opts *opts) {
+    if (access("/sys/kernel/btf/vmlinux", R_OK) == 0)
+        return 0; /* libbpf finds it itself */
+
+    const char *path = getenv("VAMOS_BTF");
+    if (!path) {
+        warn("the kernel does not expose BTF, set VAMOS_BTF to the path "
+             "of the BTF of the running kernel\n");
+        return -ENOENT;
+    }
+    if (access(path, R_OK) != 0) {
+        warn("cannot read BTF from '%s': %s\n", path, strerror(errno));
+        return -errno;
+    }
+    opts->btf_custom_path = path;
+    return 0;
+}
+
+int bpfsrc_spawn(char *argv[], pid_t *pid) {
+    int fork_sync[2];
+    if (pipe(fork_sync) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    *pid = fork();
+    if (*pid < 0) {
+        perror("fork");
+        close(fork_sync[0]);
+        close(fork_sync[1]);
+        return -1;
+    }
+
+    if (*pid == 0) { /* child */
+        close(fork_sync[1]);
+        int val = 0;
+        while (val != CAN_CONTINUE) {
+            if (read(fork_sync[0], &val, sizeof(int)) <= 0) {
+                perror("syncing child process");
+                exit(1);
+            }
+        }
+        close(fork_sync[0]);
+
+        for (int i = 0; argv[i]; ++i) {
+            warn("  spawn arg %d: %s\n", i, argv[i]);
+        }
+
+        if (execve(argv[0], argv, NULL) < 0) {
+            perror("execve");
+            warn("\033[31mFailed spawning the program...\033[0m\n");
+            exit(1);
+        }
+        assert(0 && "Unreachable after execve");
+    }
+
+    warn("Spawned pid %d\n", *pid);
+
+    close(fork_sync[0]);
+    return fork_sync[1];
+}
+
+int bpfsrc_let_run(int sync_fd) {
+    int ret = 0;
+    if (write(sync_fd, &CAN_CONTINUE, sizeof(CAN_CONTINUE)) !=
+        sizeof(CAN_CONTINUE)) {
+        perror("signaling child to continue");
+        ret = -1;
+    }
+    close(sync_fd);
+    return ret;
+}
+
+static struct bpf_link **links = NULL;
+static size_t links_num = 0;
+static size_t links_alloc = 0;
+
+static void keep_link(struct bpf_link *link) {
+    if (links_num == links_alloc) {
+        links_alloc = links_alloc ? 2 * links_alloc : 16;
+        links = realloc(links, links_alloc * sizeof(*links));
+        assert(links && "Allocation failed");
+    }
+    links[links_num++] = link;
+}
+
+int bpfsrc_attach(struct bpf_object *obj, const char *name) {
+    struct bpf_program *prog = bpf_object__find_program_by_name(obj, name);
+    if (!prog) {
+        warn("no BPF program '%s'\n", name);
+        return -ENOENT;
+    }
+
+    struct bpf_link *link = bpf_program__attach(prog);
+    if (!link) {
+        int err = -errno;
+        warn("failed to attach %s program: %s\n", name, strerror(-err));
+        return err;
+    }
+
+    keep_link(link);
+    return 0;
+}
+
+int bpfsrc_attach_uprobe(struct bpf_object *obj, const char *name, pid_t pid,
+                         const char *binary, size_t offset, bool retprobe,
+                         uint64_t cookie) {
+    struct bpf_program *prog = bpf_object__find_program_by_name(obj, name);
+    if (!prog) {
+        warn("no BPF program '%s'\n", name);
+        return -ENOENT;
+    }
+
+    LIBBPF_OPTS(bpf_uprobe_opts, opts, .bpf_cookie = cookie,
+                .retprobe = retprobe);
+    struct bpf_link *link =
+        bpf_program__attach_uprobe_opts(prog, pid, binary, offset, &opts);
+    if (!link) {
+        int err = -errno;
+        warn("failed to attach %s program to %s+0x%lx: %s\n", name, binary,
+             offset, strerror(-err));
+        return err;
+    }
+
+    keep_link(link);
+    return 0;
+}
+
+int bpfsrc_set_autoload(struct bpf_object *obj, const char *name, bool load) {
+    struct bpf_program *prog = bpf_object__find_program_by_name(obj, name);
+    if (!prog) {
+        warn("no BPF program '%s'\n", name);
+        return -ENOENT;
+    }
+    return bpf_program__set_autoload(prog, load);
+}
+
+void bpfsrc_detach_all(void) {
+    for (size_t i = 0; i < links_num; ++i) {
+        bpf_link__destroy(links[i]);
+    }
+    free(links);
+    links = NULL;
+    links_num = links_alloc = 0;
+}
+
+int bpfsrc_consume(struct ring_buffer *rb,
+                   const struct bpfsrc_consume_opts *opts) {
+    int err;
+    size_t idle_rounds = 0;
+    while (opts->keep_running(opts->data)) {
+        if (idle_rounds < BUSY_ROUNDS) {
+            err = ring_buffer__consume(rb);
+        } else {
+            err = ring_buffer__poll(rb, opts->poll_timeout_ms);
+        }
+
+        if (err > 0) {
+            idle_rounds = 0;
+        } else if (err == 0 || err == -EINTR) {
+            ++idle_rounds;
+        } else {
+            warn("polling: %s\n", strerror(-err));
+        }
+
+        if (opts->after_round) {
+            opts->after_round(opts->data);
+        }
+    }
+
+    /* get what was written before we stopped */
+    err = ring_buffer__consume(rb);
+    if (err < 0 && err != -EINTR) {
+        warn("polling: %s\n", strerror(-err));
+        return err;
+    }
+    return 0;
+}
+
+/* Find `name` among the defined functions in the symbol table `symtab` */
+static int find_function(const unsigned char *image, size_t size,
+                         const Elf64_Shdr *symtab, const Elf64_Shdr *strtab,
+                         const char *name, Elf64_Addr *addr) {
+    if (symtab->sh_offset + symtab->sh_size > size ||
+        strtab->sh_offset + strtab->sh_size > size ||
+        symtab->sh_entsize != sizeof(Elf64_Sym))
+        return -EINVAL;
+
+    const Elf64_Sym *syms = (const Elf64_Sym *)(image + symtab->sh_offset);
+    const char *strs = (const char *)(image + strtab->sh_offset);
+    size_t syms_num = symtab->sh_size / sizeof(Elf64_Sym);
+    size_t name_len = strlen(name);
+
+    for (size_t i = 0; i < syms_num; ++i) {
+        if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC ||
+            syms[i].st_shndx == SHN_UNDEF || syms[i].st_value == 0)
+            continue;
+        if (syms[i].st_name + name_len >= strtab->sh_size)
+            continue;
+        const char *sym_name = strs + syms[i].st_name;
+        /* versioned names from .dynsym, e.g., foo@@VER, match too */
+        if (strncmp(sym_name, name, name_len) == 0 &&
+            (sym_name[name_len] == '\0' || sym_name[name_len] == '@')) {
+            *addr = syms[i].st_value;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+int bpfsrc_elf_symbol_offset(const char *binary, const char *name,
+                             size_t *offset) {
+    int fd = open(binary, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        warn("cannot open '%s': %s\n", binary, strerror(errno));
+        return -errno;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Elf64_Ehdr)) {
+        close(fd);
+        warn("'%s' is not an ELF file\n", binary);
+        return -EINVAL;
+    }
+
+    size_t size = st.st_size;
+    const unsigned char *image =
+        mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        warn("cannot map '%s': %s\n", binary, strerror(errno));
+        return -errno;
+    }
+
+    int err = -EINVAL;
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) > size ||
+        ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > size) {
+        warn("'%s' is not a 64-bit ELF file\n", binary);
+        goto out;
+    }
+
+    const Elf64_Shdr *shdrs = (const Elf64_Shdr *)(image + ehdr->e_shoff);
+    Elf64_Addr addr = 0;
+    err = -ENOENT;
+    /* prefer .symtab that has also the local functions, fall back to
+     * .dynsym for stripped binaries */
+    const Elf64_Word types[] = {SHT_SYMTAB, SHT_DYNSYM};
+    for (int t = 0; t < 2 && err != 0; ++t) {
+        for (int i = 0; i < ehdr->e_shnum && err != 0; ++i) {
+            if (shdrs[i].sh_type != types[t] ||
+                shdrs[i].sh_link >= ehdr->e_shnum)
+                continue;
+            err = find_function(image, size, &shdrs[i],
+                                &shdrs[shdrs[i].sh_link], name, &addr);
+        }
+    }
+    if (err != 0) {
+        warn("function '%s' not found in '%s'\n", name, binary);
+        goto out;
+    }
+
+    /* uprobes take the offset in the file, translate the virtual address
+     * using the executable segment that contains it */
+    const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(image + ehdr->e_phoff);
+    err = -ENOENT;
+    for (int i = 0; i < ehdr->e_phnum; ++i) {
+        if (phdrs[i].p_type != PT_LOAD || !(phdrs[i].p_flags & PF_X))
+            continue;
+        if (addr >= phdrs[i].p_vaddr &&
+            addr < phdrs[i].p_vaddr + phdrs[i].p_memsz) {
+            *offset = addr - phdrs[i].p_vaddr + phdrs[i].p_offset;
+            err = 0;
+            break;
+        }
+    }
+    if (err != 0) {
+        warn("function '%s' is not in an executable segment of '%s'\n", name,
+             binary);
+    }
+
+out:
+    munmap((void *)image, size);
+    return err;
+}
@@ -0,0 +1,72 @@
+#ifndef __BPFSRC_H
+#define __BPFSRC_H
+
+/*
+ * Common parts of the CO-RE eBPF sources: opening BPF objects, spawning
+ * the traced program, attaching programs by name, resolving functions
+ * for uprobes and consuming the ring buffers.
+ */
+
+#include <bpf/libbpf.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Fill in the options for opening a BPF object. If the kernel does not
+ * expose its BTF in /sys/kernel/btf/vmlinux, the BTF is taken from the file
+ * in the VAMOS_BTF environment variable. Returns 0 on success. */
+int bpfsrc_open_opts(struct bpf_object_open_opts *opts);
+
+/* Fork and exec argv[0] with the arguments in argv (NULL-terminated).
+ * The new process waits until bpfsrc_let_run() is called, so that we can
+ * attach to it before it runs. Returns the fd to pass to bpfsrc_let_run()
+ * or -1 on error. The pid of the new process is stored in `pid`. */
+int bpfsrc_spawn(char *argv[], pid_t *pid);
+
+/* Let the spawned process run and close `sync_fd` */
+int bpfsrc_let_run(int sync_fd);
+
+/* Attach the program `name` from `obj`. The link is kept until
+ * bpfsrc_detach_all() is called. Returns 0 on success or -errno. */
+int bpfsrc_attach(struct bpf_object *obj, const char *name);
+
+/* Attach the uprobe (or uretprobe if `retprobe` is true) program `name` from
+ * `obj` to `offset` in the file `binary`. The probe fires only in process
+ * `pid` or in all processes if `pid` is -1. The program can get `cookie`
+ * with bpf_get_attach_cookie(). The link is kept until bpfsrc_detach_all()
+ * is called. Returns 0 on success or -errno. */
+int bpfsrc_attach_uprobe(struct bpf_object *obj, const char *name, pid_t pid,
+                         const char *binary, size_t offset, bool retprobe,
+                         uint64_t cookie);
+
+/* Find the function `name` in the symbol tables of the ELF file `binary`
+ * and store its offset in the file (as taken by uprobes) into `offset`.
+ * Returns 0 on success or -errno. */
+int bpfsrc_elf_symbol_offset(const char *binary, const char *name,
+                             size_t *offset);
+
+/* Enable or disable loading of the program `name` from `obj` */
+int bpfsrc_set_autoload(struct bpf_object *obj, const char *name, bool load);
+
+/* Destroy all the links created by bpfsrc_attach*() */
+void bpfsrc_detach_all(void);
+
+struct bpfsrc_consume_opts {
+    /* how long to block in epoll when the ring buffer is idle */
+    int poll_timeout_ms;
+    /* consume while this returns true */
+    bool (*keep_running)(void *data);
+    /* called after each round of consuming (can be NULL) */
+    void (*after_round)(void *data);
+    void *data;
+};
+
+/* Consume the ring buffer(s) in `rb` without blocking while the data are
+ * flowing. Once there were no data for a while, block in epoll until
+ * the kernel wakes us up or the timeout expires. When `keep_running`
+ * returns false, consume what is left and return. */
+int bpfsrc_consume(struct ring_buffer *rb,
+                   const struct bpfsrc_consume_opts *opts);
+
+#endif /* __BPFSRC_H */
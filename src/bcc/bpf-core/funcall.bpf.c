@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "funcall.h"
+
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <vmlinux.h>
+
+/* Indexed by the BPF cookie of the probe */
+const volatile struct probe_spec probes[MAX_PROBES] = {};
+/* the records that were lost and not yet reported to the userspace */
+__u64 pending_lost = 0;
+/* the total number of lost records */
+__u64 lost_total = 0;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, RINGBUF_SIZE);
+} buffer SEC(".maps");
+
+/* the records are assembled here, only the used part of them is copied into
+ * the ring buffer */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, struct call_record);
+} scratch SEC(".maps");
+
+static __always_inline int output_record(struct call_record *r, u64 size) {
+    u64 lost = pending_lost;
+    r->lost = lost;
+    if (bpf_ringbuf_output(&buffer, r, size, 0) != 0) {
+        __sync_fetch_and_add(&pending_lost, 1);
+        __sync_fetch_and_add(&lost_total, 1);
+        return -1;
+    }
+    if (lost > 0)
+        __sync_fetch_and_sub(&pending_lost, lost);
+    return 0;
+}
+
+static __always_inline struct call_record *start_record(void *ctx) {
+    u64 probe = bpf_get_attach_cookie(ctx);
+    if (probe >= MAX_PROBES)
+        return NULL;
+
+    u32 zero = 0;
+    struct call_record *r = bpf_map_lookup_elem(&scratch, &zero);
+    if (!r)
+        return NULL;
+
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    r->probe = probe;
+    r->pid = pid_tgid >> 32;
+    r->tid = (u32)pid_tgid;
+    return r;
+}
+
+SEC("uprobe")
+int BPF_KPROBE(call_entry) {
+    struct call_record *r = start_record(ctx);
+    if (!r)
+        return 0;
+
+    r->args[0] = PT_REGS_PARM1(ctx);
+    r->args[1] = PT_REGS_PARM2(ctx);
+    r->args[2] = PT_REGS_PARM3(ctx);
+    r->args[3] = PT_REGS_PARM4(ctx);
+    r->args[4] = PT_REGS_PARM5(ctx);
+    r->args[5] = PT_REGS_PARM6(ctx);
+
+    unsigned str_mask = probes[r->probe % MAX_PROBES].str_mask;
+    u32 strs = 0;
+    for (int i = 0; i < MAX_ARGS; ++i) {
+        if (!(str_mask & (1U << i)))
+            continue;
+        if (strs >= MAX_STR_ARGS)
+            break;
+        if (bpf_probe_read_user_str(r->str[strs], MAX_STR_LEN,
+                                    (const void *)r->args[i]) < 0)
+            r->str[strs][0] = '\0';
+        ++strs;
+    }
+
+    output_record(r, offsetof(struct call_record, str) + strs * MAX_STR_LEN);
+    return 0;
+}
+
+SEC("uretprobe")
+int BPF_KRETPROBE(call_return) {
+    struct call_record *r = start_record(ctx);
+    if (!r)
+        return 0;
+
+    r->args[0] = PT_REGS_RC(ctx);
+    output_record(r, offsetof(struct call_record, args[1]));
+    return 0;
+}
+
+char LICENSE[] SEC("license") = "GPL";
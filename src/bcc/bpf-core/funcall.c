@@ -0,0 +1,466 @@
+/*
+ * Source of function calls that uses uprobes instead of dynamic binary
+ * instrumentation (cf. drfun). The functions and their arguments are
+ * described the same way as in drfun (see drfun/eventspec.h) and the events
+ * have the same layout (vms_event_funcall).
+ */
+
+#include "funcall.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bpfsrc.h"
+#include "drfun/eventspec.h"
+#include "funcall.skel.h"
+#include "vamos-buffers/core/event.h"
+#include "vamos-buffers/core/signatures.h"
+#include "vamos-buffers/core/source.h"
+#include "vamos-buffers/shmbuf/buffer.h"
+#include "vamos-buffers/shmbuf/client.h"
+#include "vamos-buffers/streams/stream-funs.h"
+
+#define warn(...) fprintf(stderr, __VA_ARGS__)
+
+static void usage_and_exit(int ret) {
+    warn(
+        "Usage: funcall [options] shmkey 'fun1[@binary]:[sig][:ret]' ... -- "
+        "[program arg1 arg2... | -p PID]\n"
+        "Options:\n"
+        "  -t MS     how long to block waiting for data when the ring buffer\n"
+        "            is idle (default 100)\n"
+        "\n"
+        "The signature describes the arguments of the function like in drfun\n"
+        "(c, s, i, l, p, S = string, _ = skip), floating-point arguments are\n"
+        "not supported. At most %d arguments passed in registers can be\n"
+        "traced and at most %d of them can be strings.\n"
+        "If 'ret' is given, the returns from the function are traced too as\n"
+        "events 'fun1_ret' with the return value of type 'ret'.\n"
+        "The function is looked up in 'binary', which is the traced program\n"
+        "by default.\n"
+        "\n"
+        "The event 'dropped' with signature 'l' carries the number of calls\n"
+        "that were lost.\n",
+        MAX_ARGS, MAX_STR_ARGS);
+    exit(ret);
+}
+
+static int poll_timeout_ms = 100;
+
+/* a traced call of or a return from a function, the index of the probe is
+ * also the index of its event */
+struct probe {
+    struct call_event_spec spec;
+    const char *binary;
+    bool retprobe;
+};
+
+static struct probe probes[MAX_PROBES];
+static size_t probes_num = 0;
+
+static vms_shm_buffer *shm;
+/* the 'dropped' event is the last one */
+static vms_kind dropped_kind;
+static uint64_t last_event_id = 0;
+static size_t waiting_for_buffer = 0;
+static uint64_t lost_calls = 0;
+
+static void push_dropped(uint64_t lost) {
+    lost_calls += lost;
+    if (dropped_kind == 0)
+        return; /* monitor is not interested in this */
+
+    void *addr;
+    while (!(addr = vms_shm_buffer_start_push(shm))) {
+        ++waiting_for_buffer;
+    }
+    vms_event ev = {.id = ++last_event_id, .kind = dropped_kind};
+    addr = vms_shm_buffer_partial_push(shm, addr, &ev, sizeof(ev));
+    addr = vms_shm_buffer_partial_push(shm, addr, &lost, sizeof(lost));
+    vms_shm_buffer_finish_push(shm);
+}
+
+static int handle_record(void *ctx, void *data, size_t len) {
+    (void)ctx;
+    const struct call_record *r = data;
+    if (len < offsetof(struct call_record, args[1]) ||
+        r->probe >= probes_num) {
+        warn("invalid record of size %lu\n", len);
+        return 0;
+    }
+
+    if (r->lost > 0) {
+        push_dropped(r->lost);
+    }
+
+    const struct call_event_spec *spec = &probes[r->probe].spec;
+    if (spec->kind == 0)
+        return 0; /* monitor is not interested in this */
+
+    void *shmaddr;
+    while (!(shmaddr = vms_shm_buffer_start_push(shm))) {
+        ++waiting_for_buffer;
+    }
+    vms_event_funcall *ev = (vms_event_funcall *)shmaddr;
+    ev->base.kind = spec->kind;
+    ev->base.id = ++last_event_id;
+    memcpy(ev->signature, spec->signature, sizeof(ev->signature));
+    shmaddr = ev->args;
+
+    int strs = 0;
+    for (int i = 0; spec->signature[i]; ++i) {
+        unsigned char o = spec->signature[i];
+        switch (o) {
+            case '_':
+                break;
+            case 'S':
+                /* the BPF program puts only the strings into the record */
+                if (offsetof(struct call_record, str) +
+                        (strs + 1) * MAX_STR_LEN >
+                    len) {
+                    shmaddr = vms_shm_buffer_partial_push_str(
+                        shm, shmaddr, ev->base.id, "");
+                } else {
+                    shmaddr = vms_shm_buffer_partial_push_str_n(
+                        shm, shmaddr, ev->base.id, r->str[strs], MAX_STR_LEN);
+                }
+                ++strs;
+                break;
+            default:
+                /* the arguments are little-endian, so the lower bytes
+                 * of the register are at its address */
+                shmaddr = vms_shm_buffer_partial_push(
+                    shm, shmaddr, &r->args[i], signature_op_get_size(o));
+                break;
+        }
+    }
+    vms_shm_buffer_finish_push(shm);
+    return 0;
+}
+
+static int check_signature(const char *name, const char *sig, size_t max_args,
+                           size_t max_strs) {
+    if (strlen(sig) > max_args) {
+        warn("'%s': at most %lu arguments can be traced\n", name, max_args);
+        return -1;
+    }
+    size_t strs = 0;
+    for (const char *o = sig; *o; ++o) {
+        switch (*o) {
+            case 'c':
+            case 's':
+            case 'i':
+            case 'l':
+            case 'p':
+            case '_':
+                break;
+            case 'S':
+                if (++strs > max_strs) {
+                    warn("'%s': at most %lu strings can be traced\n", name,
+                         max_strs);
+                    return -1;
+                }
+                break;
+            case 'f':
+            case 'd':
+                warn("'%s': floating-point arguments are passed in SIMD "
+                     "registers that uprobes cannot read\n",
+                     name);
+                return -1;
+            default:
+                warn("'%s': invalid signature '%s'\n", name, sig);
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static struct probe *add_probe(const char *name, const char *binary,
+                               const char *sig, bool retprobe) {
+    if (probes_num == MAX_PROBES) {
+        warn("Too many functions, at most %d probes can be used\n",
+             MAX_PROBES);
+        return NULL;
+    }
+
+    struct probe *p = &probes[probes_num++];
+    memset(&p->spec, 0, sizeof(p->spec));
+    if (retprobe) {
+        snprintf(p->spec.name, sizeof(p->spec.name), "%s_ret", name);
+    } else {
+        snprintf(p->spec.name, sizeof(p->spec.name), "%s", name);
+    }
+    strncpy((char *)p->spec.signature, sig, sizeof(p->spec.signature) - 1);
+    p->binary = binary;
+    p->retprobe = retprobe;
+    return p;
+}
+
+/* Parse 'fun[@binary]:[sig][:ret]' (the argument is modified) */
+static int parse_function(char *arg, const char *default_binary) {
+    const char *sig = "";
+    const char *ret = NULL;
+    const char *binary = default_binary;
+
+    char *colon = strchr(arg, ':');
+    if (colon) {
+        *colon = 0;
+        sig = colon + 1;
+        colon = strchr(sig, ':');
+        if (colon) {
+            *colon = 0;
+            ret = colon + 1;
+        }
+    }
+    char *at = strchr(arg, '@');
+    if (at) {
+        *at = 0;
+        binary = at + 1;
+    }
+
+    if (check_signature(arg, sig, MAX_ARGS, MAX_STR_ARGS) < 0)
+        return -1;
+    if (!add_probe(arg, binary, sig, false))
+        return -1;
+
+    if (ret) {
+        /* the return value is a single value that is not a string */
+        if (strlen(ret) != 1 ||
+            check_signature(arg, ret, /* max_args = */ 1, /* max_strs = */ 0) <
+                0) {
+            warn("'%s': invalid type of the return value '%s'\n", arg, ret);
+            return -1;
+        }
+        if (!add_probe(arg, binary, ret, true))
+            return -1;
+    }
+    return 0;
+}
+
+/* Find the functions in the binaries, fill in the BPF part of the specs */
+static int resolve_probes(struct funcall_bpf *obj) {
+    for (size_t i = 0; i < probes_num; ++i) {
+        struct probe *p = &probes[i];
+        if (p->retprobe) {
+            /* the return probe follows the call probe */
+            p->spec.addr = probes[i - 1].spec.addr;
+            continue;
+        }
+
+        if (bpfsrc_elf_symbol_offset(p->binary, p->spec.name, &p->spec.addr) <
+            0)
+            return -1;
+        warn("info: found %s:%s in %s at 0x%lx\n", p->spec.name,
+             p->spec.signature, p->binary, p->spec.addr);
+
+        unsigned str_mask = 0;
+        for (int a = 0; p->spec.signature[a]; ++a) {
+            if (p->spec.signature[a] == 'S')
+                str_mask |= 1U << a;
+        }
+        obj->rodata->probes[i].str_mask = str_mask;
+    }
+    return 0;
+}
+
+static int attach_probes(struct funcall_bpf *obj, pid_t pid) {
+    for (size_t i = 0; i < probes_num; ++i) {
+        struct probe *p = &probes[i];
+        int err = bpfsrc_attach_uprobe(
+            obj->obj, p->retprobe ? "call_return" : "call_entry", pid,
+            p->binary, p->spec.addr, p->retprobe, /* cookie = */ i);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t child_running = 1;
+
+static void sig_int(int signo) { running = 0; }
+
+static void sig_chld(int signo) { child_running = 0; }
+
+static bool keep_running(void *data) {
+    (void)data;
+    return running && child_running;
+}
+
+int main(int argc, char *argv[]) {
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (strncmp(argv[i], "-t", 3) == 0 && i + 1 < argc) {
+            poll_timeout_ms = atoi(argv[++i]);
+        } else {
+            usage_and_exit(1);
+        }
+    }
+    int shmkey_idx = i;
+    for (; i < argc; ++i) {
+        if (strncmp(argv[i], "--", 3) == 0) {
+            break;
+        }
+    }
+    int prog_idx = i + 1;
+    if (prog_idx >= argc || shmkey_idx + 1 >= i) {
+        usage_and_exit(1);
+    }
+
+    const char *shmkey = argv[shmkey_idx];
+    pid_t pid = 0;
+    char exe[64];
+    const char *default_binary;
+    bool attach = strncmp(argv[prog_idx], "-p", 3) == 0;
+    if (attach) {
+        if (argc <= prog_idx + 1 || (pid = atoi(argv[prog_idx + 1])) <= 0) {
+            usage_and_exit(1);
+        }
+        snprintf(exe, sizeof(exe), "/proc/%d/exe", pid);
+        default_binary = exe;
+    } else {
+        default_binary = argv[prog_idx];
+    }
+
+    for (int a = shmkey_idx + 1; a < prog_idx - 1; ++a) {
+        if (parse_function(argv[a], default_binary) < 0) {
+            usage_and_exit(1);
+        }
+    }
+
+    /* +1 for the 'dropped' event */
+    const char *names[probes_num + 1];
+    const char *signatures[probes_num + 1];
+    for (size_t p = 0; p < probes_num; ++p) {
+        names[p] = probes[p].spec.name;
+        signatures[p] = (const char *)probes[p].spec.signature;
+        warn("Registering event '%s' with signature '%s'\n", names[p],
+             signatures[p]);
+    }
+    names[probes_num] = "dropped";
+    signatures[probes_num] = "l";
+
+    /* Initialize the info about this source */
+    struct vms_source_control *control =
+        vms_source_control_define_pairwise(probes_num + 1, names, signatures);
+    assert(control);
+
+    const size_t capacity = 256;
+    shm = vms_shm_buffer_create(shmkey, capacity, control);
+    assert(shm);
+    free(control);
+
+    size_t events_num;
+    struct vms_event_record *events =
+        vms_shm_buffer_get_avail_events(shm, &events_num);
+    assert(events_num == probes_num + 1);
+
+    LIBBPF_OPTS(bpf_object_open_opts, open_opts);
+    struct funcall_bpf *obj = NULL;
+    struct ring_buffer *buffer = NULL;
+    int sync_fd = -1;
+    int err, ret = 1;
+
+    libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+
+    if (bpfsrc_open_opts(&open_opts) < 0) {
+        goto cleanup;
+    }
+
+    obj = funcall_bpf__open_opts(&open_opts);
+    if (!obj) {
+        warn("failed to open BPF object\n");
+        goto cleanup;
+    }
+
+    if (resolve_probes(obj) < 0) {
+        goto cleanup;
+    }
+
+    err = funcall_bpf__load(obj);
+    if (err) {
+        warn("failed to load BPF object: %s\n", strerror(-err));
+        goto cleanup;
+    }
+
+    buffer = ring_buffer__new(bpf_map__fd(obj->maps.buffer), handle_record,
+                              NULL, NULL);
+    if (!buffer) {
+        warn("Failed to create ring buffer\n");
+        goto cleanup;
+    }
+
+    if (!attach) {
+        if (signal(SIGCHLD, sig_chld) == SIG_ERR) {
+            warn("can't set SIGCHLD handler: %s\n", strerror(errno));
+            goto cleanup;
+        }
+        /* the program waits until we attach the probes */
+        sync_fd = bpfsrc_spawn(&argv[prog_idx], &pid);
+        if (sync_fd < 0) {
+            goto cleanup;
+        }
+    }
+
+    if (attach_probes(obj, pid) < 0) {
+        goto cleanup;
+    }
+
+    warn("info: waiting for the monitor to attach\n");
+    err = vms_shm_buffer_wait_for_reader(shm);
+    if (err < 0) {
+        warn("failed waiting: %s\n", strerror(-err));
+        goto cleanup;
+    }
+
+    for (size_t p = 0; p < probes_num; ++p) {
+        probes[p].spec.kind = events[p].kind;
+        probes[p].spec.size = signature_get_size(probes[p].spec.signature) +
+                              sizeof(vms_event_funcall);
+    }
+    dropped_kind = events[probes_num].kind;
+
+    if (signal(SIGINT, sig_int) == SIG_ERR) {
+        warn("can't set signal handler: %s\n", strerror(errno));
+        goto cleanup;
+    }
+
+    if (sync_fd != -1) {
+        err = bpfsrc_let_run(sync_fd);
+        sync_fd = -1;
+        if (err < 0) {
+            goto cleanup;
+        }
+    }
+
+    printf("Tracing calls...\n");
+    struct bpfsrc_consume_opts consume_opts = {
+        .poll_timeout_ms = poll_timeout_ms, .keep_running = keep_running};
+    bpfsrc_consume(buffer, &consume_opts);
+    ret = 0;
+
+    if (obj->bss->lost_total > 0) {
+        warn("info: lost %llu calls (%lu reported to the monitor)\n",
+             (unsigned long long)obj->bss->lost_total, lost_calls);
+    }
+
+cleanup:
+    if (sync_fd != -1) {
+        /* we failed before letting the program run */
+        kill(pid, SIGKILL);
+        close(sync_fd);
+    }
+    printf("Cleaning up...\n");
+    ring_buffer__free(buffer);
+    bpfsrc_detach_all();
+    funcall_bpf__destroy(obj);
+    warn("info: sent %lu events, busy waited on buffer %lu cycles\n",
+         last_event_id, waiting_for_buffer);
+    vms_shm_buffer_destroy(shm);
+    return ret;
+}
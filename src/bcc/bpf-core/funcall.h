@@ -0,0 +1,38 @@
+#ifndef __FUNCALL_H
+#define __FUNCALL_H
+
+/* The maximal number of traced probes (calls and returns) */
+#define MAX_PROBES 64
+
+/* We read the arguments that are passed in the general purpose registers */
+#define MAX_ARGS 6
+
+/* At most this many arguments of a call can be strings ('S'), every string
+ * is truncated to MAX_STR_LEN bytes (including the terminating 0) */
+#define MAX_STR_ARGS 2
+#define MAX_STR_LEN 128
+
+/* Size of the ring buffer */
+#define RINGBUF_SIZE (4096 * 64)
+
+/* What the BPF program needs to know about a probe */
+struct probe_spec {
+    /* bit i is set if the i-th argument is a string */
+    unsigned str_mask;
+};
+
+struct call_record {
+    /* the index of the probe, it is the BPF cookie of the probe */
+    unsigned probe;
+    unsigned pid;
+    unsigned tid;
+    /* the number of records that were lost before this one */
+    unsigned lost;
+    /* the arguments or the return value in args[0] */
+    unsigned long long args[MAX_ARGS];
+    /* the strings in the order of the arguments, only the used part of
+     * `str` is put into the ring buffer */
+    char str[MAX_STR_ARGS][MAX_STR_LEN];
+};
+
+#endif /* __FUNCALL_H */
@@ -0,0 +1,207 @@
+/*
+ * Generic loader of CO-RE BPF objects. It loads the object, attaches its
+ * programs and dumps the records from its ring buffer map `buffer`.
+ * Useful for trying out new BPF programs before they get their own source.
+ */
+
+#include <bpf/libbpf.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bpfsrc.h"
+
+#define warn(...) fprintf(stderr, __VA_ARGS__)
+
+static void usage_and_exit(int ret) {
+    warn(
+        "Usage: bpf-loader object.bpf.o [program[=binary:function] ...]\n"
+        "Attaches the given programs (all programs by default) and prints\n"
+        "the records from the ring buffer 'buffer' until interrupted.\n"
+        "Uprobes without a target in their section (SEC(\"uprobe\")) are\n"
+        "attached to the function given as program=binary:function, they\n"
+        "are skipped if no target is given.\n");
+    exit(ret);
+}
+
+static int handle_record(void *ctx, void *data, size_t len) {
+    const unsigned char *bytes = data;
+    printf("record of %lu bytes:", len);
+    for (size_t i = 0; i < len; ++i) {
+        if (i % 16 == 0)
+            printf("\n  ");
+        printf("%02x ", bytes[i]);
+    }
+    printf("\n  '");
+    for (size_t i = 0; i < len; ++i) {
+        putchar(isprint(bytes[i]) ? bytes[i] : '.');
+    }
+    printf("'\n");
+    return 0;
+}
+
+/* Is `prog` an uprobe (or uretprobe) with no target in its section? */
+static bool uprobe_without_target(const struct bpf_program *prog,
+                                  bool *retprobe) {
+    const char *sec = bpf_program__section_name(prog);
+    *retprobe = strncmp(sec, "uretprobe", 9) == 0;
+    return (*retprobe || strncmp(sec, "uprobe", 6) == 0) &&
+           !strchr(sec, '/');
+}
+
+/* Attach `prog`, `target` is "binary:function" for uprobes without
+ * a target or NULL */
+static int attach_program(struct bpf_object *obj, struct bpf_program *prog,
+                          const char *target) {
+    const char *name = bpf_program__name(prog);
+    bool retprobe;
+
+    if (!uprobe_without_target(prog, &retprobe)) {
+        if (target) {
+            warn("program '%s' does not take a target\n", name);
+            return -EINVAL;
+        }
+        return bpfsrc_attach(obj, name);
+    }
+
+    if (!target) {
+        warn("skipping uprobe '%s' with no target (use %s=binary:function)\n",
+             name, name);
+        return 0;
+    }
+
+    const char *colon = strrchr(target, ':');
+    if (!colon || colon == target || colon[1] == '\0') {
+        warn("invalid target '%s' of '%s', expected binary:function\n",
+             target, name);
+        return -EINVAL;
+    }
+
+    char *binary = strndup(target, colon - target);
+    if (!binary) {
+        return -ENOMEM;
+    }
+
+    size_t offset;
+    int err = bpfsrc_elf_symbol_offset(binary, colon + 1, &offset);
+    if (err == 0) {
+        err = bpfsrc_attach_uprobe(obj, name, -1, binary, offset, retprobe, 0);
+    }
+    free(binary);
+    return err;
+}
+
+static volatile sig_atomic_t running = 1;
+
+static void sig_int(int signo) { running = 0; }
+
+static bool keep_running(void *data) {
+    (void)data;
+    return running;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage_and_exit(1);
+    }
+
+    LIBBPF_OPTS(bpf_object_open_opts, open_opts);
+    struct ring_buffer *buffer = NULL;
+    const char **targets = NULL;
+    int ret = 1;
+    int err;
+
+    libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+
+    if (bpfsrc_open_opts(&open_opts) < 0) {
+        return 1;
+    }
+
+    struct bpf_object *obj = bpf_object__open_file(argv[1], &open_opts);
+    if (!obj) {
+        warn("failed opening BPF object '%s': %s\n", argv[1],
+             strerror(errno));
+        return 1;
+    }
+
+    /* the targets of the programs given as program=binary:function */
+    targets = calloc(argc, sizeof *targets);
+    if (!targets) {
+        warn("failed memory allocation\n");
+        goto cleanup;
+    }
+    for (int i = 2; i < argc; ++i) {
+        char *eq = strchr(argv[i], '=');
+        if (eq) {
+            *eq = '\0';
+            targets[i] = eq + 1;
+        }
+    }
+
+    /* load only the programs that we attach */
+    if (argc > 2) {
+        struct bpf_program *prog;
+        bpf_object__for_each_program(prog, obj) {
+            bpf_program__set_autoload(prog, false);
+        }
+        for (int i = 2; i < argc; ++i) {
+            if (bpfsrc_set_autoload(obj, argv[i], true) < 0)
+                goto cleanup;
+        }
+    }
+
+    err = bpf_object__load(obj);
+    if (err) {
+        warn("failed loading BPF object: %s\n", strerror(-err));
+        goto cleanup;
+    }
+
+    if (argc > 2) {
+        for (int i = 2; i < argc; ++i) {
+            struct bpf_program *prog =
+                bpf_object__find_program_by_name(obj, argv[i]);
+            if (attach_program(obj, prog, targets[i]) < 0)
+                goto cleanup;
+        }
+    } else {
+        struct bpf_program *prog;
+        bpf_object__for_each_program(prog, obj) {
+            if (!bpf_program__autoload(prog))
+                continue;
+            if (attach_program(obj, prog, NULL) < 0)
+                goto cleanup;
+        }
+    }
+
+    int map_fd = bpf_object__find_map_fd_by_name(obj, "buffer");
+    if (map_fd < 0) {
+        warn("the object has no ring buffer 'buffer'\n");
+        goto cleanup;
+    }
+
+    buffer = ring_buffer__new(map_fd, handle_record, NULL, NULL);
+    if (!buffer) {
+        warn("failed to create ring buffer\n");
+        goto cleanup;
+    }
+
+    if (signal(SIGINT, sig_int) == SIG_ERR) {
+        warn("can't set signal handler: %s\n", strerror(errno));
+        goto cleanup;
+    }
+
+    struct bpfsrc_consume_opts consume_opts = {
+        .poll_timeout_ms = 100, .keep_running = keep_running};
+    bpfsrc_consume(buffer, &consume_opts);
+    ret = 0;
+
+cleanup:
+    ring_buffer__free(buffer);
+    bpfsrc_detach_all();
+    bpf_object__close(obj);
+    free(targets);
+    return ret;
+}
@@ -9,72 +9,341 @@
 #include <bpf/bpf_tracing.h>
 #include <vmlinux.h>
 
-#include "maps.bpf.h"
-
-const volatile pid_t filter_pid = 0;
-size_t dropped = 0;
+/* Trace only processes in the `pids` map */
+const volatile bool filter_pids = false;
+/* Add children of traced processes to the `pids` map */
+const volatile bool follow_children = false;
+/* Use a ring buffer per CPU instead of the shared `buffer` */
+const volatile bool per_cpu_buffers = false;
+/* Wake up the consumer only when there is at least this many bytes
+ * in the ring buffer. If 0, let the kernel decide (wake up on every
+ * record that is submitted when the consumer has caught up). */
+const volatile __u64 wakeup_threshold = 0;
+/* The prefilter is used if literals_num > 0 */
+const volatile __u32 literals_num = 0;
+const volatile struct literal literals[MAX_LITERALS] = {};
+/* statistics of the prefilter */
+__u64 skipped_bytes = 0;
 
 struct {
     __uint(type, BPF_MAP_TYPE_RINGBUF);
-    __uint(max_entries, 4096 * 64);
+    __uint(max_entries, RINGBUF_SIZE);
 } buffer SEC(".maps");
 
+/* the arguments of the system calls that are captured on exit,
+ * keyed by pid_tgid */
+struct inflight {
+    int sc;
+    int fd;
+    /* the buffer or the array of iovecs */
+    const void *buf;
+    u64 iovcnt;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 10240);
+    __type(key, u64);
+    __type(value, struct inflight);
+} inflight SEC(".maps");
+
+/* the number of lost records per (pid, fd, sc) stream that were not
+ * reported yet */
+struct stream_key {
+    u32 pid;
+    u32 fd;
+    u32 sc;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 10240);
+    __type(key, struct stream_key);
+    __type(value, u64);
+} lost SEC(".maps");
+
+/* the total number of lost records */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, u64);
+} drops SEC(".maps");
+
+struct ringbuf_map {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, RINGBUF_SIZE);
+};
+
+/* per-CPU ring buffers, created and inserted by the userspace
+ * (max_entries is set to the number of CPUs before loading) */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __uint(max_entries, MAX_CPUS);
+    __type(key, u32);
+    __array(values, struct ringbuf_map);
+} buffers SEC(".maps");
+
+/* traced file descriptors */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_FDS);
+    __type(key, u32);
+    __type(value, u8);
+} fds SEC(".maps");
+
+/* traced processes (tgids) */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_PIDS);
+    __type(key, u32);
+    __type(value, u8);
+} pids SEC(".maps");
+
+/* ring buffer records must have a constant size when they are reserved,
+ * so we assemble the record here and copy only the used part into the
+ * ring buffer with bpf_ringbuf_output */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, struct event);
+} scratch SEC(".maps");
+
+/* Get the ring buffer to which this CPU writes */
+static __always_inline void *get_buffer(void) {
+    if (!per_cpu_buffers)
+        return &buffer;
+
+    u32 cpu = bpf_get_smp_processor_id();
+    return bpf_map_lookup_elem(&buffers, &cpu);
+}
+
+static __always_inline u64 submit_flags(void *rb) {
+    if (wakeup_threshold == 0)
+        return 0;
+
+    /* batch the wakeups, the consumer falls back to polling with
+     * a timeout, so the data that stay below the threshold are not
+     * stuck in the buffer forever */
+    if (bpf_ringbuf_query(rb, BPF_RB_AVAIL_DATA) >= wakeup_threshold)
+        return BPF_RB_FORCE_WAKEUP;
+    return BPF_RB_NO_WAKEUP;
+}
+
 struct loop_data {
     int fd;
+    int pid;
+    int sc;
     size_t count;
     const char *user_buf;
 };
 
-static long submit_events(u32 index, struct loop_data *ctx) {
-    size_t off = index * BUF_SIZE;
-    size_t len =
-        ((ctx->count - off) > BUF_SIZE) ? BUF_SIZE : (ctx->count - off);
+/* A record of the stream was lost, it is reported with the next record
+ * of the stream */
+static __always_inline void count_dropped(struct loop_data *ctx) {
+    u32 zero = 0;
+    u64 *total = bpf_map_lookup_elem(&drops, &zero);
+    if (total)
+        __sync_fetch_and_add(total, 1);
+
+    struct stream_key key = {.pid = ctx->pid, .fd = ctx->fd, .sc = ctx->sc};
+    u64 *n = bpf_map_lookup_elem(&lost, &key);
+    if (!n) {
+        u64 one = 1;
+        if (bpf_map_update_elem(&lost, &key, &one, BPF_NOEXIST) == 0)
+            return;
+        /* someone else inserted it in the meantime */
+        n = bpf_map_lookup_elem(&lost, &key);
+        if (!n)
+            return;
+    }
+    __sync_fetch_and_add(n, 1);
+}
 
-    struct event *event = bpf_ringbuf_reserve(&buffer, sizeof(struct event), 0);
-    if (!event) {
+/* Put the header and `len` bytes of data that are in event->buf into the
+ * ring buffer */
+static __always_inline int output_event(struct event *event,
+                                        struct loop_data *ctx, size_t off,
+                                        size_t len) {
+    if (len > MAX_CHUNK)
+        len = MAX_CHUNK;
+
+    void *rb = get_buffer();
+    if (!rb) {
+        count_dropped(ctx);
+        return -1;
+    }
+
+    struct stream_key key = {.pid = ctx->pid, .fd = ctx->fd, .sc = ctx->sc};
+    u64 *n = bpf_map_lookup_elem(&lost, &key);
+    u64 lost_before = n ? *n : 0;
+
+    event->hdr.lost = lost_before;
+    event->hdr.count = ctx->count - off;
+    event->hdr.fd = ctx->fd;
+    event->hdr.pid = ctx->pid;
+    event->hdr.sc = ctx->sc;
+    event->hdr.len = len;
+    event->hdr.off = off;
+    event->hdr.ts = bpf_ktime_get_ns();
+    if (bpf_ringbuf_output(rb, event, sizeof(event->hdr) + len,
+                           submit_flags(rb)) != 0) {
         bpf_printk("FAILED RESERVING SLOT IN BUFFER");
-        ++dropped;
-        return 1;
-    } else {
-        size_t dtmp = dropped;
-        if (dtmp > 0) {
-            event->count = dtmp;
-            event->len = -2;
-            event->off = 0;
-            dropped = 0;
-            bpf_ringbuf_submit(event, 0);
-            return 1;
-        }
+        count_dropped(ctx);
+        return -1;
     }
 
+    /* the drops that happened in the meantime stay in the counter */
+    if (lost_before > 0)
+        __sync_fetch_and_sub(n, lost_before);
+    return 0;
+}
+
+/* Read `len` bytes at `off` from the user buffer and submit them */
+static __always_inline int submit_chunk(struct event *event,
+                                        struct loop_data *ctx, size_t off,
+                                        size_t len) {
+    if (len > MAX_CHUNK)
+        len = MAX_CHUNK;
+
     int ret = bpf_probe_read_user(event->buf, len, ctx->user_buf + off);
     if (ret != 0) {
         bpf_printk("FAILED READING USER STRING");
-        bpf_ringbuf_discard(event, 0);
-        ++dropped;
+        count_dropped(ctx);
+        return -1;
+    }
+
+    return output_event(event, ctx, off, len);
+}
+
+static long submit_events(u32 index, struct loop_data *ctx) {
+    size_t off = (size_t)index * MAX_CHUNK;
+    if (off >= ctx->count)
+        return 1;
+
+    size_t len = ctx->count - off;
+    if (len > MAX_CHUNK)
+        len = MAX_CHUNK;
+
+    u32 zero = 0;
+    struct event *event = bpf_map_lookup_elem(&scratch, &zero);
+    if (!event)
+        return 1;
+
+    /* continue also if this chunk was lost, so that every lost
+     * chunk is counted */
+    submit_chunk(event, ctx, off, len);
+    return 0;
+}
+
+struct scan_data {
+    const char *buf;
+    u32 count;
+    int first_nl;
+    int last_nl;
+    bool hit;
+};
+
+/* Does any literal start at the position `pos`? Also remember where are the
+ * first and the last new lines. */
+static long scan_position(u32 pos, struct scan_data *d) {
+    if (pos >= d->count)
         return 1;
-    } else {
-        event->count = ctx->count - off;
-        event->fd = ctx->fd;
-        event->len = len;
-        event->off = off;
-        bpf_ringbuf_submit(event, 0);
+
+    const char *buf = d->buf;
+    if (buf[pos & (MAX_CHUNK - 1)] == '\n') {
+        if (d->first_nl < 0)
+            d->first_nl = pos;
+        d->last_nl = pos;
+    }
+
+    for (u32 i = 0; i < MAX_LITERALS; ++i) {
+        if (i >= literals_num)
+            break;
+        u32 len = literals[i].len;
+        if (len == 0 || len > MAX_LITERAL_LEN || pos + len > d->count)
+            continue;
+
+        bool eq = true;
+        for (u32 k = 0; k < MAX_LITERAL_LEN; ++k) {
+            if (k >= len)
+                break;
+            if (buf[(pos + k) & (MAX_CHUNK - 1)] != literals[i].str[k]) {
+                eq = false;
+                break;
+            }
+        }
+        if (eq) {
+            d->hit = true;
+            return 1;
+        }
     }
 
     return 0;
 }
 
+/*
+ * Submit the write only if it contains any of the literals. If it does not,
+ * no line that is entirely in this write can match, but the line that
+ * continues from the previous write and the line that continues in the next
+ * write can, so we still submit the data before the first and after the last
+ * new line. Returns false if the write was not handled (too big).
+ */
+static __always_inline bool prefilter(struct loop_data *ctx) {
+    size_t count = ctx->count;
+    if (count > MAX_CHUNK)
+        return false;
+
+    u32 zero = 0;
+    struct event *event = bpf_map_lookup_elem(&scratch, &zero);
+    if (!event)
+        return true;
+
+    if (bpf_probe_read_user(event->buf, count, ctx->user_buf) != 0) {
+        bpf_printk("FAILED READING USER STRING");
+        count_dropped(ctx);
+        return true;
+    }
+
+    struct scan_data data = {.buf = event->buf,
+                             .count = count,
+                             .first_nl = -1,
+                             .last_nl = -1,
+                             .hit = false};
+    bpf_loop(count, scan_position, &data, 0);
+
+    if (data.hit || data.first_nl < 0) {
+        /* the literal is there or all the data are a part of one line */
+        output_event(event, ctx, 0, count);
+        return true;
+    }
+
+    /* the end of the line from the previous write including the new line */
+    size_t head_len = data.first_nl + 1;
+    if (output_event(event, ctx, 0, head_len) < 0)
+        return true;
+
+    /* the start of the line continued in the next write */
+    size_t tail_off = data.last_nl + 1;
+    if (tail_off < count) {
+        submit_chunk(event, ctx, tail_off, count - tail_off);
+    }
+
+    __sync_fetch_and_add(&skipped_bytes, tail_off - head_len);
+    return true;
+}
+
 SEC("tracepoint/syscalls/sys_enter_write")
 int sys_write(struct trace_event_raw_sys_enter *ctx) {
-    pid_t pid = bpf_get_current_pid_tgid() >> 32;
-    pid_t req_pid = filter_pid;
+    u32 pid = bpf_get_current_pid_tgid() >> 32;
 
-    if (req_pid > 0 && pid != req_pid) {
+    if (filter_pids && !bpf_map_lookup_elem(&pids, &pid)) {
         return 0;
     }
 
-    int fd = ctx->args[0];
-    if (fd != 1) {
+    u32 fd = ctx->args[0];
+    if (!bpf_map_lookup_elem(&fds, &fd)) {
         return 0;  // not interested
     }
 
@@ -86,10 +355,163 @@ int sys_write(struct trace_event_raw_sys_enter *ctx) {
 
     bpf_printk("[PID %d] write(%d, %p, %lu).\n", pid, fd, user_buf, count);
 
-    struct loop_data data = {.fd = fd, .count = count, .user_buf = user_buf};
+    struct loop_data data = {.fd = fd,
+                             .pid = pid,
+                             .sc = SC_WRITE,
+                             .count = count,
+                             .user_buf = user_buf};
+
+    if (literals_num > 0 && prefilter(&data))
+        return 0;
+
+    bpf_loop((count + MAX_CHUNK - 1) / MAX_CHUNK, submit_events, &data, 0);
+
+    return 0;
+}
+
+/* The maximal number of iovecs of one readv/writev/sendmsg/recvmsg that
+ * we submit, the data in the rest of them are counted as dropped */
+#define MAX_IOVS 16
+
+static __always_inline bool is_vectored(int sc) {
+    return sc == SC_WRITEV || sc == SC_READV || sc == SC_SENDMSG ||
+           sc == SC_RECVMSG;
+}
+
+/* Remember the arguments of a system call whose data we submit on exit,
+ * when we know how many bytes were actually transferred */
+static __always_inline int syscall_enter(struct trace_event_raw_sys_enter *ctx,
+                                         int sc) {
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    u32 pid = pid_tgid >> 32;
+
+    if (filter_pids && !bpf_map_lookup_elem(&pids, &pid)) {
+        return 0;
+    }
+
+    u32 fd = ctx->args[0];
+    if (!bpf_map_lookup_elem(&fds, &fd)) {
+        return 0;
+    }
+
+    struct inflight in = {.sc = sc,
+                          .fd = fd,
+                          .buf = (const void *)ctx->args[1],
+                          .iovcnt = ctx->args[2]};
+    if (sc == SC_SENDMSG || sc == SC_RECVMSG) {
+        struct user_msghdr msg;
+        if (bpf_probe_read_user(&msg, sizeof(msg), (void *)ctx->args[1]) != 0)
+            return 0;
+        in.buf = msg.msg_iov;
+        in.iovcnt = msg.msg_iovlen;
+    }
+
+    bpf_map_update_elem(&inflight, &pid_tgid, &in, BPF_ANY);
+    return 0;
+}
+
+static __always_inline void submit_iovecs(struct loop_data *data,
+                                          const struct iovec *iov,
+                                          u64 iovcnt, size_t count) {
+    for (int i = 0; i < MAX_IOVS; ++i) {
+        if (i >= iovcnt || count == 0)
+            break;
 
-    bpf_loop((count / BUF_SIZE) + 1, submit_events, &data, 0);
+        struct iovec v;
+        if (bpf_probe_read_user(&v, sizeof(v), &iov[i]) != 0)
+            break;
+
+        size_t len = v.iov_len < count ? v.iov_len : count;
+        data->user_buf = v.iov_base;
+        data->count = len;
+        bpf_loop((len + MAX_CHUNK - 1) / MAX_CHUNK, submit_events, data, 0);
+        count -= len;
+    }
+
+    if (count > 0) {
+        count_dropped(data);
+    }
+}
+
+static __always_inline int syscall_exit(struct trace_event_raw_sys_exit *ctx) {
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    struct inflight *inp = bpf_map_lookup_elem(&inflight, &pid_tgid);
+    if (!inp)
+        return 0;
+
+    struct inflight in = *inp;
+    bpf_map_delete_elem(&inflight, &pid_tgid);
+
+    long ret = ctx->ret;
+    if (ret <= 0)
+        return 0;
+
+    struct loop_data data = {.fd = in.fd,
+                             .pid = pid_tgid >> 32,
+                             .sc = in.sc,
+                             .count = ret,
+                             .user_buf = in.buf};
+
+    if (is_vectored(in.sc)) {
+        submit_iovecs(&data, in.buf, in.iovcnt, ret);
+        return 0;
+    }
+
+    if (literals_num > 0 && prefilter(&data))
+        return 0;
+
+    bpf_loop((ret + MAX_CHUNK - 1) / MAX_CHUNK, submit_events, &data, 0);
+    return 0;
+}
+
+#define TRACE_SYSCALL(name, sc)                                       \
+    SEC("tracepoint/syscalls/sys_enter_" #name)                       \
+    int sys_enter_##name(struct trace_event_raw_sys_enter *ctx) {     \
+        return syscall_enter(ctx, sc);                                \
+    }                                                                 \
+    SEC("tracepoint/syscalls/sys_exit_" #name)                        \
+    int sys_exit_##name(struct trace_event_raw_sys_exit *ctx) {       \
+        return syscall_exit(ctx);                                     \
+    }
+
+TRACE_SYSCALL(read, SC_READ)
+TRACE_SYSCALL(writev, SC_WRITEV)
+TRACE_SYSCALL(readv, SC_READV)
+TRACE_SYSCALL(sendto, SC_SENDTO)
+TRACE_SYSCALL(recvfrom, SC_RECVFROM)
+TRACE_SYSCALL(sendmsg, SC_SENDMSG)
+TRACE_SYSCALL(recvmsg, SC_RECVMSG)
+
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(sched_fork, struct task_struct *parent, struct task_struct *child) {
+    if (!follow_children || !filter_pids)
+        return 0;
+
+    u32 parent_pid = parent->tgid;
+    u32 child_pid = child->tgid;
+    /* a new thread, not a process */
+    if (parent_pid == child_pid)
+        return 0;
+
+    if (bpf_map_lookup_elem(&pids, &parent_pid)) {
+        u8 one = 1;
+        bpf_map_update_elem(&pids, &child_pid, &one, BPF_ANY);
+    }
+    return 0;
+}
+
+SEC("tracepoint/sched/sched_process_exit")
+int sched_exit(void *ctx) {
+    if (!filter_pids)
+        return 0;
+
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    u32 pid = pid_tgid >> 32;
+    /* only the exit of the main thread ends the process */
+    if ((u32)pid_tgid != pid)
+        return 0;
 
+    bpf_map_delete_elem(&pids, &pid);
     return 0;
 }
 
@@ -2,16 +2,22 @@
 
 #include <assert.h>
 #include <bpf/bpf.h>
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "btf_helpers.h"
-#include "errno_helpers.h"
+#include "bpfsrc.h"
+#include "stats/stats.h"
 #include "syswrite.skel.h"
-#include "trace_helpers.h"
 #include "vamos-buffers/core/event.h"
 #include "vamos-buffers/core/signatures.h"
 #include "vamos-buffers/core/source.h"
@@ -22,22 +28,95 @@
 
 static void usage_and_exit(int ret) {
     warn(
-        "Usage: syswrite shmkey name expr sig [name expr sig] ... -- [program "
-        "arg1 arg2... | -p PID]\n");
+        "Usage: syswrite [options] shmkey name expr sig [name expr sig] ... -- "
+        "[program arg1 arg2... | -p PID]\n"
+        "Options:\n"
+        "  -t MS     how long to block waiting for data when the ring buffer\n"
+        "            is idle (default 100)\n"
+        "  -w BYTES  let the kernel wake us up only when the ring buffer has\n"
+        "            at least BYTES of data (default 0 = on every write)\n"
+        "  -f        filter out lines that cannot match in the kernel\n"
+        "            (using literals that must occur in the expressions)\n"
+        "  -F FD     trace writes to FD, can be given multiple times\n"
+        "            (default 1)\n"
+        "  -P PID    trace also the process PID, can be given multiple times\n"
+        "  -c        trace also children of the traced processes\n"
+        "  -T        prefix the arguments of every event with the pid and fd\n"
+        "            of the write (the signatures get 'ii' prepended)\n"
+        "  -C        use a ring buffer per CPU (the records are merged back\n"
+        "            into the global order in the userspace)\n"
+        "  -s LIST   comma-separated list of traced system calls (default\n"
+        "            write): write, read, writev, readv, sendto, recvfrom,\n"
+        "            sendmsg, recvmsg. Every system call has its own buffer,\n"
+        "            'write' uses shmkey, the others shmkey_<syscall>\n"
+        "  -b BYTES  with -p PID, the data are captured right away and\n"
+        "            at most BYTES of them are kept until the monitor\n"
+        "            attaches (default 16 MiB)\n"
+        "\n"
+        "Every buffer has also the event 'dropped' with signature 'l' (or 'iil'\n"
+        "with -T) that carries the number of lost chunks of the data. The line\n"
+        "that was being assembled when the data were lost is discarded.\n");
     exit(ret);
 }
 
+static int poll_timeout_ms = 100;
+static unsigned long wakeup_threshold = 0;
+static bool use_prefilter = false;
+static bool follow_children = false;
+static bool tag_events = false;
+static bool per_cpu_buffers = false;
+static unsigned long backlog_limit = 16 * 1024 * 1024;
+
+/* indexed by enum syscall_kind */
+static const char *syscall_names[SC_NUM] = {
+    "write", "read", "writev", "readv", "sendto", "recvfrom", "sendmsg",
+    "recvmsg"};
+/* bitmask of the traced syscalls */
+static unsigned traced_syscalls = 0;
+
+/* the event stream of one system call */
+struct stream {
+    vms_shm_buffer *shm;
+    struct vms_event_record *events;
+    size_t events_num;
+    struct vsrc_stream_stats *stats;
+};
+static struct stream streams[SC_NUM];
+static struct vsrc_stats_page *stats;
+
+#define MAX_CMDLINE_PIDS 64
+static int trace_fds[MAX_FDS];
+static size_t trace_fds_num = 0;
+static pid_t trace_pids[MAX_CMDLINE_PIDS];
+static size_t trace_pids_num = 0;
+
 #define MAXMATCH 20
 
 static size_t exprs_num;
-static size_t events_num;
 
 static char *tmpline = NULL;
 static size_t tmpline_len = 0;
 
-static char *current_line = NULL;
-static size_t current_line_alloc_len = 0;
-static size_t current_line_idx = 0;
+/* Writes of different processes and to different fds interleave,
+ * so we assemble the lines for each (pid, fd, syscall) separately */
+struct line_state {
+    int pid;
+    int fd;
+    int sc;
+    char *line;
+    size_t alloc_len;
+    size_t idx;
+    /* a part of the current line was lost, skip the rest of it */
+    bool skip;
+    /* records that did not fit into the backlog and records lost
+     * after them, not reported yet */
+    int backlog_lost;
+    int pending_lost;
+    struct line_state *next;
+};
+
+#define LINE_STATES_BUCKETS 256
+static struct line_state *line_states[LINE_STATES_BUCKETS];
 
 /*
 static int libbpf_print_fn(enum libbpf_print_level level, const char *format,
@@ -71,15 +150,52 @@ static size_t line_alloc_size(size_t x) {
     return n;
 }
 
+static struct line_state *get_line_state(int pid, int fd, int sc) {
+    unsigned h =
+        (((unsigned)pid * 31 + (unsigned)fd) * 31 + sc) % LINE_STATES_BUCKETS;
+    struct line_state *st = line_states[h];
+    while (st) {
+        if (st->pid == pid && st->fd == fd && st->sc == sc)
+            return st;
+        st = st->next;
+    }
+
+    st = calloc(1, sizeof(*st));
+    assert(st && "Allocation failed");
+    st->pid = pid;
+    st->fd = fd;
+    st->sc = sc;
+    st->next = line_states[h];
+    line_states[h] = st;
+    return st;
+}
+
+static void free_line_states(void) {
+    for (int i = 0; i < LINE_STATES_BUCKETS; ++i) {
+        struct line_state *st = line_states[i];
+        while (st) {
+            struct line_state *next = st->next;
+            free(st->line);
+            free(st);
+            st = next;
+        }
+        line_states[i] = NULL;
+    }
+}
+
 static regex_t *re;
 static char **signatures;
-struct vms_event_record *events;
 static size_t waiting_for_buffer;
 static shm_event ev;
 
-static vms_shm_buffer *shm;
+static size_t lost_chunks;
+static size_t skipped_lines;
 
-static void parse_line(bool iswrite, const struct event *e, char *line) {
+static void parse_line(bool iswrite, const struct event_header *e,
+                       char *line) {
+    vms_shm_buffer *shm = streams[e->sc].shm;
+    struct vms_event_record *events = streams[e->sc].events;
+    struct vsrc_stream_stats *stream_stats = streams[e->sc].stats;
     int status;
     signature_operand op;
     ssize_t len;
@@ -100,11 +216,18 @@ static void parse_line(bool iswrite, const struct event *e, char *line) {
 
         while (!(addr = vms_shm_buffer_start_push(shm))) {
             ++waiting_for_buffer;
+            vsrc_stats_add(stream_stats, VSRC_STATS_WAITS, 1);
         }
         /* push the base info about event */
         ++ev.id;
         ev.kind = events[i].kind;
         addr = vms_shm_buffer_partial_push(shm, addr, &ev, sizeof(ev));
+        if (tag_events) {
+            addr = vms_shm_buffer_partial_push(shm, addr, &e->pid,
+                                               sizeof(e->pid));
+            addr =
+                vms_shm_buffer_partial_push(shm, addr, &e->fd, sizeof(e->fd));
+        }
 
         /* push the arguments of the event */
         for (const char *o = signatures[i]; *o && m <= MAXMATCH; ++o, ++m) {
@@ -179,45 +302,311 @@ static void parse_line(bool iswrite, const struct event *e, char *line) {
             }
         }
         vms_shm_buffer_finish_push(shm);
+        /* the line is complete with the write in `e` */
+        vsrc_stats_published(stream_stats, e->ts);
     }
 }
 
-static int handle_event(void *ctx, void *data, size_t data_sz) {
-    const struct event *e = data;
-
-    if (e->len == -2) {
-        fprintf(stderr, "\033[31mDROPPED %d\033[0m\n", e->count);
-        return 0;
+/* Tell the monitor that `lost` records of the stream were lost */
+static void push_dropped(const struct event_header *e, int lost) {
+    struct stream *stream = &streams[e->sc];
+    vsrc_stats_add(stream->stats, VSRC_STATS_DROPS, lost);
+    /* the 'dropped' event is the last one */
+    if (stream->events[exprs_num].kind == 0)
+        return; /* monitor is not interested in this */
+
+    void *addr;
+    while (!(addr = vms_shm_buffer_start_push(stream->shm))) {
+        ++waiting_for_buffer;
+        vsrc_stats_add(stream->stats, VSRC_STATS_WAITS, 1);
     }
+    ++ev.id;
+    ev.kind = stream->events[exprs_num].kind;
+    addr = vms_shm_buffer_partial_push(stream->shm, addr, &ev, sizeof(ev));
+    if (tag_events) {
+        addr = vms_shm_buffer_partial_push(stream->shm, addr, &e->pid,
+                                           sizeof(e->pid));
+        addr = vms_shm_buffer_partial_push(stream->shm, addr, &e->fd,
+                                           sizeof(e->fd));
+    }
+    uint64_t n = lost;
+    addr = vms_shm_buffer_partial_push(stream->shm, addr, &n, sizeof(n));
+    vms_shm_buffer_finish_push(stream->shm);
+    vsrc_stats_published(stream->stats, e->ts);
+}
+
+static void process_record(const struct event_header *e, const char *buf) {
     /*
     fprintf(stderr, "fd: %d, len: %d, off: %d, count: %d,
     str:\n\033[34m'%*s'\033[0m\n", e->fd, e->len, e->off, e->count, e->len,
-    e->buf);
+    buf);
             */
 
-    for (size_t i = 0; i < e->len; ++i) {
-        if (current_line_idx >= current_line_alloc_len) {
-            current_line_alloc_len += line_alloc_size(e->len);
-            current_line = realloc(current_line, current_line_alloc_len);
-            assert(current_line && "Allocation failed");
+    if (e->sc < 0 || e->sc >= SC_NUM || !streams[e->sc].shm) {
+        warn("Invalid record: syscall %d\n", e->sc);
+        return;
+    }
+
+    vsrc_stats_add(streams[e->sc].stats, VSRC_STATS_BYTES, e->len);
+
+    struct line_state *st = get_line_state(e->pid, e->fd, e->sc);
+    int lost = e->lost + st->pending_lost;
+    st->pending_lost = 0;
+    if (lost > 0) {
+        lost_chunks += lost;
+        push_dropped(e, lost);
+        /* the line that we have been assembling misses some data and
+         * so does the line that continues in this record */
+        st->idx = 0;
+        st->skip = true;
+    }
+
+    for (int i = 0; i < e->len; ++i) {
+        if (st->skip) {
+            if (buf[i] == '\n' || buf[i] == '\0') {
+                st->skip = false;
+                ++skipped_lines;
+            }
+            continue;
+        }
+
+        if (st->idx >= st->alloc_len) {
+            st->alloc_len += line_alloc_size(e->len);
+            st->line = realloc(st->line, st->alloc_len);
+            assert(st->line && "Allocation failed");
         }
 
-        char c = e->buf[i];
+        char c = buf[i];
         if (c == '\n' || c == '\0') {
             /* temporary end */
-            assert(current_line_idx < current_line_alloc_len);
-            current_line[current_line_idx] = '\0';
+            assert(st->idx < st->alloc_len);
+            st->line[st->idx] = '\0';
             /* start new line */
-            current_line_idx = 0;
+            st->idx = 0;
 
-            parse_line(true, e, current_line);
+            parse_line(true, e, st->line);
             continue;
         }
 
-        assert(current_line_idx < current_line_alloc_len);
-        current_line[current_line_idx++] = c;
+        assert(st->idx < st->alloc_len);
+        st->line[st->idx++] = c;
+    }
+}
+
+/*
+ * When attaching to a running process, we capture the data from the start
+ * but cannot push them before the monitor attaches (we do not even know
+ * what events it is interested in). Until then, the records are kept in the
+ * backlog. Once the backlog is full, the records are dropped until it is
+ * drained, and the drops are reported with the first record of each stream
+ * after the backlog.
+ */
+static atomic_bool monitor_ready = true;
+
+struct backlog_record {
+    struct backlog_record *next;
+    struct event_header hdr;
+    /* followed by hdr.len bytes of data */
+};
+
+static struct backlog_record *backlog_head = NULL;
+static struct backlog_record *backlog_tail = NULL;
+static size_t backlog_size = 0;
+static bool backlog_full = false;
+static size_t backlog_dropped = 0;
+
+static void backlog_push(const struct event_header *e) {
+    size_t size = sizeof(struct backlog_record) + e->len;
+    if (backlog_full || backlog_size + size > backlog_limit) {
+        backlog_full = true;
+        ++backlog_dropped;
+        if (e->sc >= 0 && e->sc < SC_NUM) {
+            struct line_state *st = get_line_state(e->pid, e->fd, e->sc);
+            st->backlog_lost += 1 + e->lost;
+        }
+        return;
+    }
+
+    struct backlog_record *r = malloc(size);
+    assert(r && "Allocation failed");
+    r->next = NULL;
+    memcpy(&r->hdr, e, sizeof(*e) + e->len);
+    if (backlog_tail) {
+        backlog_tail->next = r;
+    } else {
+        backlog_head = r;
     }
+    backlog_tail = r;
+    backlog_size += size;
+}
 
+static void drain_backlog(void) {
+    while (backlog_head) {
+        struct backlog_record *r = backlog_head;
+        backlog_head = r->next;
+        process_record(&r->hdr, (const char *)(&r->hdr + 1));
+        free(r);
+    }
+    backlog_tail = NULL;
+    backlog_size = 0;
+
+    if (backlog_full) {
+        /* the losses go after everything that was in the backlog */
+        for (int i = 0; i < LINE_STATES_BUCKETS; ++i) {
+            for (struct line_state *st = line_states[i]; st; st = st->next) {
+                st->pending_lost += st->backlog_lost;
+                st->backlog_lost = 0;
+            }
+        }
+        backlog_full = false;
+    }
+}
+
+static void free_backlog(void) {
+    while (backlog_head) {
+        struct backlog_record *r = backlog_head;
+        backlog_head = r->next;
+        free(r);
+    }
+}
+
+static void process_event(const struct event_header *e, const char *buf) {
+    if (!atomic_load_explicit(&monitor_ready, memory_order_acquire)) {
+        backlog_push(e);
+        return;
+    }
+
+    if (backlog_head || backlog_full) {
+        drain_backlog();
+    }
+    process_record(e, buf);
+}
+
+/*
+ * With per-CPU buffers, the records are copied into a min-heap ordered by
+ * their timestamps (ties are broken by the CPU and the order in which the
+ * records arrived, which keeps the order of records of one CPU). After every
+ * round, the buffers are drained once more and the records that are older
+ * than the moment when we started draining (minus MERGE_SLACK_NS for the
+ * records that are being written right now) are processed: every record
+ * that could come before them is in the heap already. A record that comes
+ * later than that is processed out of order (and counted).
+ */
+#define MERGE_MAX_PENDING 65536
+#define MERGE_SLACK_NS 100000ULL
+
+struct pending_record {
+    unsigned long long order;
+    int cpu;
+    /* followed by the data of the record */
+    struct event_header hdr;
+};
+
+static struct pending_record **pending = NULL;
+static size_t pending_num = 0;
+static size_t pending_alloc = 0;
+static unsigned long long arrived_records = 0;
+static unsigned long long last_merged_ts = 0;
+static size_t late_records = 0;
+
+static bool pending_before(const struct pending_record *a,
+                           const struct pending_record *b) {
+    if (a->hdr.ts != b->hdr.ts)
+        return a->hdr.ts < b->hdr.ts;
+    if (a->cpu != b->cpu)
+        return a->cpu < b->cpu;
+    return a->order < b->order;
+}
+
+static void pending_push(struct pending_record *r) {
+    if (pending_num == pending_alloc) {
+        pending_alloc = pending_alloc ? 2 * pending_alloc : 256;
+        pending = realloc(pending, pending_alloc * sizeof(*pending));
+        assert(pending && "Allocation failed");
+    }
+
+    size_t i = pending_num++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!pending_before(r, pending[parent]))
+            break;
+        pending[i] = pending[parent];
+        i = parent;
+    }
+    pending[i] = r;
+}
+
+static struct pending_record *pending_pop(void) {
+    struct pending_record *top = pending[0];
+    struct pending_record *last = pending[--pending_num];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= pending_num)
+            break;
+        if (child + 1 < pending_num &&
+            pending_before(pending[child + 1], pending[child]))
+            ++child;
+        if (!pending_before(pending[child], last))
+            break;
+        pending[i] = pending[child];
+        i = child;
+    }
+    if (pending_num > 0)
+        pending[i] = last;
+    return top;
+}
+
+/* Process the pending records with the timestamp up to `limit` */
+static void merge_pending(unsigned long long limit) {
+    while (pending_num > 0) {
+        struct pending_record *r = pending[0];
+        if (r->hdr.ts > limit && pending_num < MERGE_MAX_PENDING)
+            return;
+
+        pending_pop();
+        if (r->hdr.ts < last_merged_ts)
+            ++late_records;
+        else
+            last_merged_ts = r->hdr.ts;
+        process_event(&r->hdr, (const char *)(&r->hdr + 1));
+        free(r);
+    }
+}
+
+static void free_pending(void) {
+    while (pending_num > 0) {
+        free(pending_pop());
+    }
+    free(pending);
+}
+
+static int handle_event(void *ctx, void *data, size_t data_sz) {
+    const struct event_header *e = data;
+
+    if (data_sz < sizeof(*e)) {
+        warn("Invalid record of size %lu\n", data_sz);
+        return 0;
+    }
+
+    if (e->len < 0 || data_sz < sizeof(*e) + e->len) {
+        warn("Invalid record: len %d, size %lu\n", e->len, data_sz);
+        return 0;
+    }
+
+    if (per_cpu_buffers) {
+        /* `ctx` is the CPU of the buffer */
+        struct pending_record *r =
+            malloc(offsetof(struct pending_record, hdr) + data_sz);
+        assert(r && "Allocation failed");
+        r->order = arrived_records++;
+        r->cpu = (int)(intptr_t)ctx;
+        memcpy(&r->hdr, data, data_sz);
+        pending_push(r);
+        return 0;
+    }
+
+    process_event(e, (const char *)data + sizeof(*e));
     return 0;
 }
 
@@ -228,8 +617,130 @@ void sig_int(int signo) { running = 0; }
 
 void sig_chld(int signo) { child_running = 0; }
 
+static atomic_bool monitor_failed = false;
+
+/* Wait for the monitor in a separate thread while the main thread keeps
+ * consuming the data */
+static void *wait_for_monitor(void *arg) {
+    (void)arg;
+    for (int sc = 0; sc < SC_NUM; ++sc) {
+        if (!streams[sc].shm)
+            continue;
+        int err = vms_shm_buffer_wait_for_reader(streams[sc].shm);
+        if (err < 0) {
+            if (err != EINTR) {
+                warn("failed waiting: %s\n", strerror(-err));
+            }
+            atomic_store(&monitor_failed, true);
+            return NULL;
+        }
+    }
+    warn("info: monitor attached\n");
+    atomic_store_explicit(&monitor_ready, true, memory_order_release);
+    return NULL;
+}
+
+/* index of shmkey in argv, it follows the options */
+static int shmkey_idx = 1;
+
+static int parse_syscalls(const char *list) {
+    const char *p = list;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        int sc = 0;
+        for (; sc < SC_NUM; ++sc) {
+            if (strlen(syscall_names[sc]) == len &&
+                strncmp(p, syscall_names[sc], len) == 0)
+                break;
+        }
+        if (sc == SC_NUM) {
+            warn("Unknown system call: %.*s\n", (int)len, p);
+            return -1;
+        }
+        traced_syscalls |= 1U << sc;
+        p += len;
+        if (*p == ',')
+            ++p;
+    }
+    return 0;
+}
+
+static int parse_opt_num(int argc, char *argv[], int i, unsigned long *val) {
+    char *end;
+    if (i + 1 >= argc) {
+        warn("Missing a value for %s\n", argv[i]);
+        return -1;
+    }
+    *val = strtoul(argv[i + 1], &end, 10);
+    if (*end != '\0') {
+        warn("Invalid value for %s: %s\n", argv[i], argv[i + 1]);
+        return -1;
+    }
+    return 0;
+}
+
 int parse_args(int argc, char *argv[]) {
     int i = 1;
+    unsigned long val;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (strncmp(argv[i], "--", 3) == 0) {
+            return -1;
+        }
+
+        if (strncmp(argv[i], "-f", 3) == 0) {
+            use_prefilter = true;
+            continue;
+        }
+        if (strncmp(argv[i], "-c", 3) == 0) {
+            follow_children = true;
+            continue;
+        }
+        if (strncmp(argv[i], "-T", 3) == 0) {
+            tag_events = true;
+            continue;
+        }
+        if (strncmp(argv[i], "-C", 3) == 0) {
+            per_cpu_buffers = true;
+            continue;
+        }
+        if (strncmp(argv[i], "-s", 3) == 0) {
+            if (i + 1 >= argc || parse_syscalls(argv[i + 1]) < 0) {
+                return -1;
+            }
+            ++i;
+            continue;
+        }
+
+        if (parse_opt_num(argc, argv, i, &val) < 0) {
+            return -1;
+        }
+        if (strncmp(argv[i], "-t", 3) == 0) {
+            poll_timeout_ms = (int)val;
+        } else if (strncmp(argv[i], "-w", 3) == 0) {
+            wakeup_threshold = val;
+        } else if (strncmp(argv[i], "-F", 3) == 0) {
+            if (trace_fds_num == MAX_FDS) {
+                warn("Too many fds, at most %d can be traced\n", MAX_FDS);
+                return -1;
+            }
+            trace_fds[trace_fds_num++] = (int)val;
+        } else if (strncmp(argv[i], "-b", 3) == 0) {
+            backlog_limit = val;
+        } else if (strncmp(argv[i], "-P", 3) == 0) {
+            if (trace_pids_num == MAX_CMDLINE_PIDS) {
+                warn("Too many pids, at most %d can be given\n",
+                     MAX_CMDLINE_PIDS);
+                return -1;
+            }
+            trace_pids[trace_pids_num++] = (pid_t)val;
+        } else {
+            warn("Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+        ++i; /* skip the value */
+    }
+    shmkey_idx = i;
+
     for (; i < argc; ++i) {
         if (strncmp(argv[i], "--", 3) == 0) {
             break;
@@ -238,11 +749,336 @@ int parse_args(int argc, char *argv[]) {
     if (i == argc)
         return -1;
 
-    exprs_num = (i - 2) / 3;
+    exprs_num = (i - shmkey_idx - 1) / 3;
     return i + 1;
 }
 
-static const int CAN_CONTINUE = 0xbee;
+/* Skip the bracket expression that starts at re[i] == '[',
+ * return the index of the closing ']' */
+static size_t skip_bracket(const char *re, size_t i) {
+    ++i;
+    if (re[i] == '^')
+        ++i;
+    if (re[i] == ']')
+        ++i;
+    while (re[i] && re[i] != ']') {
+        if (re[i] == '[' && (re[i + 1] == ':' || re[i + 1] == '.' ||
+                             re[i + 1] == '=')) {
+            char delim = re[i + 1];
+            i += 2;
+            while (re[i] && !(re[i] == delim && re[i + 1] == ']'))
+                ++i;
+            if (re[i])
+                ++i;
+        }
+        if (re[i])
+            ++i;
+    }
+    return re[i] ? i : i - 1;
+}
+
+/* Skip the group that starts at re[i] == '(',
+ * return the index of the closing ')' */
+static size_t skip_group(const char *re, size_t i) {
+    int depth = 0;
+    for (; re[i]; ++i) {
+        if (re[i] == '\\' && re[i + 1]) {
+            ++i;
+        } else if (re[i] == '[') {
+            i = skip_bracket(re, i);
+        } else if (re[i] == '(') {
+            ++depth;
+        } else if (re[i] == ')') {
+            if (--depth == 0)
+                return i;
+        }
+    }
+    return i - 1;
+}
+
+/*
+ * Find the longest string that occurs in every match of the extended regular
+ * expression `re`. Only the top-level literal characters are taken into
+ * account, anything else just ends the current string. Returns the length
+ * of the string (0 if there is none). At most `maxlen` characters are
+ * copied to `out`, a prefix of the string must occur in every match too.
+ */
+static size_t required_literal(const char *re, char *out, size_t maxlen) {
+    size_t n = strlen(re);
+    char *cur = malloc(n + 1);
+    char *best = malloc(n + 1);
+    assert(cur && best && "Allocation failed");
+    size_t cur_len = 0, best_len = 0;
+
+#define FLUSH()                         \
+    do {                                \
+        if (cur_len > best_len) {       \
+            memcpy(best, cur, cur_len); \
+            best_len = cur_len;         \
+        }                               \
+        cur_len = 0;                    \
+    } while (0)
+
+    for (size_t i = 0; i < n; ++i) {
+        char c = re[i];
+        switch (c) {
+            case '|':
+                /* alternatives on the top-level, there is no required
+                 * literal (unless all alternatives share it, but we do not
+                 * bother) */
+                best_len = cur_len = 0;
+                goto out;
+            case '(':
+                FLUSH();
+                i = skip_group(re, i);
+                continue;
+            case '[':
+                FLUSH();
+                i = skip_bracket(re, i);
+                continue;
+            case '.':
+            case '^':
+            case '$':
+            case '+': /* the previous character is there at least once */
+                FLUSH();
+                continue;
+            case '*':
+            case '?':
+                /* the previous character is optional */
+                if (cur_len > 0)
+                    --cur_len;
+                FLUSH();
+                continue;
+            case '{':
+                if (re[i + 1] == '0' || re[i + 1] == ',') {
+                    if (cur_len > 0)
+                        --cur_len;
+                }
+                FLUSH();
+                while (re[i] && re[i] != '}')
+                    ++i;
+                continue;
+            case '\\':
+                ++i;
+                if (i >= n || isalnum((unsigned char)re[i])) {
+                    /* a character class, back-reference, ... */
+                    FLUSH();
+                    continue;
+                }
+                c = re[i];
+                break;
+        }
+        cur[cur_len++] = c;
+    }
+    FLUSH();
+#undef FLUSH
+
+out:
+    if (best_len > 0) {
+        memcpy(out, best, best_len < maxlen ? best_len : maxlen);
+    }
+    free(cur);
+    free(best);
+    return best_len < maxlen ? best_len : maxlen;
+}
+
+/* Set up the literals for the in-kernel prefilter. Returns the number of
+ * literals, 0 if the prefilter cannot be used. */
+static size_t setup_prefilter(struct syswrite_bpf *obj, char *exprs[]) {
+    if (exprs_num > MAX_LITERALS) {
+        warn("warning: too many expressions for the prefilter, disabling it\n");
+        return 0;
+    }
+
+    char lit[MAX_LITERAL_LEN];
+    for (size_t i = 0; i < exprs_num; ++i) {
+        size_t len = required_literal(exprs[i], lit, MAX_LITERAL_LEN);
+        if (len == 0) {
+            warn("warning: found no literal in '%s', disabling the prefilter\n",
+                 exprs[i]);
+            return 0;
+        }
+        warn("info: prefilter literal for '%s': '%.*s'\n", exprs[i], (int)len,
+             lit);
+        obj->rodata->literals[i].len = len;
+        memcpy((char *)obj->rodata->literals[i].str, lit, len);
+    }
+
+    obj->rodata->literals_num = exprs_num;
+    return exprs_num;
+}
+
+/* Put the traced fds and pids into the BPF maps */
+static int setup_filters(struct syswrite_bpf *obj, pid_t filter_pid) {
+    const uint8_t one = 1;
+    int fds_fd = bpf_map__fd(obj->maps.fds);
+    for (size_t i = 0; i < trace_fds_num; ++i) {
+        uint32_t fd = trace_fds[i];
+        if (bpf_map_update_elem(fds_fd, &fd, &one, BPF_ANY) < 0)
+            return -errno;
+    }
+
+    int pids_fd = bpf_map__fd(obj->maps.pids);
+    if (filter_pid > 0) {
+        uint32_t pid = filter_pid;
+        if (bpf_map_update_elem(pids_fd, &pid, &one, BPF_ANY) < 0)
+            return -errno;
+    }
+    for (size_t i = 0; i < trace_pids_num; ++i) {
+        uint32_t pid = trace_pids[i];
+        if (bpf_map_update_elem(pids_fd, &pid, &one, BPF_ANY) < 0)
+            return -errno;
+    }
+    return 0;
+}
+
+/* Load only the programs for the traced system calls */
+static void setup_autoload(struct syswrite_bpf *obj) {
+    char name[64];
+    bpfsrc_set_autoload(obj->obj, "sys_write",
+                        traced_syscalls & (1U << SC_WRITE));
+    for (int sc = SC_WRITE + 1; sc < SC_NUM; ++sc) {
+        bool load = traced_syscalls & (1U << sc);
+        snprintf(name, sizeof(name), "sys_enter_%s", syscall_names[sc]);
+        bpfsrc_set_autoload(obj->obj, name, load);
+        snprintf(name, sizeof(name), "sys_exit_%s", syscall_names[sc]);
+        bpfsrc_set_autoload(obj->obj, name, load);
+    }
+}
+
+static int attach_syscalls(struct syswrite_bpf *obj) {
+    char name[64];
+    int err;
+    if (traced_syscalls & (1U << SC_WRITE)) {
+        if ((err = bpfsrc_attach(obj->obj, "sys_write")))
+            return err;
+    }
+
+    for (int sc = SC_WRITE + 1; sc < SC_NUM; ++sc) {
+        if (!(traced_syscalls & (1U << sc)))
+            continue;
+
+        /* attach the exit first so that we do not miss it */
+        snprintf(name, sizeof(name), "sys_exit_%s", syscall_names[sc]);
+        if ((err = bpfsrc_attach(obj->obj, name)))
+            return err;
+        snprintf(name, sizeof(name), "sys_enter_%s", syscall_names[sc]);
+        if ((err = bpfsrc_attach(obj->obj, name)))
+            return err;
+    }
+
+    if (obj->rodata->filter_pids) {
+        /* forget the processes that exited, their pids can be reused */
+        if ((err = bpfsrc_attach(obj->obj, "sched_exit")))
+            return err;
+    }
+
+    if (follow_children) {
+        if ((err = bpfsrc_attach(obj->obj, "sched_fork")))
+            return err;
+    }
+    return 0;
+}
+
+/* Print how many records were lost in total */
+static void report_drops(struct syswrite_bpf *obj) {
+    int ncpus = libbpf_num_possible_cpus();
+    if (ncpus <= 0)
+        return;
+
+    uint64_t values[ncpus];
+    uint32_t zero = 0;
+    if (bpf_map_lookup_elem(bpf_map__fd(obj->maps.drops), &zero, values) < 0)
+        return;
+
+    uint64_t total = 0;
+    for (int cpu = 0; cpu < ncpus; ++cpu) {
+        total += values[cpu];
+    }
+    if (total > 0 || lost_chunks > 0) {
+        warn("info: lost %llu chunks of data (%lu reported to the monitor), "
+             "skipped %lu incomplete lines\n",
+             (unsigned long long)total, lost_chunks, skipped_lines);
+    }
+}
+
+static int *cpu_buffer_fds = NULL;
+static int cpu_buffers_num = 0;
+
+/* Create a ring buffer for every CPU, put them into the `buffers` map and
+ * register them all in one ring_buffer manager */
+static struct ring_buffer *setup_per_cpu_buffers(struct syswrite_bpf *obj) {
+    struct ring_buffer *rb = NULL;
+    int outer_fd = bpf_map__fd(obj->maps.buffers);
+
+    cpu_buffer_fds = malloc(cpu_buffers_num * sizeof(int));
+    assert(cpu_buffer_fds && "Allocation failed");
+    for (int cpu = 0; cpu < cpu_buffers_num; ++cpu) {
+        cpu_buffer_fds[cpu] = -1;
+    }
+
+    for (int cpu = 0; cpu < cpu_buffers_num; ++cpu) {
+        int fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, NULL, 0, 0, RINGBUF_SIZE,
+                                NULL);
+        if (fd < 0) {
+            warn("failed creating ring buffer for CPU %d: %s\n", cpu,
+                 strerror(errno));
+            goto fail;
+        }
+        cpu_buffer_fds[cpu] = fd;
+
+        uint32_t key = cpu;
+        if (bpf_map_update_elem(outer_fd, &key, &fd, BPF_ANY) < 0) {
+            warn("failed inserting ring buffer for CPU %d: %s\n", cpu,
+                 strerror(errno));
+            goto fail;
+        }
+
+        if (!rb) {
+            rb = ring_buffer__new(fd, handle_event, (void *)(intptr_t)cpu,
+                                  NULL);
+            if (!rb)
+                goto fail;
+        } else if (ring_buffer__add(rb, fd, handle_event,
+                                    (void *)(intptr_t)cpu) < 0) {
+            goto fail;
+        }
+    }
+    return rb;
+
+fail:
+    ring_buffer__free(rb);
+    return NULL;
+}
+
+static void close_per_cpu_buffers(void) {
+    if (!cpu_buffer_fds)
+        return;
+    for (int cpu = 0; cpu < cpu_buffers_num; ++cpu) {
+        if (cpu_buffer_fds[cpu] >= 0)
+            close(cpu_buffer_fds[cpu]);
+    }
+    free(cpu_buffer_fds);
+}
+
+static bool keep_running(void *data) {
+    (void)data;
+    return running && child_running && !atomic_load(&monitor_failed);
+}
+
+static void after_round(void *data) {
+    if (per_cpu_buffers) {
+        /* everything written before `started` is in the heap after this */
+        unsigned long long started = vsrc_stats_now_ns();
+        ring_buffer__consume((struct ring_buffer *)data);
+        merge_pending(started - MERGE_SLACK_NS);
+    }
+
+    if (backlog_head &&
+        atomic_load_explicit(&monitor_ready, memory_order_acquire)) {
+        drain_backlog();
+    }
+}
 
 int main(int argc, char *argv[]) {
     int prog_idx = parse_args(argc, argv);
@@ -250,14 +1086,23 @@ int main(int argc, char *argv[]) {
         usage_and_exit(1);
     }
 
-    const char *shmkey = argv[1];
+    const char *shmkey = argv[shmkey_idx];
     char *exprs[exprs_num];
-    char *names[exprs_num];
+    /* +1 for the 'dropped' event */
+    char *names[exprs_num + 1];
+    char *control_signatures[exprs_num + 1];
+
+    if (trace_fds_num == 0) {
+        trace_fds[trace_fds_num++] = 1;
+    }
+    if (traced_syscalls == 0) {
+        traced_syscalls = 1U << SC_WRITE;
+    }
 
     signatures = malloc(sizeof(char *) * exprs_num);
     re = malloc(exprs_num * sizeof(regex_t));
 
-    int arg_i = 2;
+    int arg_i = shmkey_idx + 1;
     for (int i = 0; i < (int)exprs_num; ++i) {
         names[i] = (char *)argv[arg_i++];
         exprs[i] = (char *)argv[arg_i++];
@@ -266,6 +1111,15 @@ int main(int argc, char *argv[]) {
             usage_and_exit(1);
         }
         signatures[i] = (char *)argv[arg_i++];
+        if (tag_events) {
+            /* pid and fd come before the arguments from the line */
+            control_signatures[i] = malloc(strlen(signatures[i]) + 3);
+            assert(control_signatures[i] && "Allocation failed");
+            strcpy(control_signatures[i], "ii");
+            strcat(control_signatures[i], signatures[i]);
+        } else {
+            control_signatures[i] = signatures[i];
+        }
 
         /* compile the regex, use extended RE */
         int status = regcomp(&re[i], exprs[i], REG_EXTENDED);
@@ -276,21 +1130,44 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    names[exprs_num] = "dropped";
+    control_signatures[exprs_num] = tag_events ? "iil" : "l";
+
     /* Initialize the info about this source */
     struct vms_source_control *control = vms_source_control_define_pairwise(
-        exprs_num, (const char **)names, (const char **)signatures);
+        exprs_num + 1, (const char **)names, (const char **)control_signatures);
     assert(control);
+    if (tag_events) {
+        for (int i = 0; i < (int)exprs_num; ++i) {
+            free(control_signatures[i]);
+        }
+    }
+
+    stats = vsrc_stats_create(shmkey, "syswrite");
 
     size_t max_size = source_control_max_event_size(control);
     if (max_size < sizeof(shm_event_dropped))
         max_size = sizeof(shm_event_dropped);
-    shm = vms_shm_buffer_create(shmkey, max_size, control);
-    assert(shm);
-    events = vms_shm_buffer_get_avail_events(shm, &events_num);
+    for (int sc = 0; sc < SC_NUM; ++sc) {
+        if (!(traced_syscalls & (1U << sc)))
+            continue;
+
+        char key[strlen(shmkey) + 16];
+        if (sc == SC_WRITE) {
+            strcpy(key, shmkey);
+        } else {
+            snprintf(key, sizeof(key), "%s_%s", shmkey, syscall_names[sc]);
+        }
+        streams[sc].shm = vms_shm_buffer_create(key, max_size, control);
+        assert(streams[sc].shm);
+        streams[sc].stats = vsrc_stats_add_stream(stats, key);
+        streams[sc].events = vms_shm_buffer_get_avail_events(
+            streams[sc].shm, &streams[sc].events_num);
+    }
     free(control);
 
     pid_t filter_pid = 0;
-    int fork_sync[2] = {-1, -1};
+    int sync_fd = -1;
     if (strncmp(argv[prog_idx], "-p", 3) == 0) {
         if (argc <= prog_idx + 1) {
             usage_and_exit(1);
@@ -299,52 +1176,15 @@ int main(int argc, char *argv[]) {
             usage_and_exit(1);
         }
     } else { /* spawn the program */
-        if (pipe(fork_sync) < 0) {
-            perror("pipe");
-            exit(1);
-        }
-
         if (signal(SIGCHLD, sig_chld) == SIG_ERR) {
             warn("can't set SIGCHLD handler: %s\n", strerror(errno));
-            goto cleanup_core;
-        }
-
-        filter_pid = fork();
-        if (filter_pid < 0) {
-            perror("fork");
             exit(1);
         }
 
-        if (filter_pid == 0) { /* child */
-            close(fork_sync[1]);
-            int val = 0;
-            while (val != CAN_CONTINUE) {
-                if (read(fork_sync[0], &val, sizeof(int)) < 0) {
-                    perror("syncing child process");
-                    exit(1);
-                }
-            }
-            char **nargv = malloc((argc - prog_idx) + 1);
-            assert(nargv && "Allocation failed");
-            int n = 0;
-            for (int i = prog_idx; i < argc; ++i) {
-                warn("  spawn arg %d: %s\n", n, argv[i]);
-                nargv[n++] = strdup(argv[i]);
-                assert(nargv[n - 1] && "Allocation failed");
-            }
-            nargv[n] = 0;
-
-            if (execve(argv[prog_idx], nargv, NULL) < 0) {
-                perror("execve");
-                warn("\033[31mFailed spawning the program...\033[0m\n");
-                exit(1);
-            }
-            assert(0 && "Unreachable after execve");
+        sync_fd = bpfsrc_spawn(&argv[prog_idx], &filter_pid);
+        if (sync_fd < 0) {
+            exit(1);
         }
-
-        warn("Spawned pid %d\n", filter_pid);
-
-        close(fork_sync[0]);
     }
 
     LIBBPF_OPTS(bpf_object_open_opts, open_opts);
@@ -354,10 +1194,8 @@ int main(int argc, char *argv[]) {
     libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
     // libbpf_set_print(libbpf_print_fn);
 
-    err = ensure_core_btf(&open_opts);
+    err = bpfsrc_open_opts(&open_opts);
     if (err) {
-        fprintf(stderr, "failed to fetch necessary BTF for CO-RE: %s\n",
-                strerror(-err));
         return 1;
     }
 
@@ -365,11 +1203,26 @@ int main(int argc, char *argv[]) {
     if (!obj) {
         warn("failed to open BPF object\n");
         err = 1;
-        goto cleanup_core;
+        goto cleanup;
     }
 
-    if (filter_pid > 0)
-        obj->rodata->filter_pid = filter_pid;
+    obj->rodata->filter_pids = filter_pid > 0 || trace_pids_num > 0;
+    obj->rodata->follow_children = follow_children;
+    obj->rodata->wakeup_threshold = wakeup_threshold;
+    if (per_cpu_buffers) {
+        cpu_buffers_num = libbpf_num_possible_cpus();
+        if (cpu_buffers_num <= 0 || cpu_buffers_num > MAX_CPUS) {
+            warn("failed getting the number of CPUs (or too many CPUs)\n");
+            err = 1;
+            goto cleanup_obj;
+        }
+        bpf_map__set_max_entries(obj->maps.buffers, cpu_buffers_num);
+        obj->rodata->per_cpu_buffers = true;
+    }
+    if (use_prefilter) {
+        setup_prefilter(obj, exprs);
+    }
+    setup_autoload(obj);
 
     err = syswrite_bpf__load(obj);
     if (err) {
@@ -377,73 +1230,136 @@ int main(int argc, char *argv[]) {
         goto cleanup_obj;
     }
 
-    obj->links.sys_write = bpf_program__attach(obj->progs.sys_write);
-    if (!obj->links.sys_write) {
-        err = -errno;
-        warn("failed to attach sys_write program: %s\n", strerror(-err));
+    err = setup_filters(obj, filter_pid);
+    if (err) {
+        warn("failed to set up traced fds and pids: %s\n", strerror(-err));
+        goto cleanup_obj;
+    }
+
+    err = attach_syscalls(obj);
+    if (err) {
         goto cleanup_obj;
     }
 
-    struct ring_buffer *buffer = ring_buffer__new(bpf_map__fd(obj->maps.buffer),
-                                                  handle_event, NULL, NULL);
+    struct ring_buffer *buffer;
+    if (per_cpu_buffers) {
+        buffer = setup_per_cpu_buffers(obj);
+    } else {
+        buffer = ring_buffer__new(bpf_map__fd(obj->maps.buffer), handle_event,
+                                  NULL, NULL);
+    }
     if (!buffer) {
         warn("Failed to create ring buffer\n");
         goto cleanup_obj;
     }
 
-    warn("info: waiting for the monitor to attach\n");
-    err = vms_shm_buffer_wait_for_reader(shm);
-    if (err < 0) {
-        if (err != EINTR) {
-            warn("failed waiting: %s\n", strerror(-err));
+    /* we attached to a running process, do not make it wait for the
+     * monitor and capture its data right away */
+    bool attached = sync_fd == -1;
+    pthread_t waiter;
+    bool waiter_running = false;
+
+    if (attached) {
+        if (signal(SIGINT, sig_int) == SIG_ERR) {
+            warn("can't set signal handler: %s\n", strerror(errno));
+            goto cleanup_obj;
         }
-        goto cleanup_obj;
-    }
 
-    if (signal(SIGINT, sig_int) == SIG_ERR) {
-        warn("can't set signal handler: %s\n", strerror(errno));
-        goto cleanup_obj;
+        warn("info: capturing, waiting for the monitor to attach\n");
+        atomic_store(&monitor_ready, false);
+        if (pthread_create(&waiter, NULL, wait_for_monitor, NULL) != 0) {
+            warn("failed creating the waiting thread\n");
+            goto cleanup_obj;
+        }
+        waiter_running = true;
+    } else {
+        warn("info: waiting for the monitor to attach\n");
+        wait_for_monitor(NULL);
+        if (atomic_load(&monitor_failed)) {
+            goto cleanup_obj;
+        }
+
+        if (signal(SIGINT, sig_int) == SIG_ERR) {
+            warn("can't set signal handler: %s\n", strerror(errno));
+            goto cleanup_obj;
+        }
     }
 
     /* we spawned the process, signal it to run */
-    if (fork_sync[1] != -1) {
-        if (write(fork_sync[1], &CAN_CONTINUE, sizeof(CAN_CONTINUE)) !=
-            sizeof(CAN_CONTINUE)) {
-            perror("signaling child to continue");
+    if (sync_fd != -1) {
+        if (bpfsrc_let_run(sync_fd) < 0) {
             goto cleanup_obj;
         }
     }
 
-    printf("Tracing write syscalls...\n");
-    while (running && child_running) {
-        err = ring_buffer__consume(buffer);
-        // err = ring_buffer__poll(buffer,
-        //                         100 /* timeout in ms */);
-        if (err < 0 && err != -EINTR) {
-            perror("polling");
+    printf("Tracing syscalls...\n");
+    struct bpfsrc_consume_opts consume_opts = {
+        .poll_timeout_ms = poll_timeout_ms,
+        .keep_running = keep_running,
+        .after_round = after_round,
+        .data = buffer};
+    bpfsrc_consume(buffer, &consume_opts);
+
+    if (per_cpu_buffers) {
+        merge_pending(ULLONG_MAX);
+    }
+    if (atomic_load_explicit(&monitor_ready, memory_order_acquire)) {
+        drain_backlog();
+    } else if (backlog_head) {
+        warn("warning: the monitor did not attach, discarding %lu bytes\n",
+             backlog_size);
+    }
+    if (backlog_dropped > 0) {
+        warn("info: %lu records did not fit into the backlog\n",
+             backlog_dropped);
+    }
+    if (per_cpu_buffers) {
+        if (late_records > 0) {
+            warn("info: %lu records came too late to be merged in order\n",
+                 late_records);
         }
     }
 
+    report_drops(obj);
+
+    if (use_prefilter) {
+        warn("info: prefilter skipped %llu bytes\n",
+             (unsigned long long)obj->bss->skipped_bytes);
+    }
+
     printf("Cleaning up...\n");
     ring_buffer__free(buffer);
 
+    if (waiter_running) {
+        /* the monitor may have never attached */
+        pthread_cancel(waiter);
+        pthread_join(waiter, NULL);
+    }
+
 cleanup_obj:
+    bpfsrc_detach_all();
     syswrite_bpf__destroy(obj);
-cleanup_core:
-    cleanup_core_btf(&open_opts);
-
+    close_per_cpu_buffers();
+cleanup:
     warn("info: sent %lu events, busy waited on buffer %lu cycles\n", ev.id,
          waiting_for_buffer);
+    vsrc_stats_print(stderr, stats);
     for (int i = 0; i < (int)exprs_num; ++i) {
         regfree(&re[i]);
     }
     free(tmpline);
-    free(current_line);
+    free_line_states();
+    free_pending();
+    free_backlog();
     free(signatures);
     free(re);
 
-    warn("Destroying shared buffer\n");
-    vms_shm_buffer_destroy(shm);
+    warn("Destroying shared buffers\n");
+    for (int sc = 0; sc < SC_NUM; ++sc) {
+        if (streams[sc].shm)
+            vms_shm_buffer_destroy(streams[sc].shm);
+    }
+    vsrc_stats_destroy(stats);
 
     return 0;
 }
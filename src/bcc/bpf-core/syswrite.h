@@ -1,14 +1,62 @@
 #ifndef __SYSWRITE_H
 #define __SYSWRITE_H
 
-#define BUF_SIZE 255
+/* The maximal size of data in one record. Records are variable-sized,
+ * only the header and `len` bytes of data are put into the ring buffer.
+ * Must be a power of 2. */
+#define MAX_CHUNK 4096
 
-struct event {
-    char buf[BUF_SIZE];
+/* Literals for the in-kernel prefilter. Every line that the monitor can be
+ * interested in contains at least one of them. */
+#define MAX_LITERALS 8
+#define MAX_LITERAL_LEN 16
+
+struct literal {
+    unsigned len;
+    char str[MAX_LITERAL_LEN];
+};
+
+/* Size of a ring buffer (the shared one or each of the per-CPU ones) */
+#define RINGBUF_SIZE (4096 * 64)
+/* The maximal number of per-CPU ring buffers */
+#define MAX_CPUS 1024
+
+/* Sizes of the maps with the traced file descriptors and processes */
+#define MAX_FDS 64
+#define MAX_PIDS 4096
+
+/* The traced system calls, every one of them has its own event stream */
+enum syscall_kind {
+    SC_WRITE = 0,
+    SC_READ,
+    SC_WRITEV,
+    SC_READV,
+    SC_SENDTO,
+    SC_RECVFROM,
+    SC_SENDMSG,
+    SC_RECVMSG,
+    SC_NUM
+};
+
+struct event_header {
     int count;
     int len;
     int off;
     int fd;
+    int pid;
+    /* enum syscall_kind */
+    int sc;
+    /* the number of records of this (pid, fd, sc) stream that were lost
+     * since the previous record of the stream */
+    int lost;
+    /* CLOCK_MONOTONIC time (in ns) of the system call, also used to merge
+     * the per-CPU buffers */
+    unsigned long long ts;
+};
+
+struct event {
+    struct event_header hdr;
+    char buf[MAX_CHUNK];
 };
 
 #endif /* __SYSWRITE_H */
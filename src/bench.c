@@ -0,0 +1,493 @@
+/*
+ * vsrc-bench: a synthetic source for measuring the throughput and latency of
+ * the shared-memory buffers. It pushes events with the given signatures as
+ * fast as possible (or in batches with pauses) and reports events/s,
+ * bytes/s, how many times it had to wait for the monitor and percentiles of
+ * the time it took to push an event.
+ *
+ * Every event starts with the timestamp (in ticks of the TSC, or in
+ * nanoseconds if there is no TSC) of when we started pushing it, so
+ * that a monitor can compute the end-to-end latency. The number of ticks
+ * per nanosecond is printed at the start.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "vamos-buffers/core/event.h"
+#include "vamos-buffers/core/signatures.h"
+#include "vamos-buffers/core/source.h"
+#include "vamos-buffers/shmbuf/buffer.h"
+#include "vamos-buffers/shmbuf/client.h"
+
+#define MAX_EVENT_KINDS 16
+#define MAX_SIG_LEN 32
+#define MAX_PRODUCERS 64
+
+static void usage_and_exit(int ret) {
+    fprintf(
+        stderr,
+        "Usage: vsrc-bench [options] shmkey\n"
+        "  -n N        push N events from every producer (default 1000000)\n"
+        "  -c N        capacity of the buffers in events (default 128)\n"
+        "  -e SIG      add an event with the signature SIG (the events are\n"
+        "              pushed in round-robin, default is one event 'p')\n"
+        "  -L MIN:MAX  length of the strings ('S'), every string gets\n"
+        "              a random length from the range (default 8:8)\n"
+        "  -t N        push from N threads, each into its own sub-buffer\n"
+        "              (default 0 = push from the main thread into the main\n"
+        "              buffer)\n"
+        "  -b N        push events in batches of N (default 1)\n"
+        "  -p USEC     pause for USEC microseconds after every batch\n"
+        "              (default 0)\n");
+    exit(ret);
+}
+
+static struct {
+    size_t events;
+    size_t capacity;
+    size_t producers;
+    size_t batch;
+    unsigned pause_us;
+    size_t str_min, str_max;
+    const char *sigs[MAX_EVENT_KINDS];
+    size_t sigs_num;
+} config = {
+    .events = 1000000,
+    .capacity = 128,
+    .batch = 1,
+    .str_min = 8,
+    .str_max = 8,
+};
+
+/* the names and signatures of the events, the signatures have
+ * the timestamp 'l' in front of the signatures from the user */
+static char event_names[MAX_EVENT_KINDS][16];
+static char event_sigs[MAX_EVENT_KINDS][MAX_SIG_LEN + 2];
+
+static double ticks_per_ns = 1.0;
+
+static inline uint64_t mono_ns(void) {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static inline uint64_t now_ticks(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return mono_ns();
+#endif
+}
+
+static void calibrate_ticks(void) {
+#ifdef HAVE_TSC
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 50 * 1000 * 1000};
+    uint64_t ns = mono_ns();
+    uint64_t ticks = now_ticks();
+    nanosleep(&ts, NULL);
+    ticks = now_ticks() - ticks;
+    ns = mono_ns() - ns;
+    ticks_per_ns = (double)ticks / ns;
+#endif
+}
+
+/* A log-linear histogram of push latencies in ticks: values below HIST_SUB
+ * have their own bucket, every higher power of two is split into HIST_SUB
+ * buckets. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+static inline unsigned hist_bucket(uint64_t v) {
+    if (v < HIST_SUB)
+        return v;
+    unsigned exp = 63 - __builtin_clzll(v);
+    unsigned sub = (v >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+/* the smallest value that falls into the bucket */
+static uint64_t hist_bucket_value(unsigned bucket) {
+    if (bucket < HIST_SUB)
+        return bucket;
+    unsigned exp = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % HIST_SUB;
+    return (1ULL << exp) | (sub << (exp - HIST_SUB_BITS));
+}
+
+struct producer {
+    size_t idx;
+    vms_shm_buffer *shm;
+    vms_kind kinds[MAX_EVENT_KINDS];
+    pthread_t thread;
+
+    /* results */
+    size_t events;
+    uint64_t bytes;
+    size_t waiting_for_buffer;
+    uint64_t ticks;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+static size_t arg_size(char c) {
+    switch (c) {
+        case 'c':
+            return 1;
+        case 's':
+            return 2;
+        case 'i':
+        case 'f':
+            return 4;
+        case 'l':
+        case 'd':
+        case 'p':
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+static bool check_signature(const char *sig) {
+    if (strlen(sig) > MAX_SIG_LEN) {
+        fprintf(stderr, "Signature '%s' is too long\n", sig);
+        return false;
+    }
+    for (const char *o = sig; *o; ++o) {
+        if (*o != 'S' && arg_size(*o) == 0) {
+            fprintf(stderr, "Unsupported type '%c' in signature '%s'\n", *o,
+                    sig);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *produce(void *arg) {
+    struct producer *p = arg;
+    vms_shm_buffer *shm = p->shm;
+    const size_t str_range = config.str_max - config.str_min + 1;
+    uint64_t rnd = p->idx + 1;
+
+    /* strings of all lengths are suffixes of this one */
+    char *str = malloc(config.str_max + 1);
+    assert(str);
+    memset(str, 'a', config.str_max);
+    str[config.str_max] = '\0';
+
+    vms_event ev = {.kind = 0, .id = 0};
+    uint64_t start = now_ticks();
+    size_t i = 0;
+    while (i < config.events) {
+        for (size_t b = 0; b < config.batch && i < config.events; ++b, ++i) {
+            size_t k = i % config.sigs_num;
+            /* monitor does not want this event */
+            if (p->kinds[k] == 0)
+                continue;
+
+            uint64_t t0 = now_ticks();
+            unsigned char *addr;
+            while (!(addr = vms_shm_buffer_start_push(shm))) {
+                ++p->waiting_for_buffer;
+            }
+            ev.kind = p->kinds[k];
+            ++ev.id;
+            addr = vms_shm_buffer_partial_push(shm, addr, &ev, sizeof(ev));
+            addr = vms_shm_buffer_partial_push(shm, addr, &t0, sizeof(t0));
+            uint64_t bytes = sizeof(ev) + sizeof(t0);
+
+            for (const char *o = config.sigs[k]; *o; ++o) {
+                if (*o == 'S') {
+                    /* xorshift */
+                    rnd ^= rnd << 13;
+                    rnd ^= rnd >> 7;
+                    rnd ^= rnd << 17;
+                    size_t len = config.str_min + rnd % str_range;
+                    addr = vms_shm_buffer_partial_push_str(
+                        shm, addr, ev.id, str + config.str_max - len);
+                    bytes += len + 1;
+                } else {
+                    /* the value does not matter */
+                    size_t size = arg_size(*o);
+                    addr = vms_shm_buffer_partial_push(shm, addr, &ev.id, size);
+                    bytes += size;
+                }
+            }
+            vms_shm_buffer_finish_push(shm);
+
+            ++p->hist[hist_bucket(now_ticks() - t0)];
+            p->bytes += bytes;
+            ++p->events;
+        }
+
+        if (config.pause_us > 0) {
+            struct timespec ts = {
+                .tv_sec = config.pause_us / 1000000,
+                .tv_nsec = (config.pause_us % 1000000) * 1000};
+            nanosleep(&ts, NULL);
+        }
+    }
+    p->ticks = now_ticks() - start;
+
+    free(str);
+    return NULL;
+}
+
+static void get_kinds(struct producer *p) {
+    size_t events_num;
+    struct vms_event_record *events =
+        vms_shm_buffer_get_avail_events(p->shm, &events_num);
+
+    for (size_t i = 0; i < events_num; ++i) {
+        for (size_t k = 0; k < config.sigs_num; ++k) {
+            if (strcmp(events[i].name, event_names[k]) == 0) {
+                p->kinds[k] = events[i].kind;
+                break;
+            }
+        }
+    }
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total,
+                                double pct) {
+    uint64_t rank = (uint64_t)(total * pct / 100.0);
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < HIST_BUCKETS; ++b) {
+        seen += hist[b];
+        if (seen > rank)
+            return hist_bucket_value(b) / ticks_per_ns;
+    }
+    return 0;
+}
+
+static uint64_t hist_max(const uint64_t *hist) {
+    for (unsigned b = HIST_BUCKETS; b > 0; --b) {
+        if (hist[b - 1] > 0)
+            return hist_bucket_value(b - 1) / ticks_per_ns;
+    }
+    return 0;
+}
+
+static void report(const char *who, size_t events, uint64_t bytes,
+                   size_t waiting, uint64_t ticks, const uint64_t *hist) {
+    double secs = ticks / ticks_per_ns / 1e9;
+    fprintf(stderr,
+            "%s: %zu events, %" PRIu64
+            " bytes in %.3f s: %.0f events/s, %.2f MB/s, busy waited on "
+            "buffer %zu cycles\n",
+            who, events, bytes, secs, secs > 0 ? events / secs : 0.0,
+            secs > 0 ? bytes / secs / 1e6 : 0.0, waiting);
+    if (events == 0)
+        return;
+    fprintf(stderr,
+            "%s: push latency (ns) p50 %" PRIu64 ", p90 %" PRIu64
+            ", p99 %" PRIu64 ", p99.9 %" PRIu64 ", max %" PRIu64 "\n",
+            who, hist_percentile(hist, events, 50),
+            hist_percentile(hist, events, 90),
+            hist_percentile(hist, events, 99),
+            hist_percentile(hist, events, 99.9), hist_max(hist));
+}
+
+static bool parse_size(const char *str, size_t *val) {
+    char *end;
+    unsigned long long v = strtoull(str, &end, 10);
+    if (*str == '\0' || *end != '\0')
+        return false;
+    *val = v;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    size_t val;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:e:L:t:b:p:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                if (!parse_size(optarg, &config.events))
+                    usage_and_exit(1);
+                break;
+            case 'c':
+                if (!parse_size(optarg, &config.capacity) ||
+                    config.capacity == 0)
+                    usage_and_exit(1);
+                break;
+            case 'e':
+                if (config.sigs_num == MAX_EVENT_KINDS) {
+                    fprintf(stderr, "At most %d events are supported\n",
+                            MAX_EVENT_KINDS);
+                    return 1;
+                }
+                if (!check_signature(optarg))
+                    return 1;
+                config.sigs[config.sigs_num++] = optarg;
+                break;
+            case 'L':
+                if (sscanf(optarg, "%zu:%zu", &config.str_min,
+                           &config.str_max) != 2 ||
+                    config.str_min > config.str_max)
+                    usage_and_exit(1);
+                break;
+            case 't':
+                if (!parse_size(optarg, &config.producers) ||
+                    config.producers > MAX_PRODUCERS)
+                    usage_and_exit(1);
+                break;
+            case 'b':
+                if (!parse_size(optarg, &config.batch) || config.batch == 0)
+                    usage_and_exit(1);
+                break;
+            case 'p':
+                if (!parse_size(optarg, &val))
+                    usage_and_exit(1);
+                config.pause_us = val;
+                break;
+            case 'h':
+                usage_and_exit(0);
+                break;
+            default:
+                usage_and_exit(1);
+        }
+    }
+    if (optind + 1 != argc) {
+        usage_and_exit(1);
+    }
+    const char *shmkey = argv[optind];
+
+    if (config.sigs_num == 0) {
+        config.sigs[config.sigs_num++] = "p";
+    }
+
+    const char *names[MAX_EVENT_KINDS];
+    const char *sigs[MAX_EVENT_KINDS];
+    for (size_t k = 0; k < config.sigs_num; ++k) {
+        snprintf(event_names[k], sizeof(event_names[k]), "event%zu", k);
+        snprintf(event_sigs[k], sizeof(event_sigs[k]), "l%s", config.sigs[k]);
+        names[k] = event_names[k];
+        sigs[k] = event_sigs[k];
+    }
+
+    /* Initialize the info about this source */
+    struct vms_source_control *control =
+        vms_source_control_define_pairwise(config.sigs_num, names, sigs);
+    assert(control);
+
+    /* with producer threads, the main buffer only announces the
+     * sub-buffers of the producers */
+    struct vms_source_control *top_control =
+        config.producers > 0 ? vms_source_control_define(1, "producer", "i")
+                             : control;
+    assert(top_control);
+
+    vms_shm_buffer *shm =
+        vms_shm_buffer_create(shmkey, config.capacity, top_control);
+    assert(shm);
+
+    fprintf(stderr, "info: waiting for the monitor to attach... ");
+    vms_shm_buffer_wait_for_reader(shm);
+    fprintf(stderr, "done\n");
+
+    calibrate_ticks();
+    fprintf(stderr, "info: the timestamps are in ticks, %.4f ticks/ns\n",
+            ticks_per_ns);
+
+    const size_t producers_num = config.producers > 0 ? config.producers : 1;
+    struct producer *producers = calloc(producers_num, sizeof(*producers));
+    assert(producers);
+
+    if (config.producers == 0) {
+        producers[0].shm = shm;
+        get_kinds(&producers[0]);
+    } else {
+        size_t events_num;
+        struct vms_event_record *events =
+            vms_shm_buffer_get_avail_events(shm, &events_num);
+        assert(events_num == 1);
+        vms_event ev = {.kind = events[0].kind, .id = 0};
+
+        for (size_t i = 0; i < producers_num; ++i) {
+            struct producer *p = &producers[i];
+            p->idx = i;
+            p->shm = vms_shm_buffer_create_sub_buffer(shm, config.capacity,
+                                                      control);
+            assert(p->shm);
+
+            /* announce the sub-buffer, it must be done before waiting for
+             * the monitor to attach */
+            unsigned char *addr;
+            while (!(addr = vms_shm_buffer_start_push(shm)))
+                ;
+            ++ev.id;
+            int idx = i;
+            addr = vms_shm_buffer_partial_push(shm, addr, &ev, sizeof(ev));
+            vms_shm_buffer_partial_push(shm, addr, &idx, sizeof(idx));
+            vms_shm_buffer_finish_push(shm);
+
+            fprintf(stderr, "info: [%zu] waiting for the monitor... ", i);
+            vms_shm_buffer_wait_for_reader(p->shm);
+            fprintf(stderr, "done\n");
+            get_kinds(p);
+        }
+        free(top_control);
+    }
+    free(control);
+
+    if (config.producers == 0) {
+        produce(&producers[0]);
+    } else {
+        for (size_t i = 0; i < producers_num; ++i) {
+            if (pthread_create(&producers[i].thread, NULL, produce,
+                               &producers[i]) != 0) {
+                fprintf(stderr, "Failed creating a thread\n");
+                abort();
+            }
+        }
+        for (size_t i = 0; i < producers_num; ++i) {
+            pthread_join(producers[i].thread, NULL);
+        }
+    }
+
+    static uint64_t total_hist[HIST_BUCKETS];
+    size_t total_events = 0, total_waiting = 0;
+    uint64_t total_bytes = 0, max_ticks = 0;
+    char who[32];
+    for (size_t i = 0; i < producers_num; ++i) {
+        struct producer *p = &producers[i];
+        snprintf(who, sizeof(who), "info: producer %zu", i);
+        report(who, p->events, p->bytes, p->waiting_for_buffer, p->ticks,
+               p->hist);
+
+        total_events += p->events;
+        total_bytes += p->bytes;
+        total_waiting += p->waiting_for_buffer;
+        if (p->ticks > max_ticks)
+            max_ticks = p->ticks;
+        for (unsigned b = 0; b < HIST_BUCKETS; ++b)
+            total_hist[b] += p->hist[b];
+    }
+    if (producers_num > 1) {
+        report("info: total", total_events, total_bytes, total_waiting,
+               max_ticks, total_hist);
+    }
+
+    for (size_t i = 0; i < config.producers; ++i) {
+        vms_shm_buffer_release_sub_buffer(producers[i].shm);
+    }
+    free(producers);
+    vms_shm_buffer_destroy(shm);
+
+    return 0;
+}
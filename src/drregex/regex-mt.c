@@ -11,6 +11,7 @@
 
 #include "dr_api.h"
 #include "drmgr.h"
+#include "stats/stats.h"
 #include "vamos-buffers/core/list-embedded.h"
 #include "vamos-buffers/core/signatures.h"
 #include "vamos-buffers/core/source.h"
@@ -63,6 +64,8 @@ static size_t tmpline_len;
 struct line {
     STRING(data);
     size_t timestamp;
+    /* when the line was written by the program (for stats) */
+    uint64_t observed;
     vms_list_embedded list;
 } __attribute__((aligned(CACHELINE_SIZE)));
 
@@ -150,6 +153,9 @@ static vms_event evs[3];
 
 static vms_shm_buffer *shmbuf[3];
 
+static struct vsrc_stats_page *stats;
+static struct vsrc_stream_stats *stats_streams[3];
+
 typedef struct {
     int fd;
     void *buf;
@@ -171,6 +177,9 @@ static int parse_line(int fd, struct line *line_info) {
     int num = (int)exprs_num[fd];
     vms_shm_buffer *shm = shmbuf[fd];
     char *line = line_info->data;
+    struct vsrc_stream_stats *stream = stats_streams[fd];
+
+    vsrc_stats_add(stream, VSRC_STATS_BYTES, STRING_SIZE(line_info->data));
 
     // info("[%d] parsing line (%p): '%s'\n", fd, line, line);
 
@@ -192,6 +201,7 @@ static int parse_line(int fd, struct line *line_info) {
         const char *o = signatures[fd][i];
         while (!(addr = vms_shm_buffer_start_push(shm))) {
             ++waiting_for_buffer[fd];
+            vsrc_stats_add(stream, VSRC_STATS_WAITS, 1);
             if (++waiting > 5000) {
                 if (!vms_shm_buffer_reader_is_ready(shm)) {
                     warn("buffer detached while waiting for space");
@@ -282,6 +292,7 @@ static int parse_line(int fd, struct line *line_info) {
             }
         }
         vms_shm_buffer_finish_push(shm);
+        vsrc_stats_published(stream, line_info->observed);
 
         if (first_match_only)
             break;
@@ -458,6 +469,7 @@ static struct line *init_new_line(int fd) {
 
 static inline void finish_line(int fd) {
     current_line[fd]->timestamp = ++timestamp;
+    current_line[fd]->observed = vsrc_stats_now_ns();
     list_lock(fd);
     /* insert at the end */
     vms_list_embedded_insert_after(lines[fd].list.prev,
@@ -672,6 +684,7 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
     int filter_fd_mask = 0;
 
     info("Creating SHM buffers\n");
+    stats = vsrc_stats_create(shmkey, "drregex-mt");
 
     /* Create shared memory buffers */
     for (int i = 0; i < 3; ++i) {
@@ -698,6 +711,7 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
         shmbuf[i] = vms_shm_buffer_create(extended_shmkey, capacity, control);
         /* create the shared buffer */
         assert(shmbuf[i]);
+        stats_streams[i] = vsrc_stats_add_stream(stats, extended_shmkey);
 
         size_t events_num;
         events[i] = vms_shm_buffer_get_avail_events(shmbuf[i], &events_num);
@@ -803,6 +817,8 @@ static void event_exit(void) {
         VEC_DESTROY(line_pool[fd].lines);
     }
 
+    vsrc_stats_print(stderr, stats);
+    vsrc_stats_destroy(stats);
     free(tmpline);
     /*info("Clean up done\n");*/
 }
@@ -40,6 +40,7 @@
 
 #include "linux/input.h"
 #include "shared.h"
+#include "stats/stats.h"
 #include "util-macros.h"
 #include "util-strings.h"
 #include "vamos-buffers/core/event.h"
@@ -48,7 +49,11 @@
 #include "vamos-buffers/shmbuf/buffer.h"
 #include "vamos-buffers/shmbuf/client.h"
 
+/* The events are printed only when built with -DPRINT_EVENTS
+ * (the LIBINPUT_PRINT_EVENTS CMake option), printing is too slow otherwise */
+#ifndef PRINT_EVENTS
 #define NO_OUTPUT
+#endif
 
 struct event {
     vms_event base;
@@ -59,11 +64,49 @@ static size_t waiting_for_buffer = 0;
 static vms_shm_buffer *buffer;
 static struct event vev;
 
+static struct vsrc_stats_page *stats;
+static struct vsrc_stream_stats *stream_stats;
+/* when we got the libinput event that is being pushed */
+static uint64_t observed_ns;
+
 enum vamos_event_idx {
     POINTER_MOTION = 0,
     POINTER_MOTION_ABS = 1,
     POINTER_BUTTON = 2,
     KEYBOARD_KEY = 3,
+    DROPPED = 4,
+    POINTER_SCROLL = 5,
+    TOUCH_DOWN = 6,
+    TOUCH_MOTION = 7,
+    TOUCH_UP = 8,
+    TOUCH_CANCEL = 9,
+    TOUCH_FRAME = 10,
+    GESTURE_SWIPE_BEGIN = 11,
+    GESTURE_SWIPE_UPDATE = 12,
+    GESTURE_SWIPE_END = 13,
+    GESTURE_PINCH_BEGIN = 14,
+    GESTURE_PINCH_UPDATE = 15,
+    GESTURE_PINCH_END = 16,
+    GESTURE_HOLD_BEGIN = 17,
+    GESTURE_HOLD_END = 18,
+    TABLET_TOOL_AXIS = 19,
+    TABLET_TOOL_PROXIMITY = 20,
+    TABLET_TOOL_TIP = 21,
+    TABLET_TOOL_BUTTON = 22,
+    TABLET_PAD_BUTTON = 23,
+    TABLET_PAD_RING = 24,
+    TABLET_PAD_STRIP = 25,
+    TABLET_PAD_KEY = 26,
+    SWITCH_TOGGLE = 27,
+    DEVICE_ADDED = 28,
+    DEVICE_REMOVED = 29,
+};
+
+/* the values of the `source` argument of pointer_scroll */
+enum scroll_source {
+    SCROLL_SOURCE_WHEEL = 0,
+    SCROLL_SOURCE_FINGER = 1,
+    SCROLL_SOURCE_CONTINUOUS = 2,
 };
 
 struct _kind_mapping {
@@ -77,6 +120,50 @@ struct _kind_mapping {
     {"pointer_motion_abs", "ddd", 0},
     {"pointer_button", "dic", 0},
     {"keyboard_key", "dic", 0},
+    /* the number of events that were dropped because neither the shared
+     * buffer nor the overflow queue had space for them */
+    {"dropped", "l", 0},
+    /* time, source, vertical, horizontal, vertical v120, horizontal v120 */
+    {"pointer_scroll", "dcdddd", 0},
+    /* time, slot, seat slot, x, y */
+    {"touch_down", "diidd", 0},
+    {"touch_motion", "diidd", 0},
+    /* time, slot, seat slot */
+    {"touch_up", "dii", 0},
+    {"touch_cancel", "dii", 0},
+    {"touch_frame", "d", 0},
+    /* time, fingers[, dx, dy, dx unaccelerated, dy unaccelerated
+     * [, scale, angle delta]][, cancelled] */
+    {"gesture_swipe_begin", "di", 0},
+    {"gesture_swipe_update", "didddd", 0},
+    {"gesture_swipe_end", "dic", 0},
+    {"gesture_pinch_begin", "di", 0},
+    {"gesture_pinch_update", "didddddd", 0},
+    {"gesture_pinch_end", "dic", 0},
+    {"gesture_hold_begin", "di", 0},
+    {"gesture_hold_end", "dic", 0},
+    /* time, x, y, pressure, distance, tilt x, tilt y, rotation, slider,
+     * wheel delta */
+    {"tablet_tool_axis", "dddddddddd", 0},
+    /* time, tool type, serial, in proximity, x, y */
+    {"tablet_tool_proximity", "dclcdd", 0},
+    /* time, x, y, pressure, down */
+    {"tablet_tool_tip", "ddddc", 0},
+    /* time, button, pressed */
+    {"tablet_tool_button", "dic", 0},
+    /* time, button, pressed, mode */
+    {"tablet_pad_button", "dici", 0},
+    /* time, number, position, finger source, mode */
+    {"tablet_pad_ring", "didci", 0},
+    {"tablet_pad_strip", "didci", 0},
+    /* time, key, pressed */
+    {"tablet_pad_key", "dic", 0},
+    /* time, switch, state */
+    {"switch_toggle", "dcc", 0},
+    /* device number, capabilities */
+    {"device_added", "ii", 0},
+    /* device number */
+    {"device_removed", "i", 0},
 };
 
 static uint32_t start_time;
@@ -87,6 +174,29 @@ static bool show_keycodes;
 static volatile sig_atomic_t stop = 0;
 static bool be_quiet = false;
 
+/* Consecutive pointer motion events that come within this window (in
+ * microseconds) from the first one are merged into one event (0 = off).
+ * The merged events carry the number of merged events as the last
+ * argument. */
+static uint64_t coalesce_window_us = 0;
+
+static struct {
+    /* POINTER_MOTION or POINTER_MOTION_ABS */
+    enum vamos_event_idx idx;
+    /* the number of merged events, 0 if there are none */
+    uint32_t count;
+    /* the time of the first merged event */
+    uint64_t start_us;
+    /* when we got the first merged event (for stats) */
+    uint64_t observed_ns;
+    /* the time of the last merged event */
+    double time;
+    /* the sum of deltas or the last absolute position */
+    double x, y;
+    /* the sum of unaccelerated deltas */
+    double ux, uy;
+} pending_motion;
+
 #ifdef NO_OUTPUT
 #define printq(...)
 #else
@@ -97,26 +207,220 @@ static bool be_quiet = false;
     })
 #endif
 
-static unsigned char *push_header(vms_kind kind) {
-    unsigned char *addr;
+/* The events that do not fit into the shared buffer wait in the overflow
+ * queue, so that we never block and libinput is drained even if
+ * the monitor is slow. The queue is allocated at the start and when it is
+ * full, the events are dropped and the 'dropped' event is pushed (or
+ * queued) right before the next event that is not dropped. */
+#define QUEUED_EVENT_SIZE 128
+/* how often we retry pushing the queued events when there are no new ones */
+#define QUEUE_RETRY_MS 1
+
+struct queued_event {
+    size_t size;
+    uint64_t observed_ns;
+    unsigned char data[QUEUED_EVENT_SIZE];
+};
 
-    assert(buffer && "Do not have VAMOS buffer");
+static struct queued_event *queue;
+static size_t queue_capacity = 4096;
+static size_t queue_head = 0;
+static size_t queue_len = 0;
+static size_t queue_max_len = 0;
+/* the dropped events that were not reported to the monitor yet */
+static uint64_t dropped_pending = 0;
+static uint64_t dropped_total = 0;
+
+/* true if the event that is being pushed goes into the queue */
+static bool pushing_to_queue = false;
+
+/* The pushed events can be recorded into a file (--record) and replayed
+ * from it later (--replay) without any input devices. The file starts with
+ * a `struct dump_header` and then every event is a `struct dump_record`
+ * followed by the arguments of the event. */
+#define DUMP_MAGIC "VSRCLI01"
+
+struct dump_header {
+    char magic[8];
+    /* non-zero if the motion events were coalesced (their signature
+     * has the count of merged events) */
+    uint32_t coalesced;
+    uint32_t reserved;
+};
 
-    vev.base.kind = kind;
-    ++vev.base.id;
-    while (!(addr = vms_shm_buffer_start_push(buffer))) {
-      ++waiting_for_buffer;
-      if (!vms_shm_buffer_reader_is_ready(buffer))
+struct dump_record {
+    /* CLOCK_MONOTONIC time of the push in microseconds */
+    uint64_t time_us;
+    /* the index into vamos_events */
+    uint16_t idx;
+    /* the size of the arguments */
+    uint16_t size;
+    uint32_t reserved;
+};
+
+static FILE *record_file;
+/* true if the arguments of the event that is being pushed are recorded */
+static bool recording = false;
+static struct dump_record record;
+static unsigned char record_args[QUEUED_EVENT_SIZE];
+
+static struct queued_event *queue_tail(void) {
+    return &queue[(queue_head + queue_len) % queue_capacity];
+}
+
+static unsigned char *push_data(unsigned char *addr, const void *data,
+                                size_t size) {
+    if (recording) {
+        memcpy(record_args + record.size, data, size);
+        record.size += size;
+    }
+    if (pushing_to_queue) {
+        struct queued_event *qe = queue_tail();
+        memcpy(addr, data, size);
+        addr += size;
+        qe->size = addr - qe->data;
+        return addr;
+    }
+    return vms_shm_buffer_partial_push(buffer, addr, data, size);
+}
+
+static void write_record(void) {
+    recording = false;
+    if (fwrite(&record, sizeof(record), 1, record_file) != 1 ||
+        fwrite(record_args, 1, record.size, record_file) != record.size) {
+        fprintf(stderr, "Failed writing the record, stop recording: %s\n",
+                strerror(errno));
+        fclose(record_file);
+        record_file = NULL;
+    }
+}
+
+static void finish_push(void) {
+    if (recording)
+        write_record();
+
+    if (!pushing_to_queue) {
+        vms_shm_buffer_finish_push(buffer);
+        vsrc_stats_published(stream_stats, observed_ns);
+        return;
+    }
+
+    queue_tail()->observed_ns = observed_ns;
+    ++queue_len;
+    if (queue_len > queue_max_len)
+        queue_max_len = queue_len;
+    pushing_to_queue = false;
+}
+
+/* Push the queued events into the shared buffer while it has space.
+ * Returns true if the queue is empty. */
+static bool drain_queue(void) {
+    while (queue_len > 0) {
+        unsigned char *addr = vms_shm_buffer_start_push(buffer);
+        if (!addr) {
+            ++waiting_for_buffer;
+            vsrc_stats_add(stream_stats, VSRC_STATS_WAITS, 1);
+            return false;
+        }
+        struct queued_event *qe = &queue[queue_head];
+        vms_shm_buffer_partial_push(buffer, addr, qe->data, qe->size);
+        vms_shm_buffer_finish_push(buffer);
+        vsrc_stats_published(stream_stats, qe->observed_ns);
+        queue_head = (queue_head + 1) % queue_capacity;
+        --queue_len;
+    }
+    return true;
+}
+
+static uint64_t monotonic_time_us(void) {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+static void start_record(vms_kind kind) {
+    const size_t vamos_events_num =
+        sizeof vamos_events / sizeof vamos_events[0];
+    for (size_t i = 0; i < vamos_events_num; ++i) {
+        if (vamos_events[i].kind == kind) {
+            record.time_us = monotonic_time_us();
+            record.idx = i;
+            record.size = 0;
+            recording = true;
+            return;
+        }
+    }
+}
+
+/* Push the 'dropped' event with the number of the events dropped since the
+ * last report into `addr`, a slot in the shared buffer or in the queue
+ * (if pushing_to_queue is set) */
+static void push_dropped(unsigned char *addr) {
+    vms_event ev = {.id = ++vev.base.id, .kind = vamos_events[DROPPED].kind};
+    addr = push_data(addr, &ev, sizeof(ev));
+    if (record_file)
+        start_record(ev.kind);
+    push_data(addr, &dropped_pending, sizeof(dropped_pending));
+    finish_push();
+    dropped_pending = 0;
+}
+
+/* Get the place for the next event: the shared buffer if it has space and
+ * there are no older events in the queue, otherwise a slot in the queue.
+ * Returns NULL if the event must be dropped. */
+static unsigned char *start_event(void) {
+    if (dropped_pending > 0 && vamos_events[DROPPED].kind == 0) {
+        /* the monitor is not interested in the drops */
+        dropped_pending = 0;
+    }
+
+    if (drain_queue()) {
+        unsigned char *addr = vms_shm_buffer_start_push(buffer);
+        if (addr && dropped_pending > 0) {
+            /* report the drops before the events that came after them */
+            push_dropped(addr);
+            addr = vms_shm_buffer_start_push(buffer);
+        }
+        if (addr)
+            return addr;
+        ++waiting_for_buffer;
+        vsrc_stats_add(stream_stats, VSRC_STATS_WAITS, 1);
+    }
+
+    if (dropped_pending > 0 && queue_len < queue_capacity) {
+        pushing_to_queue = true;
+        push_dropped(queue_tail()->data);
+    }
+
+    if (queue_len == queue_capacity) {
+        ++dropped_pending;
+        ++dropped_total;
+        vsrc_stats_add(stream_stats, VSRC_STATS_DROPS, 1);
         return NULL;
     }
 
-    /* write the header */
-    addr =
-        vms_shm_buffer_partial_push(buffer, addr, &vev.base, sizeof(vms_event));
+    pushing_to_queue = true;
+    return queue_tail()->data;
+}
+
+static unsigned char *push_header(vms_kind kind) {
+    assert(buffer && "Do not have VAMOS buffer");
+
+    unsigned char *addr = start_event();
+    if (!addr)
+        return NULL;
 
+    vev.base.kind = kind;
+    ++vev.base.id;
+    /* write the header */
+    addr = push_data(addr, &vev.base, sizeof(vms_event));
+    /* record only the arguments, the kinds are assigned anew on replay */
+    if (record_file)
+        start_record(kind);
     return addr;
 }
 
+#ifndef NO_OUTPUT
 static void print_event_header(struct libinput_event *ev) {
     /* use for pointer value only, do not dereference */
     static void *last_device = NULL;
@@ -350,6 +654,7 @@ static void print_device_notify(struct libinput_event *ev) {
 
     printq("\n");
 }
+#endif
 
 static void handle_key_event(struct libinput_event *ev) {
     vms_kind kind = vamos_events[KEYBOARD_KEY].kind;
@@ -367,11 +672,11 @@ static void handle_key_event(struct libinput_event *ev) {
     unsigned char *addr = push_header(kind);
     if (!addr)
         return;
-    addr = vms_shm_buffer_partial_push(buffer, addr, &time, sizeof(time));
-    addr = vms_shm_buffer_partial_push(buffer, addr, &key, sizeof(key));
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &key, sizeof(key));
     unsigned char statec = (state == LIBINPUT_KEY_STATE_PRESSED);
-    addr = vms_shm_buffer_partial_push(buffer, addr, &statec, sizeof(char));
-    vms_shm_buffer_finish_push(buffer);
+    addr = push_data(addr, &statec, sizeof(char));
+    finish_push();
 
 #ifndef NO_OUTPUT
     const char *keyname;
@@ -388,6 +693,75 @@ static void handle_key_event(struct libinput_event *ev) {
 #endif
 }
 
+static void flush_motion(void) {
+    if (pending_motion.count == 0)
+        return;
+
+    observed_ns = pending_motion.observed_ns;
+    unsigned char *addr = push_header(vamos_events[pending_motion.idx].kind);
+    if (addr) {
+        addr = push_data(addr, &pending_motion.time, sizeof(double));
+        addr = push_data(addr, &pending_motion.x, sizeof(double));
+        addr = push_data(addr, &pending_motion.y, sizeof(double));
+        if (pending_motion.idx == POINTER_MOTION) {
+            addr = push_data(addr, &pending_motion.ux, sizeof(double));
+            addr = push_data(addr, &pending_motion.uy, sizeof(double));
+        }
+        addr = push_data(addr, &pending_motion.count, sizeof(uint32_t));
+        finish_push();
+    }
+
+    pending_motion.count = 0;
+}
+
+/* Merge the motion event into the pending one. Relative motion sums up
+ * the deltas, absolute motion keeps the last position. */
+static void coalesce_motion(enum vamos_event_idx idx, uint64_t time_us,
+                            double time, double x, double y, double ux,
+                            double uy) {
+    if (pending_motion.count > 0 &&
+        (pending_motion.idx != idx ||
+         time_us - pending_motion.start_us > coalesce_window_us)) {
+        flush_motion();
+    }
+
+    if (pending_motion.count == 0) {
+        pending_motion.idx = idx;
+        pending_motion.start_us = time_us;
+        pending_motion.observed_ns = observed_ns;
+        pending_motion.x = pending_motion.y = 0;
+        pending_motion.ux = pending_motion.uy = 0;
+    }
+
+    if (idx == POINTER_MOTION) {
+        pending_motion.x += x;
+        pending_motion.y += y;
+        pending_motion.ux += ux;
+        pending_motion.uy += uy;
+    } else {
+        pending_motion.x = x;
+        pending_motion.y = y;
+    }
+    pending_motion.time = time;
+    ++pending_motion.count;
+}
+
+/* How long (in ms) poll() can wait before the pending motion must be
+ * flushed, -1 if there is nothing to flush */
+static int motion_flush_timeout(void) {
+    if (pending_motion.count == 0)
+        return -1;
+
+    /* libinput uses CLOCK_MONOTONIC for the timestamps */
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    uint64_t now_us = tp.tv_sec * 1000000ULL + tp.tv_nsec / 1000;
+    uint64_t deadline_us = pending_motion.start_us + coalesce_window_us;
+    if (now_us >= deadline_us)
+        return 0;
+    return (deadline_us - now_us + 999) / 1000;
+}
+
 static void handle_motion_event(struct libinput_event *ev) {
     vms_kind kind = vamos_events[POINTER_MOTION].kind;
     if (kind == 0)
@@ -400,17 +774,23 @@ static void handle_motion_event(struct libinput_event *ev) {
     double uy = libinput_event_pointer_get_dy_unaccelerated(p);
     double time = libinput_event_pointer_get_time(p);
 
+    if (coalesce_window_us > 0) {
+        coalesce_motion(POINTER_MOTION, libinput_event_pointer_get_time_usec(p),
+                        time, x, y, ux, uy);
+        return;
+    }
+
     unsigned char *addr = push_header(kind);
     if (!addr)
         return;
 
     /* write the data */
-    addr = vms_shm_buffer_partial_push(buffer, addr, &time, sizeof(time));
-    addr = vms_shm_buffer_partial_push(buffer, addr, &x, sizeof(x));
-    addr = vms_shm_buffer_partial_push(buffer, addr, &y, sizeof(y));
-    addr = vms_shm_buffer_partial_push(buffer, addr, &ux, sizeof(ux));
-    addr = vms_shm_buffer_partial_push(buffer, addr, &uy, sizeof(uy));
-    vms_shm_buffer_finish_push(buffer);
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &x, sizeof(x));
+    addr = push_data(addr, &y, sizeof(y));
+    addr = push_data(addr, &ux, sizeof(ux));
+    addr = push_data(addr, &uy, sizeof(uy));
+    finish_push();
 
 #ifndef NO_OUTPUT
     print_event_time(time);
@@ -430,18 +810,27 @@ static void handle_absmotion_event(struct libinput_event *ev) {
         libinput_event_pointer_get_absolute_y_transformed(p, screen_height);
     double time = libinput_event_pointer_get_time(p);
 
+    if (coalesce_window_us > 0) {
+        coalesce_motion(POINTER_MOTION_ABS,
+                        libinput_event_pointer_get_time_usec(p), time, x, y, 0,
+                        0);
+        return;
+    }
+
     unsigned char *addr = push_header(kind);
     if (!addr)
         return;
 
     /* write the data */
-    addr = vms_shm_buffer_partial_push(buffer, addr, &time, sizeof(time));
-    addr = vms_shm_buffer_partial_push(buffer, addr, &x, sizeof(x));
-    addr = vms_shm_buffer_partial_push(buffer, addr, &y, sizeof(y));
-    vms_shm_buffer_finish_push(buffer);
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &x, sizeof(x));
+    addr = push_data(addr, &y, sizeof(y));
+    finish_push();
 
+#ifndef NO_OUTPUT
     print_event_time(time);
     printq("%6.2f/%6.2f\n", x, y);
+#endif
 }
 
 static void handle_pointer_button_event(struct libinput_event *ev) {
@@ -460,11 +849,11 @@ static void handle_pointer_button_event(struct libinput_event *ev) {
     unsigned char *addr = push_header(kind);
     if (!addr)
         return;
-    addr = vms_shm_buffer_partial_push(buffer, addr, &time, sizeof(time));
-    addr = vms_shm_buffer_partial_push(buffer, addr, &button, sizeof(button));
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &button, sizeof(button));
     unsigned char statec = (state == LIBINPUT_BUTTON_STATE_PRESSED);
-    addr = vms_shm_buffer_partial_push(buffer, addr, &statec, sizeof(statec));
-    vms_shm_buffer_finish_push(buffer);
+    addr = push_data(addr, &statec, sizeof(statec));
+    finish_push();
 
 #ifndef NO_OUTPUT
     const char *buttonname = libevdev_event_code_get_name(EV_KEY, button);
@@ -476,6 +865,7 @@ static void handle_pointer_button_event(struct libinput_event *ev) {
 #endif
 }
 
+#ifndef NO_OUTPUT
 static void print_tablet_axes(struct libinput_event_tablet_tool *t) {
     struct libinput_tablet_tool *tool = libinput_event_tablet_tool_get_tool(t);
     double x, y;
@@ -532,44 +922,82 @@ static void print_tablet_axes(struct libinput_event_tablet_tool *t) {
                minor, changed_sym(t, size_minor));
     }
 }
+#endif
+
+static void handle_tablet_tip_event(struct libinput_event *ev) {
+    vms_kind kind = vamos_events[TABLET_TOOL_TIP].kind;
+    if (kind == 0)
+        return;
 
-static void print_tablet_tip_event(struct libinput_event *ev) {
     struct libinput_event_tablet_tool *t =
         libinput_event_get_tablet_tool_event(ev);
     enum libinput_tablet_tool_tip_state state;
 
-    print_event_time(libinput_event_tablet_tool_get_time(t));
+    double time = libinput_event_tablet_tool_get_time(t);
+    double x = libinput_event_tablet_tool_get_x(t);
+    double y = libinput_event_tablet_tool_get_y(t);
+    double pressure = libinput_event_tablet_tool_get_pressure(t);
+    state = libinput_event_tablet_tool_get_tip_state(t);
 
-    print_tablet_axes(t);
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &x, sizeof(x));
+    addr = push_data(addr, &y, sizeof(y));
+    addr = push_data(addr, &pressure, sizeof(pressure));
+    unsigned char statec = (state == LIBINPUT_TABLET_TOOL_TIP_DOWN);
+    addr = push_data(addr, &statec, sizeof(statec));
+    finish_push();
 
-    state = libinput_event_tablet_tool_get_tip_state(t);
+#ifndef NO_OUTPUT
+    print_event_time(time);
+    print_tablet_axes(t);
     printq(" %s\n", state == LIBINPUT_TABLET_TOOL_TIP_DOWN ? "down" : "up");
+#endif
 }
 
-static void print_tablet_button_event(struct libinput_event *ev) {
+static void handle_tablet_button_event(struct libinput_event *ev) {
+    vms_kind kind = vamos_events[TABLET_TOOL_BUTTON].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_tablet_tool *p =
         libinput_event_get_tablet_tool_event(ev);
     enum libinput_button_state state;
-    const char *buttonname;
     int button;
 
-    print_event_time(libinput_event_tablet_tool_get_time(p));
-
+    double time = libinput_event_tablet_tool_get_time(p);
     button = libinput_event_tablet_tool_get_button(p);
-    buttonname = libevdev_event_code_get_name(EV_KEY, button);
-
     state = libinput_event_tablet_tool_get_button_state(p);
+
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &button, sizeof(button));
+    unsigned char statec = (state == LIBINPUT_BUTTON_STATE_PRESSED);
+    addr = push_data(addr, &statec, sizeof(statec));
+    finish_push();
+
+#ifndef NO_OUTPUT
+    const char *buttonname = libevdev_event_code_get_name(EV_KEY, button);
+    print_event_time(time);
     printq("%3d (%s) %s, seat count: %u\n", button,
            buttonname ? buttonname : "???",
            state == LIBINPUT_BUTTON_STATE_PRESSED ? "pressed" : "released",
            libinput_event_tablet_tool_get_seat_button_count(p));
+#endif
 }
 
-static void print_pointer_axis_event(struct libinput_event *ev) {
+static void handle_pointer_scroll_event(struct libinput_event *ev) {
+    vms_kind kind = vamos_events[POINTER_SCROLL].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_pointer *p = libinput_event_get_pointer_event(ev);
     double v = 0, h = 0, v120 = 0, h120 = 0;
-    const char *have_vert = "", *have_horiz = "";
-    const char *source = NULL;
+    unsigned char source;
     enum libinput_pointer_axis axis;
     enum libinput_event_type type;
 
@@ -577,13 +1005,13 @@ static void print_pointer_axis_event(struct libinput_event *ev) {
 
     switch (type) {
         case LIBINPUT_EVENT_POINTER_SCROLL_WHEEL:
-            source = "wheel";
+            source = SCROLL_SOURCE_WHEEL;
             break;
         case LIBINPUT_EVENT_POINTER_SCROLL_FINGER:
-            source = "finger";
+            source = SCROLL_SOURCE_FINGER;
             break;
         case LIBINPUT_EVENT_POINTER_SCROLL_CONTINUOUS:
-            source = "continuous";
+            source = SCROLL_SOURCE_CONTINUOUS;
             break;
         default:
             abort();
@@ -595,31 +1023,83 @@ static void print_pointer_axis_event(struct libinput_event *ev) {
         v = libinput_event_pointer_get_scroll_value(p, axis);
         if (type == LIBINPUT_EVENT_POINTER_SCROLL_WHEEL)
             v120 = libinput_event_pointer_get_scroll_value_v120(p, axis);
-        have_vert = "*";
     }
     axis = LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL;
     if (libinput_event_pointer_has_axis(p, axis)) {
         h = libinput_event_pointer_get_scroll_value(p, axis);
         if (type == LIBINPUT_EVENT_POINTER_SCROLL_WHEEL)
             h120 = libinput_event_pointer_get_scroll_value_v120(p, axis);
-        have_horiz = "*";
     }
+    double time = libinput_event_pointer_get_time(p);
 
-    print_event_time(libinput_event_pointer_get_time(p));
-    printq("vert %.2f/%.1f%s horiz %.2f/%.1f%s (%s)\n", v, v120, have_vert, h,
-           h120, have_horiz, source);
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &source, sizeof(source));
+    addr = push_data(addr, &v, sizeof(v));
+    addr = push_data(addr, &h, sizeof(h));
+    addr = push_data(addr, &v120, sizeof(v120));
+    addr = push_data(addr, &h120, sizeof(h120));
+    finish_push();
+
+#ifndef NO_OUTPUT
+    static const char *source_names[] = {"wheel", "finger", "continuous"};
+    print_event_time(time);
+    printq("vert %.2f/%.1f%s horiz %.2f/%.1f%s (%s)\n", v, v120,
+           libinput_event_pointer_has_axis(
+               p, LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL)
+               ? "*"
+               : "",
+           h, h120,
+           libinput_event_pointer_has_axis(
+               p, LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL)
+               ? "*"
+               : "",
+           source_names[source]);
+#endif
 }
 
-static void print_tablet_axis_event(struct libinput_event *ev) {
+static void handle_tablet_axis_event(struct libinput_event *ev) {
+    vms_kind kind = vamos_events[TABLET_TOOL_AXIS].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_tablet_tool *t =
         libinput_event_get_tablet_tool_event(ev);
 
-    print_event_time(libinput_event_tablet_tool_get_time(t));
+    /* the axes that the tool does not have are 0 */
+    double axes[] = {
+        libinput_event_tablet_tool_get_time(t),
+        libinput_event_tablet_tool_get_x(t),
+        libinput_event_tablet_tool_get_y(t),
+        libinput_event_tablet_tool_get_pressure(t),
+        libinput_event_tablet_tool_get_distance(t),
+        libinput_event_tablet_tool_get_tilt_x(t),
+        libinput_event_tablet_tool_get_tilt_y(t),
+        libinput_event_tablet_tool_get_rotation(t),
+        libinput_event_tablet_tool_get_slider_position(t),
+        libinput_event_tablet_tool_get_wheel_delta(t),
+    };
+
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, axes, sizeof(axes));
+    finish_push();
+
+#ifndef NO_OUTPUT
+    print_event_time(axes[0]);
     print_tablet_axes(t);
     printq("\n");
+#endif
 }
 
-static void print_proximity_event(struct libinput_event *ev) {
+static void handle_proximity_event(struct libinput_event *ev) {
+    vms_kind kind = vamos_events[TABLET_TOOL_PROXIMITY].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_tablet_tool *t =
         libinput_event_get_tablet_tool_event(ev);
     struct libinput_tablet_tool *tool = libinput_event_tablet_tool_get_tool(t);
@@ -656,19 +1136,37 @@ static void print_proximity_event(struct libinput_event *ev) {
     }
 
     state = libinput_event_tablet_tool_get_proximity_state(t);
-
-    print_event_time(libinput_event_tablet_tool_get_time(t));
-
     if (state == LIBINPUT_TABLET_TOOL_PROXIMITY_STATE_IN) {
-        print_tablet_axes(t);
         state_str = "proximity-in";
     } else if (state == LIBINPUT_TABLET_TOOL_PROXIMITY_STATE_OUT) {
-        print_tablet_axes(t);
         state_str = "proximity-out";
     } else {
         abort();
     }
 
+    double time = libinput_event_tablet_tool_get_time(t);
+    double x = libinput_event_tablet_tool_get_x(t);
+    double y = libinput_event_tablet_tool_get_y(t);
+    /* the values of enum libinput_tablet_tool_type */
+    unsigned char tool_type = libinput_tablet_tool_get_type(tool);
+    uint64_t serial = libinput_tablet_tool_get_serial(tool);
+
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &tool_type, sizeof(tool_type));
+    addr = push_data(addr, &serial, sizeof(serial));
+    unsigned char statec = (state == LIBINPUT_TABLET_TOOL_PROXIMITY_STATE_IN);
+    addr = push_data(addr, &statec, sizeof(statec));
+    addr = push_data(addr, &x, sizeof(x));
+    addr = push_data(addr, &y, sizeof(y));
+    finish_push();
+
+#ifndef NO_OUTPUT
+    print_event_time(time);
+    print_tablet_axes(t);
+
     printq("\t%-8s (%#" PRIx64 ", id %#" PRIx64 ") %s ", tool_str,
            libinput_tablet_tool_get_serial(tool),
            libinput_tablet_tool_get_tool_id(tool), state_str);
@@ -712,23 +1210,73 @@ static void print_proximity_event(struct libinput_event *ev) {
     }
 
     printq("\n");
+#else
+    (void)tool_str;
+    (void)state_str;
+#endif
 }
 
-static void print_touch_event(struct libinput_event *ev) {
+static void handle_touch_event(struct libinput_event *ev) {
     struct libinput_event_touch *t = libinput_event_get_touch_event(ev);
     enum libinput_event_type type = libinput_event_get_type(ev);
+    enum vamos_event_idx idx;
+
+    switch (type) {
+        case LIBINPUT_EVENT_TOUCH_DOWN:
+            idx = TOUCH_DOWN;
+            break;
+        case LIBINPUT_EVENT_TOUCH_MOTION:
+            idx = TOUCH_MOTION;
+            break;
+        case LIBINPUT_EVENT_TOUCH_UP:
+            idx = TOUCH_UP;
+            break;
+        case LIBINPUT_EVENT_TOUCH_CANCEL:
+            idx = TOUCH_CANCEL;
+            break;
+        case LIBINPUT_EVENT_TOUCH_FRAME:
+            idx = TOUCH_FRAME;
+            break;
+        default:
+            abort();
+    }
+
+    vms_kind kind = vamos_events[idx].kind;
+    if (kind == 0)
+        return;
+
+    double time = libinput_event_touch_get_time(t);
+    int slot = 0, seat_slot = 0;
+    double x = 0, y = 0;
+
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    if (type != LIBINPUT_EVENT_TOUCH_FRAME) {
+        slot = libinput_event_touch_get_slot(t);
+        seat_slot = libinput_event_touch_get_seat_slot(t);
+        addr = push_data(addr, &slot, sizeof(slot));
+        addr = push_data(addr, &seat_slot, sizeof(seat_slot));
+    }
+    if (type == LIBINPUT_EVENT_TOUCH_DOWN ||
+        type == LIBINPUT_EVENT_TOUCH_MOTION) {
+        x = libinput_event_touch_get_x_transformed(t, screen_width);
+        y = libinput_event_touch_get_y_transformed(t, screen_height);
+        addr = push_data(addr, &x, sizeof(x));
+        addr = push_data(addr, &y, sizeof(y));
+    }
+    finish_push();
 
-    print_event_time(libinput_event_touch_get_time(t));
+#ifndef NO_OUTPUT
+    print_event_time(time);
 
     if (type != LIBINPUT_EVENT_TOUCH_FRAME) {
-        printq("%d (%d)", libinput_event_touch_get_slot(t),
-               libinput_event_touch_get_seat_slot(t));
+        printq("%d (%d)", slot, seat_slot);
     }
 
     if (type == LIBINPUT_EVENT_TOUCH_DOWN ||
         type == LIBINPUT_EVENT_TOUCH_MOTION) {
-        double x = libinput_event_touch_get_x_transformed(t, screen_width);
-        double y = libinput_event_touch_get_y_transformed(t, screen_height);
         double xmm = libinput_event_touch_get_x(t);
         double ymm = libinput_event_touch_get_y(t);
 
@@ -736,60 +1284,140 @@ static void print_touch_event(struct libinput_event *ev) {
     }
 
     printq("\n");
+#endif
+}
+
+static enum vamos_event_idx gesture_event_idx(enum libinput_event_type type) {
+    switch (type) {
+        case LIBINPUT_EVENT_GESTURE_SWIPE_BEGIN:
+            return GESTURE_SWIPE_BEGIN;
+        case LIBINPUT_EVENT_GESTURE_SWIPE_UPDATE:
+            return GESTURE_SWIPE_UPDATE;
+        case LIBINPUT_EVENT_GESTURE_SWIPE_END:
+            return GESTURE_SWIPE_END;
+        case LIBINPUT_EVENT_GESTURE_PINCH_BEGIN:
+            return GESTURE_PINCH_BEGIN;
+        case LIBINPUT_EVENT_GESTURE_PINCH_UPDATE:
+            return GESTURE_PINCH_UPDATE;
+        case LIBINPUT_EVENT_GESTURE_PINCH_END:
+            return GESTURE_PINCH_END;
+        case LIBINPUT_EVENT_GESTURE_HOLD_BEGIN:
+            return GESTURE_HOLD_BEGIN;
+        case LIBINPUT_EVENT_GESTURE_HOLD_END:
+            return GESTURE_HOLD_END;
+        default:
+            abort();
+    }
 }
 
-static void print_gesture_event_without_coords(struct libinput_event *ev) {
+static void handle_gesture_event_without_coords(struct libinput_event *ev) {
+    enum libinput_event_type type = libinput_event_get_type(ev);
+    vms_kind kind = vamos_events[gesture_event_idx(type)].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_gesture *t = libinput_event_get_gesture_event(ev);
     int finger_count = libinput_event_gesture_get_finger_count(t);
     int cancelled = 0;
-    enum libinput_event_type type;
-
-    type = libinput_event_get_type(ev);
+    bool is_end = type == LIBINPUT_EVENT_GESTURE_SWIPE_END ||
+                  type == LIBINPUT_EVENT_GESTURE_PINCH_END ||
+                  type == LIBINPUT_EVENT_GESTURE_HOLD_END;
 
-    if (type == LIBINPUT_EVENT_GESTURE_SWIPE_END ||
-        type == LIBINPUT_EVENT_GESTURE_PINCH_END ||
-        type == LIBINPUT_EVENT_GESTURE_HOLD_END)
+    if (is_end)
         cancelled = libinput_event_gesture_get_cancelled(t);
+    double time = libinput_event_gesture_get_time(t);
 
-    print_event_time(libinput_event_gesture_get_time(t));
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &finger_count, sizeof(finger_count));
+    if (is_end) {
+        unsigned char cancelledc = cancelled;
+        addr = push_data(addr, &cancelledc, sizeof(cancelledc));
+    }
+    finish_push();
+
+#ifndef NO_OUTPUT
+    print_event_time(time);
     printq("%d%s\n", finger_count, cancelled ? " cancelled" : "");
+#endif
 }
 
-static void print_gesture_event_with_coords(struct libinput_event *ev) {
+static void handle_gesture_event_with_coords(struct libinput_event *ev) {
+    enum libinput_event_type type = libinput_event_get_type(ev);
+    vms_kind kind = vamos_events[gesture_event_idx(type)].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_gesture *t = libinput_event_get_gesture_event(ev);
-    double dx = libinput_event_gesture_get_dx(t);
-    double dy = libinput_event_gesture_get_dy(t);
-    double dx_unaccel = libinput_event_gesture_get_dx_unaccelerated(t);
-    double dy_unaccel = libinput_event_gesture_get_dy_unaccelerated(t);
+    int finger_count = libinput_event_gesture_get_finger_count(t);
+    double time = libinput_event_gesture_get_time(t);
+    double deltas[] = {
+        libinput_event_gesture_get_dx(t),
+        libinput_event_gesture_get_dy(t),
+        libinput_event_gesture_get_dx_unaccelerated(t),
+        libinput_event_gesture_get_dy_unaccelerated(t),
+    };
+    double scale = 0, angle = 0;
 
-    print_event_time(libinput_event_gesture_get_time(t));
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &finger_count, sizeof(finger_count));
+    addr = push_data(addr, deltas, sizeof(deltas));
+    if (type == LIBINPUT_EVENT_GESTURE_PINCH_UPDATE) {
+        scale = libinput_event_gesture_get_scale(t);
+        angle = libinput_event_gesture_get_angle_delta(t);
+        addr = push_data(addr, &scale, sizeof(scale));
+        addr = push_data(addr, &angle, sizeof(angle));
+    }
+    finish_push();
 
-    printq("%d %5.2f/%5.2f (%5.2f/%5.2f unaccelerated)",
-           libinput_event_gesture_get_finger_count(t), dx, dy, dx_unaccel,
-           dy_unaccel);
+#ifndef NO_OUTPUT
+    print_event_time(time);
 
-    if (libinput_event_get_type(ev) == LIBINPUT_EVENT_GESTURE_PINCH_UPDATE) {
-        double scale = libinput_event_gesture_get_scale(t);
-        double angle = libinput_event_gesture_get_angle_delta(t);
+    printq("%d %5.2f/%5.2f (%5.2f/%5.2f unaccelerated)", finger_count,
+           deltas[0], deltas[1], deltas[2], deltas[3]);
 
+    if (type == LIBINPUT_EVENT_GESTURE_PINCH_UPDATE) {
         printq(" %5.2f @ %5.2f\n", scale, angle);
     } else {
         printq("\n");
     }
+#endif
 }
 
-static void print_tablet_pad_button_event(struct libinput_event *ev) {
+static void handle_tablet_pad_button_event(struct libinput_event *ev) {
+    vms_kind kind = vamos_events[TABLET_PAD_BUTTON].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_tablet_pad *p =
         libinput_event_get_tablet_pad_event(ev);
-    struct libinput_tablet_pad_mode_group *group;
     enum libinput_button_state state;
     unsigned int button, mode;
 
-    print_event_time(libinput_event_tablet_pad_get_time(p));
-
-    button = libinput_event_tablet_pad_get_button_number(p),
+    double time = libinput_event_tablet_pad_get_time(p);
+    button = libinput_event_tablet_pad_get_button_number(p);
     state = libinput_event_tablet_pad_get_button_state(p);
     mode = libinput_event_tablet_pad_get_mode(p);
+
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &button, sizeof(button));
+    unsigned char statec = (state == LIBINPUT_BUTTON_STATE_PRESSED);
+    addr = push_data(addr, &statec, sizeof(statec));
+    addr = push_data(addr, &mode, sizeof(mode));
+    finish_push();
+
+#ifndef NO_OUTPUT
+    struct libinput_tablet_pad_mode_group *group;
+
+    print_event_time(time);
     printq("%3d %s (mode %d)", button,
            state == LIBINPUT_BUTTON_STATE_PRESSED ? "pressed" : "released",
            mode);
@@ -799,64 +1427,95 @@ static void print_tablet_pad_button_event(struct libinput_event *ev) {
         printq(" <mode toggle>");
 
     printq("\n");
+#endif
+}
+
+static void push_pad_position(vms_kind kind, double time, int number,
+                              double position, unsigned char source,
+                              unsigned int mode) {
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &number, sizeof(number));
+    addr = push_data(addr, &position, sizeof(position));
+    addr = push_data(addr, &source, sizeof(source));
+    addr = push_data(addr, &mode, sizeof(mode));
+    finish_push();
 }
 
-static void print_tablet_pad_ring_event(struct libinput_event *ev) {
+static void handle_tablet_pad_ring_event(struct libinput_event *ev) {
+    vms_kind kind = vamos_events[TABLET_PAD_RING].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_tablet_pad *p =
         libinput_event_get_tablet_pad_event(ev);
-    const char *source = NULL;
-    unsigned int mode;
+    unsigned char finger = libinput_event_tablet_pad_get_ring_source(p) ==
+                           LIBINPUT_TABLET_PAD_RING_SOURCE_FINGER;
+    double time = libinput_event_tablet_pad_get_time(p);
+    int number = libinput_event_tablet_pad_get_ring_number(p);
+    double position = libinput_event_tablet_pad_get_ring_position(p);
+    unsigned int mode = libinput_event_tablet_pad_get_mode(p);
 
-    print_event_time(libinput_event_tablet_pad_get_time(p));
+    push_pad_position(kind, time, number, position, finger, mode);
 
-    switch (libinput_event_tablet_pad_get_ring_source(p)) {
-        case LIBINPUT_TABLET_PAD_RING_SOURCE_FINGER:
-            source = "finger";
-            break;
-        case LIBINPUT_TABLET_PAD_RING_SOURCE_UNKNOWN:
-            source = "unknown";
-            break;
-    }
-
-    mode = libinput_event_tablet_pad_get_mode(p);
-    printq("ring %d position %.2f (source %s) (mode %d)\n",
-           libinput_event_tablet_pad_get_ring_number(p),
-           libinput_event_tablet_pad_get_ring_position(p), source, mode);
+#ifndef NO_OUTPUT
+    print_event_time(time);
+    printq("ring %d position %.2f (source %s) (mode %d)\n", number, position,
+           finger ? "finger" : "unknown", mode);
+#endif
 }
 
-static void print_tablet_pad_strip_event(struct libinput_event *ev) {
+static void handle_tablet_pad_strip_event(struct libinput_event *ev) {
+    vms_kind kind = vamos_events[TABLET_PAD_STRIP].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_tablet_pad *p =
         libinput_event_get_tablet_pad_event(ev);
-    const char *source = NULL;
-    unsigned int mode;
+    unsigned char finger = libinput_event_tablet_pad_get_strip_source(p) ==
+                           LIBINPUT_TABLET_PAD_STRIP_SOURCE_FINGER;
+    double time = libinput_event_tablet_pad_get_time(p);
+    int number = libinput_event_tablet_pad_get_strip_number(p);
+    double position = libinput_event_tablet_pad_get_strip_position(p);
+    unsigned int mode = libinput_event_tablet_pad_get_mode(p);
 
-    print_event_time(libinput_event_tablet_pad_get_time(p));
+    push_pad_position(kind, time, number, position, finger, mode);
 
-    switch (libinput_event_tablet_pad_get_strip_source(p)) {
-        case LIBINPUT_TABLET_PAD_STRIP_SOURCE_FINGER:
-            source = "finger";
-            break;
-        case LIBINPUT_TABLET_PAD_STRIP_SOURCE_UNKNOWN:
-            source = "unknown";
-            break;
-    }
-
-    mode = libinput_event_tablet_pad_get_mode(p);
-    printq("strip %d position %.2f (source %s) (mode %d)\n",
-           libinput_event_tablet_pad_get_strip_number(p),
-           libinput_event_tablet_pad_get_strip_position(p), source, mode);
+#ifndef NO_OUTPUT
+    print_event_time(time);
+    printq("strip %d position %.2f (source %s) (mode %d)\n", number, position,
+           finger ? "finger" : "unknown", mode);
+#endif
 }
 
-static void print_tablet_pad_key_event(struct libinput_event *ev) {
+static void handle_tablet_pad_key_event(struct libinput_event *ev) {
+    vms_kind kind = vamos_events[TABLET_PAD_KEY].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_tablet_pad *p =
         libinput_event_get_tablet_pad_event(ev);
     enum libinput_key_state state;
     uint32_t key;
-    const char *keyname;
-
-    print_event_time(libinput_event_tablet_pad_get_time(p));
 
+    double time = libinput_event_tablet_pad_get_time(p);
     key = libinput_event_tablet_pad_get_key(p);
+    state = libinput_event_tablet_pad_get_key_state(p);
+
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    addr = push_data(addr, &key, sizeof(key));
+    unsigned char statec = (state == LIBINPUT_KEY_STATE_PRESSED);
+    addr = push_data(addr, &statec, sizeof(statec));
+    finish_push();
+
+#ifndef NO_OUTPUT
+    const char *keyname;
+    print_event_time(time);
     if (!show_keycodes && (key >= KEY_ESC && key < KEY_ZENKAKUHANKAKU)) {
         keyname = "***";
         key = -1;
@@ -864,18 +1523,20 @@ static void print_tablet_pad_key_event(struct libinput_event *ev) {
         keyname = libevdev_event_code_get_name(EV_KEY, key);
         keyname = keyname ? keyname : "???";
     }
-    state = libinput_event_tablet_pad_get_key_state(p);
     printq("%s (%d) %s\n", keyname, key,
            state == LIBINPUT_KEY_STATE_PRESSED ? "pressed" : "released");
+#endif
 }
 
-static void print_switch_event(struct libinput_event *ev) {
+static void handle_switch_event(struct libinput_event *ev) {
+    vms_kind kind = vamos_events[SWITCH_TOGGLE].kind;
+    if (kind == 0)
+        return;
+
     struct libinput_event_switch *sw = libinput_event_get_switch_event(ev);
     enum libinput_switch_state state;
     const char *which;
 
-    print_event_time(libinput_event_switch_get_time(sw));
-
     switch (libinput_event_switch_get_switch(sw)) {
         case LIBINPUT_SWITCH_LID:
             which = "lid";
@@ -887,37 +1548,104 @@ static void print_switch_event(struct libinput_event *ev) {
             abort();
     }
 
+    double time = libinput_event_switch_get_time(sw);
     state = libinput_event_switch_get_switch_state(sw);
 
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &time, sizeof(time));
+    /* the values of enum libinput_switch */
+    unsigned char switchc = libinput_event_switch_get_switch(sw);
+    addr = push_data(addr, &switchc, sizeof(switchc));
+    unsigned char statec = state;
+    addr = push_data(addr, &statec, sizeof(statec));
+    finish_push();
+
+#ifndef NO_OUTPUT
+    print_event_time(time);
     printq("switch %s state %d\n", which, state);
+#else
+    (void)which;
+#endif
+}
+
+static void handle_device_event(struct libinput_event *ev) {
+    struct libinput_device *dev = libinput_event_get_device(ev);
+    bool added = libinput_event_get_type(ev) == LIBINPUT_EVENT_DEVICE_ADDED;
+
+    /* number the devices, so that the monitor can match the removal with
+     * the addition */
+    static int next_device_id = 0;
+    int device_id = (intptr_t)libinput_device_get_user_data(dev);
+    if (!device_id) {
+        device_id = ++next_device_id;
+        libinput_device_set_user_data(dev, (void *)(intptr_t)device_id);
+    }
+
+    vms_kind kind = vamos_events[added ? DEVICE_ADDED : DEVICE_REMOVED].kind;
+    if (kind == 0)
+        return;
+
+    unsigned char *addr = push_header(kind);
+    if (!addr)
+        return;
+    addr = push_data(addr, &device_id, sizeof(device_id));
+    if (added) {
+        /* bit N is set if the device has the capability N
+         * (enum libinput_device_capability) */
+        int caps = 0;
+        for (int cap = LIBINPUT_DEVICE_CAP_KEYBOARD;
+             cap <= LIBINPUT_DEVICE_CAP_SWITCH; ++cap) {
+            if (libinput_device_has_capability(dev, cap))
+                caps |= 1 << cap;
+        }
+        addr = push_data(addr, &caps, sizeof(caps));
+    }
+    finish_push();
 }
 
 static int handle_and_write_events(struct libinput *li) {
     int rc = -1;
     struct libinput_event *ev;
 
+    drain_queue();
     tools_dispatch(li);
     while ((ev = libinput_get_event(li))) {
         enum libinput_event_type type = libinput_event_get_type(ev);
+        observed_ns = vsrc_stats_now_ns();
 
         if (!vms_shm_buffer_reader_is_ready(buffer)) {
             stop = 1;
             break;
         }
 
+        /* keep the order of the coalesced motion and other events */
+        if (type != LIBINPUT_EVENT_POINTER_MOTION &&
+            type != LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE)
+            flush_motion();
+
+#ifndef NO_OUTPUT
         if (type != LIBINPUT_EVENT_POINTER_AXIS)
             print_event_header(ev);
+#endif
 
         switch (type) {
             case LIBINPUT_EVENT_NONE:
                 abort();
             case LIBINPUT_EVENT_DEVICE_ADDED:
+#ifndef NO_OUTPUT
                 print_device_notify(ev);
+#endif
+                handle_device_event(ev);
                 tools_device_apply_config(libinput_event_get_device(ev),
                                           &options);
                 break;
             case LIBINPUT_EVENT_DEVICE_REMOVED:
+#ifndef NO_OUTPUT
                 print_device_notify(ev);
+#endif
+                handle_device_event(ev);
                 break;
             case LIBINPUT_EVENT_KEYBOARD_KEY:
                 handle_key_event(ev);
@@ -932,70 +1660,58 @@ static int handle_and_write_events(struct libinput *li) {
                 handle_pointer_button_event(ev);
                 break;
             case LIBINPUT_EVENT_POINTER_AXIS:
-                /* ignore */
+                /* ignore, deprecated by the scroll events below */
                 break;
             case LIBINPUT_EVENT_POINTER_SCROLL_WHEEL:
             case LIBINPUT_EVENT_POINTER_SCROLL_FINGER:
             case LIBINPUT_EVENT_POINTER_SCROLL_CONTINUOUS:
-                print_pointer_axis_event(ev);
+                handle_pointer_scroll_event(ev);
                 break;
             case LIBINPUT_EVENT_TOUCH_DOWN:
             case LIBINPUT_EVENT_TOUCH_MOTION:
             case LIBINPUT_EVENT_TOUCH_UP:
             case LIBINPUT_EVENT_TOUCH_CANCEL:
             case LIBINPUT_EVENT_TOUCH_FRAME:
-                print_touch_event(ev);
+                handle_touch_event(ev);
                 break;
             case LIBINPUT_EVENT_GESTURE_SWIPE_BEGIN:
-                print_gesture_event_without_coords(ev);
-                break;
-            case LIBINPUT_EVENT_GESTURE_SWIPE_UPDATE:
-                print_gesture_event_with_coords(ev);
-                break;
             case LIBINPUT_EVENT_GESTURE_SWIPE_END:
-                print_gesture_event_without_coords(ev);
-                break;
             case LIBINPUT_EVENT_GESTURE_PINCH_BEGIN:
-                print_gesture_event_without_coords(ev);
-                break;
-            case LIBINPUT_EVENT_GESTURE_PINCH_UPDATE:
-                print_gesture_event_with_coords(ev);
-                break;
             case LIBINPUT_EVENT_GESTURE_PINCH_END:
-                print_gesture_event_without_coords(ev);
-                break;
             case LIBINPUT_EVENT_GESTURE_HOLD_BEGIN:
-                print_gesture_event_without_coords(ev);
-                break;
             case LIBINPUT_EVENT_GESTURE_HOLD_END:
-                print_gesture_event_without_coords(ev);
+                handle_gesture_event_without_coords(ev);
+                break;
+            case LIBINPUT_EVENT_GESTURE_SWIPE_UPDATE:
+            case LIBINPUT_EVENT_GESTURE_PINCH_UPDATE:
+                handle_gesture_event_with_coords(ev);
                 break;
             case LIBINPUT_EVENT_TABLET_TOOL_AXIS:
-                print_tablet_axis_event(ev);
+                handle_tablet_axis_event(ev);
                 break;
             case LIBINPUT_EVENT_TABLET_TOOL_PROXIMITY:
-                print_proximity_event(ev);
+                handle_proximity_event(ev);
                 break;
             case LIBINPUT_EVENT_TABLET_TOOL_TIP:
-                print_tablet_tip_event(ev);
+                handle_tablet_tip_event(ev);
                 break;
             case LIBINPUT_EVENT_TABLET_TOOL_BUTTON:
-                print_tablet_button_event(ev);
+                handle_tablet_button_event(ev);
                 break;
             case LIBINPUT_EVENT_TABLET_PAD_BUTTON:
-                print_tablet_pad_button_event(ev);
+                handle_tablet_pad_button_event(ev);
                 break;
             case LIBINPUT_EVENT_TABLET_PAD_RING:
-                print_tablet_pad_ring_event(ev);
+                handle_tablet_pad_ring_event(ev);
                 break;
             case LIBINPUT_EVENT_TABLET_PAD_STRIP:
-                print_tablet_pad_strip_event(ev);
+                handle_tablet_pad_strip_event(ev);
                 break;
             case LIBINPUT_EVENT_TABLET_PAD_KEY:
-                print_tablet_pad_key_event(ev);
+                handle_tablet_pad_key_event(ev);
                 break;
             case LIBINPUT_EVENT_SWITCH_TOGGLE:
-                print_switch_event(ev);
+                handle_switch_event(ev);
                 break;
         }
 
@@ -1012,6 +1728,40 @@ static void sighandler(int signal, siginfo_t *siginfo, void *userdata) {
     stop = 1;
 }
 
+static int poll_timeout(void) {
+    int timeout = motion_flush_timeout();
+    /* there is no notification when the monitor frees some space in the
+     * buffer, so retry pushing the queued events periodically */
+    if (queue_len > 0 && (timeout < 0 || timeout > QUEUE_RETRY_MS))
+        timeout = QUEUE_RETRY_MS;
+    return timeout;
+}
+
+static int wait_for_events(struct pollfd *fds) {
+    int rc;
+    while ((rc = poll(fds, 1, poll_timeout())) == 0) {
+        /* flush the coalesced motion when its window is over and no other
+         * event came */
+        if (motion_flush_timeout() == 0)
+            flush_motion();
+        drain_queue();
+        if (!vms_shm_buffer_reader_is_ready(buffer))
+            return -1;
+    }
+    return rc;
+}
+
+static void print_queue_info(void) {
+    if (dropped_total > 0) {
+        fprintf(stderr, "info: dropped %" PRIu64 " events\n", dropped_total);
+    }
+    fprintf(stderr,
+            "info: at most %zu events waited in the overflow queue, busy "
+            "waited on buffer %zu times\n",
+            queue_max_len, waiting_for_buffer);
+    vsrc_stats_print(stderr, stats);
+}
+
 static void mainloop(struct libinput *li) {
     struct pollfd fds;
 
@@ -1033,32 +1783,163 @@ static void mainloop(struct libinput *li) {
         start_time = tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
         do {
             handle_and_write_events(li);
-        } while (!stop && poll(&fds, 1, -1) > -1);
+        } while (!stop && wait_for_events(&fds) > -1);
     }
 
+    flush_motion();
+    /* the input is not being read anymore, we can wait for the monitor */
+    while (!drain_queue() && vms_shm_buffer_reader_is_ready(buffer))
+        ;
+    print_queue_info();
+
     printf("\n");
 }
 
+static FILE *open_replay(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Failed opening '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    struct dump_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, DUMP_MAGIC, sizeof(hdr.magic)) != 0) {
+        fprintf(stderr, "'%s' is not a recording of vsrc-libinput\n", path);
+        fclose(f);
+        return NULL;
+    }
+    /* the motion events must have the signature they were recorded with */
+    coalesce_window_us = hdr.coalesced;
+    return f;
+}
+
+/* Wait until `target_us`, pushing the queued events in the meantime.
+ * Returns false if the monitor is gone. */
+static bool replay_wait_until(uint64_t target_us) {
+    for (;;) {
+        drain_queue();
+        if (!vms_shm_buffer_reader_is_ready(buffer))
+            return false;
+
+        uint64_t now = monotonic_time_us();
+        if (now >= target_us)
+            return true;
+
+        uint64_t wait_us = target_us - now;
+        if (queue_len > 0 && wait_us > QUEUE_RETRY_MS * 1000)
+            wait_us = QUEUE_RETRY_MS * 1000;
+        struct timespec ts = {.tv_sec = wait_us / 1000000,
+                              .tv_nsec = (wait_us % 1000000) * 1000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Push the events from the recording with the original timing scaled
+ * by `speed` (2 = twice as fast) or as fast as possible if `speed` is 0.
+ * The events are not dropped in this mode, we wait for the monitor
+ * instead when the queue is full. */
+static void replay(FILE *f, double speed) {
+    const size_t vamos_events_num =
+        sizeof vamos_events / sizeof vamos_events[0];
+    struct dump_record rec;
+    unsigned char args[QUEUED_EVENT_SIZE];
+    uint64_t first_us = 0, start_us = monotonic_time_us();
+    size_t replayed = 0;
+
+    while (!stop && fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.idx >= vamos_events_num || rec.size > sizeof(args) ||
+            fread(args, 1, rec.size, f) != rec.size) {
+            fprintf(stderr, "Malformed recording\n");
+            break;
+        }
+
+        if (replayed++ == 0)
+            first_us = rec.time_us;
+        if (speed > 0 &&
+            !replay_wait_until(start_us +
+                               (uint64_t)((rec.time_us - first_us) / speed)))
+            break;
+
+        vms_kind kind = vamos_events[rec.idx].kind;
+        if (kind == 0)
+            continue;
+
+        while (queue_len == queue_capacity) {
+            if (!vms_shm_buffer_reader_is_ready(buffer)) {
+                stop = 1;
+                break;
+            }
+            drain_queue();
+        }
+        if (stop)
+            break;
+
+        observed_ns = vsrc_stats_now_ns();
+        unsigned char *addr = push_header(kind);
+        assert(addr && "The queue has space");
+        push_data(addr, args, rec.size);
+        finish_push();
+    }
+
+    while (!drain_queue() && vms_shm_buffer_reader_is_ready(buffer))
+        ;
+
+    uint64_t duration_us = monotonic_time_us() - start_us;
+    fprintf(stderr, "info: replayed %zu events in %.3f s (%.0f events/s)\n",
+            replayed, duration_us / 1e6,
+            duration_us > 0 ? replayed / (duration_us / 1e6) : 0.0);
+    print_queue_info();
+}
+
 static void usage(void) {
     printf(
         "Usage: vsrc-libinput --shmkey <key> [options] [--udev <seat>|--device "
-        "/dev/input/event0 ...]\n");
+        "/dev/input/event0 ...]\n"
+        "\n"
+        "  --coalesce <usec>  merge consecutive pointer motion events that\n"
+        "                     come within <usec> microseconds from the first\n"
+        "                     one. The deltas are summed up, the absolute\n"
+        "                     position is the last one and the number of\n"
+        "                     merged events is added as the last argument\n"
+        "                     ('i') of the motion events\n"
+        "  --queue-size <n>   the number of events that can wait when the\n"
+        "                     shared buffer is full (default 4096). Further\n"
+        "                     events are dropped and reported by the event\n"
+        "                     'dropped'\n"
+        "  --record <file>    save the pushed events into <file>\n"
+        "  --replay <file>    push the events saved by --record instead of\n"
+        "                     reading input devices\n"
+        "  --replay-speed <x> replay <x> times faster than recorded (default\n"
+        "                     1), 0 replays as fast as the monitor reads\n");
 }
 
 static int init_vamos(const char *shmkey) {
-    const size_t event_types_num = 4;
-    struct vms_source_control *control = vms_source_control_define(
-        sizeof vamos_events / sizeof vamos_events[0],
-	vamos_events[POINTER_MOTION].name,
-        vamos_events[POINTER_MOTION].sig,
-	vamos_events[POINTER_MOTION_ABS].name,
-        vamos_events[POINTER_MOTION_ABS].sig,
-	vamos_events[POINTER_BUTTON].name,
-        vamos_events[POINTER_BUTTON].sig,
-	vamos_events[KEYBOARD_KEY].name,
-        vamos_events[KEYBOARD_KEY].sig);
+    const size_t vamos_events_num =
+        sizeof vamos_events / sizeof vamos_events[0];
+    const char *names[vamos_events_num];
+    const char *signatures[vamos_events_num];
+    for (size_t i = 0; i < vamos_events_num; ++i) {
+        names[i] = vamos_events[i].name;
+        signatures[i] = vamos_events[i].sig;
+    }
+    struct vms_source_control *control =
+        vms_source_control_define_pairwise(vamos_events_num, names, signatures);
     assert(control);
 
+    /* every event must fit into a slot of the overflow queue */
+    if (source_control_max_event_size(control) > QUEUED_EVENT_SIZE) {
+        fprintf(stderr, "Events are too big for the overflow queue\n");
+        free(control);
+        return -1;
+    }
+    queue = malloc(queue_capacity * sizeof(*queue));
+    if (!queue) {
+        fprintf(stderr, "Failed allocating the overflow queue\n");
+        free(control);
+        return -1;
+    }
+
     const size_t capacity = 128;
     buffer = vms_shm_buffer_create(shmkey, capacity, control);
     if (!buffer) {
@@ -1067,10 +1948,14 @@ static int init_vamos(const char *shmkey) {
     }
     free(control);
 
+    stats = vsrc_stats_create(shmkey, "libinput");
+    stream_stats = vsrc_stats_add_stream(stats, shmkey);
+
     fprintf(stderr, "info: waiting for the monitor to attach... ");
     if (vms_shm_buffer_wait_for_reader(buffer) < 0) {
         fprintf(stderr, "Failed waiting for the monitor to attach...\n");
         vms_shm_buffer_destroy(buffer);
+        vsrc_stats_destroy(stats);
         return -1;
     }
     fprintf(stderr, "done\n");
@@ -1080,16 +1965,12 @@ static int init_vamos(const char *shmkey) {
         vms_shm_buffer_get_avail_events(buffer, &events_num);
 
     struct vms_event_record *event = events;
-    for (int i = 0; i < events_num; ++i) {
-        if (strcmp(event->name, vamos_events[POINTER_MOTION].name) == 0) {
-            vamos_events[POINTER_MOTION].kind = event->kind;
-        } else if (strcmp(event->name, vamos_events[POINTER_MOTION_ABS].name) ==
-                   0) {
-            vamos_events[POINTER_MOTION_ABS].kind = event->kind;
-        } else if (strcmp(event->name, vamos_events[POINTER_BUTTON].name) == 0) {
-            vamos_events[POINTER_BUTTON].kind = event->kind;
-        } else if (strcmp(event->name, vamos_events[KEYBOARD_KEY].name) == 0) {
-            vamos_events[KEYBOARD_KEY].kind = event->kind;
+    for (size_t i = 0; i < events_num; ++i) {
+        for (size_t j = 0; j < vamos_events_num; ++j) {
+            if (strcmp(event->name, vamos_events[j].name) == 0) {
+                vamos_events[j].kind = event->kind;
+                break;
+            }
         }
         ++event;
     }
@@ -1102,6 +1983,10 @@ int main(int argc, char **argv) {
     enum tools_backend backend = BACKEND_NONE;
     const char *seat_or_devices[60] = {NULL};
     const char *shmkey = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    FILE *replay_file = NULL;
+    double replay_speed = 1;
     size_t ndevices = 0;
     bool grab = false;
     bool verbose = false;
@@ -1120,6 +2005,11 @@ int main(int argc, char **argv) {
             OPT_SHOW_KEYCODES,
             OPT_QUIET,
             OPT_SHMKEY,
+            OPT_COALESCE,
+            OPT_QUEUE_SIZE,
+            OPT_RECORD,
+            OPT_REPLAY,
+            OPT_REPLAY_SPEED,
         };
         static struct option opts[] = {
             CONFIGURATION_OPTIONS,
@@ -1128,6 +2018,11 @@ int main(int argc, char **argv) {
             {"device", required_argument, 0, OPT_DEVICE},
             {"udev", required_argument, 0, OPT_UDEV},
             {"shmkey", required_argument, 0, OPT_SHMKEY},
+            {"coalesce", required_argument, 0, OPT_COALESCE},
+            {"queue-size", required_argument, 0, OPT_QUEUE_SIZE},
+            {"record", required_argument, 0, OPT_RECORD},
+            {"replay", required_argument, 0, OPT_REPLAY},
+            {"replay-speed", required_argument, 0, OPT_REPLAY_SPEED},
             {"grab", no_argument, 0, OPT_GRAB},
             {"verbose", no_argument, 0, OPT_VERBOSE},
             {"quiet", no_argument, 0, OPT_QUIET},
@@ -1154,6 +2049,36 @@ int main(int argc, char **argv) {
             case OPT_SHMKEY:
                 shmkey = optarg;
                 break;
+            case OPT_COALESCE: {
+                unsigned int window;
+                if (!safe_atou(optarg, &window)) {
+                    usage();
+                    return EXIT_INVALID_USAGE;
+                }
+                coalesce_window_us = window;
+                break;
+            }
+            case OPT_QUEUE_SIZE: {
+                unsigned int size;
+                if (!safe_atou(optarg, &size) || size == 0) {
+                    usage();
+                    return EXIT_INVALID_USAGE;
+                }
+                queue_capacity = size;
+                break;
+            }
+            case OPT_RECORD:
+                record_path = optarg;
+                break;
+            case OPT_REPLAY:
+                replay_path = optarg;
+                break;
+            case OPT_REPLAY_SPEED:
+                if (!safe_atod(optarg, &replay_speed) || replay_speed < 0) {
+                    usage();
+                    return EXIT_INVALID_USAGE;
+                }
+                break;
             case OPT_DEVICE:
                 if (backend == BACKEND_UDEV ||
                     ndevices >= ARRAY_LENGTH(seat_or_devices)) {
@@ -1206,11 +2131,22 @@ int main(int argc, char **argv) {
         seat_or_devices[0] = "seat0";
     }
 
-    if (shmkey == NULL) {
+    if (shmkey == NULL || (record_path && replay_path)) {
         usage();
         return EXIT_INVALID_USAGE;
     }
 
+    if (replay_path) {
+        replay_file = open_replay(replay_path);
+        if (!replay_file)
+            return EXIT_FAILURE;
+    }
+
+    if (coalesce_window_us > 0) {
+        vamos_events[POINTER_MOTION].sig = "dddddi";
+        vamos_events[POINTER_MOTION_ABS].sig = "dddi";
+    }
+
     memset(&act, 0, sizeof(act));
     act.sa_sigaction = sighandler;
     act.sa_flags = SA_SIGINFO;
@@ -1221,6 +2157,28 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    if (replay_file) {
+        if (init_vamos(shmkey) < 0)
+            return EXIT_FAILURE;
+        replay(replay_file, replay_speed);
+        fclose(replay_file);
+        vms_shm_buffer_release(buffer);
+        vsrc_stats_destroy(stats);
+        free(queue);
+        return EXIT_SUCCESS;
+    }
+
+    if (record_path) {
+        record_file = fopen(record_path, "wb");
+        struct dump_header hdr = {.magic = DUMP_MAGIC,
+                                  .coalesced = coalesce_window_us > 0};
+        if (!record_file || fwrite(&hdr, sizeof(hdr), 1, record_file) != 1) {
+            fprintf(stderr, "Failed creating '%s': %s\n", record_path,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
     li = tools_open_backend(backend, seat_or_devices, verbose, &grab);
     if (!li)
         return EXIT_FAILURE;
@@ -1232,6 +2190,10 @@ int main(int argc, char **argv) {
 
     libinput_unref(li);
     vms_shm_buffer_release(buffer);
+    vsrc_stats_destroy(stats);
+    free(queue);
+    if (record_file)
+        fclose(record_file);
 
     return EXIT_SUCCESS;
 }
@@ -2,17 +2,31 @@
 
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 
 namespace {
 using namespace llvm;
 
+static cl::opt<bool> SummarizeLoops(
+    "vamos-summarize-loops",
+    cl::desc("Replace the instrumentation of strided accesses in loops "
+             "without synchronization by a single range event"),
+    cl::init(true));
+
 struct RaceInstrumentation : public FunctionPass {
     static char ID;
     StructType *thread_data_ty = nullptr;
@@ -20,7 +34,10 @@ struct RaceInstrumentation : public FunctionPass {
     RaceInstrumentation() : FunctionPass(ID) {}
 
     void getAnalysisUsage(AnalysisUsage &Info) const override {
-        Info.setPreservesAll();
+        Info.addRequired<DominatorTreeWrapperPass>();
+        Info.addRequired<LoopInfoWrapperPass>();
+        Info.addRequired<ScalarEvolutionWrapperPass>();
+        Info.setPreservesCFG();
     }
 
     bool runOnFunction(Function &F) override {
@@ -41,6 +58,15 @@ struct RaceInstrumentation : public FunctionPass {
        //errs() << "Instrumenting: ";
        //errs().write_escaped(F.getName()) << '\n';
 
+        if (SummarizeLoops) {
+            auto &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+            auto &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+            auto &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+            for (Loop *L : LI.getLoopsInPreorder()) {
+                changed |= summarizeLoop(L, LI, SE, DT);
+            }
+        }
+
         for (auto &BB : F) {
             changed |= runOnBasicBlock(BB);
         }
@@ -50,6 +76,9 @@ struct RaceInstrumentation : public FunctionPass {
 
     bool runOnBasicBlock(BasicBlock &block);
 
+    bool summarizeLoop(Loop *L, LoopInfo &LI, ScalarEvolution &SE,
+                       DominatorTree &DT);
+
     void instrumentThreadCreate(CallInst *call, int data_idx);
 
     bool instrumentMainFunc(Function *fun);
@@ -97,6 +126,40 @@ static inline bool isThreadExit(Function *fun) {
     return fun->getName().equals("thrd_exit") || fun->getName().equals("pthread_exit");
 }
 
+// Return the size of allocated memory if `fun` is an allocation function
+// (malloc, calloc, aligned_alloc or C++ operator new), nullptr otherwise.
+// May create new instructions before `call`.
+static Value *getAllocSize(Function *fun, CallBase *call) {
+    StringRef name = fun->getName();
+    if (name.equals("malloc") || name.startswith("_Znw") ||
+        name.startswith("_Zna")) {
+        return call->getArgOperand(0);
+    }
+    if (name.equals("aligned_alloc")) {
+        return call->getArgOperand(1);
+    }
+    if (name.equals("calloc")) {
+        return BinaryOperator::CreateMul(call->getArgOperand(0),
+                                         call->getArgOperand(1), "", call);
+    }
+
+    return nullptr;
+}
+
+static inline Value *getFreedPtr(Function *fun, CallBase *call) {
+    StringRef name = fun->getName();
+    if (name.equals("free") || name.startswith("_Zdl") ||
+        name.startswith("_Zda")) {
+        return call->getArgOperand(0);
+    }
+
+    return nullptr;
+}
+
+static inline bool isRealloc(Function *fun) {
+    return fun->getName().equals("realloc");
+}
+
 void RaceInstrumentation::instrumentThreadCreate(CallInst *call, int data_idx) {
     assert(data_idx > 0);
     Module *module = call->getModule();
@@ -205,6 +268,87 @@ static void insertMutexLockOrUnlock(CallInst *call, Value *mtx,
     cast->insertBefore(new_call);
 }
 
+// The free event must be emitted before the memory is freed
+// and the alloc event after it is allocated, otherwise the monitor could see
+// an allocation of memory by one thread before it is freed by another thread.
+static void instrumentFree(CallBase *call, Value *ptr) {
+    Module *module = call->getModule();
+    LLVMContext &ctx = module->getContext();
+
+    const FunctionCallee &fun = module->getOrInsertFunction(
+        "__vrd_free", Type::getVoidTy(ctx), Type::getInt8PtrTy(ctx));
+    auto *cast =
+        CastInst::CreatePointerCast(ptr, Type::getInt8PtrTy(ctx), "", call);
+    std::vector<Value *> args = {cast};
+    auto *new_call = CallInst::Create(fun, args, "", call);
+    new_call->setDebugLoc(call->getDebugLoc());
+}
+
+// `operator new` is called with `invoke` in scopes with cleanups
+// (-fexceptions), then the memory is allocated only on the normal path,
+// so the alloc event goes at the beginning of the normal destination.
+// If the destination has other predecessors, the edge is split first.
+static Instruction *getAllocInsertPt(CallBase *call) {
+    auto *invoke = dyn_cast<InvokeInst>(call);
+    if (!invoke)
+        return call->getNextNode();
+
+    BasicBlock *dest = invoke->getNormalDest();
+    if (!dest->getSinglePredecessor()) {
+        // the normal destination is the successor 0 of invoke
+        dest = SplitCriticalEdge(invoke, 0);
+        if (!dest) {
+            errs() << "Failed splitting the normal edge of " << *invoke
+                   << "\n";
+            return nullptr;
+        }
+    }
+    return &*dest->getFirstInsertionPt();
+}
+
+static void instrumentAlloc(CallBase *call, Value *size) {
+    Module *module = call->getModule();
+    LLVMContext &ctx = module->getContext();
+
+    auto *insert_pt = getAllocInsertPt(call);
+    if (!insert_pt)
+        return;
+
+    const FunctionCallee &fun = module->getOrInsertFunction(
+        "__vrd_alloc", Type::getVoidTy(ctx), Type::getInt8PtrTy(ctx),
+        Type::getInt64Ty(ctx));
+    auto *cast = CastInst::CreatePointerCast(call, Type::getInt8PtrTy(ctx), "",
+                                             insert_pt);
+    auto *size_cast = CastInst::CreateZExtOrBitCast(
+        size, Type::getInt64Ty(ctx), "", insert_pt);
+    std::vector<Value *> args = {cast, size_cast};
+    auto *new_call = CallInst::Create(fun, args, "", insert_pt);
+    new_call->setDebugLoc(call->getDebugLoc());
+}
+
+static void instrumentRealloc(CallInst *call) {
+    Module *module = call->getModule();
+    LLVMContext &ctx = module->getContext();
+
+    instrumentFree(call, call->getArgOperand(0));
+
+    const FunctionCallee &fun = module->getOrInsertFunction(
+        "__vrd_realloc", Type::getVoidTy(ctx), Type::getInt8PtrTy(ctx),
+        Type::getInt8PtrTy(ctx), Type::getInt64Ty(ctx));
+    auto *old_cast = CastInst::CreatePointerCast(call->getArgOperand(0),
+                                                 Type::getInt8PtrTy(ctx));
+    auto *cast = CastInst::CreatePointerCast(call, Type::getInt8PtrTy(ctx));
+    auto *size_cast = CastInst::CreateZExtOrBitCast(call->getArgOperand(1),
+                                                    Type::getInt64Ty(ctx));
+    std::vector<Value *> args = {old_cast, cast, size_cast};
+    auto *new_call = CallInst::Create(fun, args, "");
+    new_call->setDebugLoc(call->getDebugLoc());
+    new_call->insertAfter(call);
+    size_cast->insertBefore(new_call);
+    cast->insertBefore(size_cast);
+    old_cast->insertBefore(cast);
+}
+
 static const Instruction *findInstWithDbg(const BasicBlock *block) {
     for (const auto &inst : *block) {
         if (inst.getDebugLoc())
@@ -274,6 +418,167 @@ static bool instrumentNoreturn(BasicBlock &block,
     return false;
 }
 
+static inline Function *getCalledFunction(CallBase *call) {
+    auto *calledop = call->getCalledOperand()->stripPointerCastsAndAliases();
+    return dyn_cast<Function>(calledop);
+}
+
+// Return the size of the access if `fun` is one of
+// __tsan_{unaligned_,}{read,write}N, 0 otherwise.
+static unsigned getTsanAccessSize(Function *fun, bool &iswrite) {
+    StringRef name = fun->getName();
+    if (!name.consume_front("__tsan_"))
+        return 0;
+    name.consume_front("unaligned_");
+    if (name.consume_front("read")) {
+        iswrite = false;
+    } else if (name.consume_front("write")) {
+        iswrite = true;
+    } else {
+        return 0;
+    }
+
+    unsigned size;
+    if (name.getAsInteger(10, size))
+        return 0;
+    return size;
+}
+
+// The loop does not contain anything that the monitor could use
+// for synchronization, so the order of its memory accesses with respect
+// to each other does not matter. We are conservative and allow only
+// TSAN reads and writes and harmless intrinsics, as any other call
+// can lock a mutex or spawn a thread.
+static bool isSyncFree(Loop *L) {
+    for (auto *block : L->blocks()) {
+        for (auto &I : *block) {
+            if (I.isAtomic())
+                return false;
+
+            auto *call = dyn_cast<CallBase>(&I);
+            if (!call)
+                continue;
+            if (auto *intr = dyn_cast<IntrinsicInst>(call)) {
+                if (isa<DbgInfoIntrinsic>(intr) || intr->isLifetimeStartOrEnd())
+                    continue;
+                return false;
+            }
+
+            auto *fun = getCalledFunction(call);
+            if (!fun)
+                return false;
+
+            bool iswrite;
+            if (getTsanAccessSize(fun, iswrite) > 0 ||
+                fun->getName().equals("__tsan_func_entry") ||
+                fun->getName().equals("__tsan_func_exit"))
+                continue;
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline bool isSafeToExpandAt(const SCEV *S, Instruction *I,
+                                    ScalarEvolution &SE,
+                                    SCEVExpander &expander) {
+#if LLVM_VERSION_MAJOR < 16
+    (void)expander;
+    return llvm::isSafeToExpandAt(S, I, SE);
+#else
+    (void)SE;
+    return expander.isSafeToExpandAt(S, I);
+#endif
+}
+
+// Replace the instrumentation of accesses that happen in every iteration of
+// the loop `L` at addresses `base + i*stride` with a single call to
+// __vrd_range_read/__vrd_range_write(base, stride, count, size) in the
+// preheader of the loop.
+bool RaceInstrumentation::summarizeLoop(Loop *L, LoopInfo &LI,
+                                        ScalarEvolution &SE,
+                                        DominatorTree &DT) {
+    BasicBlock *preheader = L->getLoopPreheader();
+    BasicBlock *latch = L->getLoopLatch();
+    BasicBlock *exiting = L->getExitingBlock();
+    // With a single exiting block that dominates the single latch, every
+    // block that dominates the latch is executed either
+    // backedge-taken-count times (if it is after the exit test) or once more
+    // (if it is before the exit test).
+    if (!preheader || !latch || !exiting || !DT.dominates(exiting, latch))
+        return false;
+
+    const SCEV *btc = SE.getBackedgeTakenCount(L);
+    if (isa<SCEVCouldNotCompute>(btc))
+        return false;
+
+    if (!isSyncFree(L))
+        return false;
+
+    std::vector<CallInst *> accesses;
+    for (auto *block : L->blocks()) {
+        // accesses in subloops are handled (if possible) with the subloop
+        if (LI.getLoopFor(block) != L || !DT.dominates(block, latch))
+            continue;
+        for (auto &I : *block) {
+            if (auto *call = dyn_cast<CallInst>(&I)) {
+                auto *fun = getCalledFunction(call);
+                bool iswrite;
+                if (fun && getTsanAccessSize(fun, iswrite) > 0)
+                    accesses.push_back(call);
+            }
+        }
+    }
+
+    if (accesses.empty())
+        return false;
+
+    Module *module = preheader->getModule();
+    LLVMContext &ctx = module->getContext();
+    Type *i64Ty = Type::getInt64Ty(ctx);
+    Type *i8PtrTy = Type::getInt8PtrTy(ctx);
+    Instruction *insert_pt = preheader->getTerminator();
+    SCEVExpander expander(SE, module->getDataLayout(), "vrd.range");
+
+    bool changed = false;
+    for (CallInst *call : accesses) {
+        auto *addr = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(call->getArgOperand(0)));
+        if (!addr || addr->getLoop() != L || !addr->isAffine())
+            continue;
+        auto *stride = dyn_cast<SCEVConstant>(addr->getStepRecurrence(SE));
+        if (!stride)
+            continue;
+
+        const SCEV *count = SE.getTruncateOrZeroExtend(btc, i64Ty);
+        if (DT.dominates(call->getParent(), exiting)) {
+            count = SE.getAddExpr(count, SE.getOne(i64Ty));
+        }
+
+        if (!isSafeToExpandAt(addr->getStart(), insert_pt, SE, expander) ||
+            !isSafeToExpandAt(count, insert_pt, SE, expander))
+            continue;
+
+        bool iswrite;
+        unsigned size = getTsanAccessSize(getCalledFunction(call), iswrite);
+        const FunctionCallee &range_fun = module->getOrInsertFunction(
+            iswrite ? "__vrd_range_write" : "__vrd_range_read",
+            Type::getVoidTy(ctx), i8PtrTy, i64Ty, i64Ty, i64Ty);
+
+        std::vector<Value *> args = {
+            expander.expandCodeFor(addr->getStart(), i8PtrTy, insert_pt),
+            ConstantInt::get(i64Ty, stride->getAPInt().getSExtValue()),
+            expander.expandCodeFor(count, i64Ty, insert_pt),
+            ConstantInt::get(i64Ty, size)};
+        auto *new_call = CallInst::Create(range_fun, args, "", insert_pt);
+        new_call->setDebugLoc(call->getDebugLoc() ? call->getDebugLoc()
+                                                  : findFirstDbgLoc(call));
+        call->eraseFromParent();
+        changed = true;
+    }
+
+    return changed;
+}
+
 bool RaceInstrumentation::instrumentMainFunc(Function *fun) {
     Module *module = fun->getParent();
     LLVMContext &ctx = module->getContext();
@@ -311,16 +616,29 @@ bool RaceInstrumentation::runOnBasicBlock(BasicBlock &block) {
     std::vector<CallInst *> remove;
     int data_idx = -1;
     for (auto &I : block) {
-        if (CallInst *call = dyn_cast<CallInst>(&I)) {
+        if (CallBase *cb = dyn_cast<CallBase>(&I)) {
             auto *calledop =
-                call->getCalledOperand()->stripPointerCastsAndAliases();
+                cb->getCalledOperand()->stripPointerCastsAndAliases();
             auto *calledfun = dyn_cast<Function>(calledop);
             if (calledfun == nullptr) {
-                errs() << "A call via function pointer ignored: " << *call
+                errs() << "A call via function pointer ignored: " << *cb
                        << "\n";
                 continue;
             }
 
+            // allocations and deallocations may be also invokes
+            if (auto *size = getAllocSize(calledfun, cb)) {
+                instrumentAlloc(cb, size);
+                continue;
+            } else if (auto *ptr = getFreedPtr(calledfun, cb)) {
+                instrumentFree(cb, ptr);
+                continue;
+            }
+
+            CallInst *call = dyn_cast<CallInst>(cb);
+            if (!call)
+                continue;
+
             if (calledfun->getName().startswith("__tsan_")) {
                 // __tsan_* functions may not have dbgloc, workaround that.
                 // We must set it also when we will remove the call,
@@ -342,6 +660,8 @@ bool RaceInstrumentation::runOnBasicBlock(BasicBlock &block) {
                 instrumentThreadJoin(call, data);
             } else if (isThreadExit(calledfun)) {
                 instrumentThreadExit(call);
+            } else if (isRealloc(calledfun)) {
+                instrumentRealloc(call);
             }
         }
     }
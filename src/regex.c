@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "stats/stats.h"
 #include "vamos-buffers/core/event.h"
 #include "vamos-buffers/core/signatures.h"
 #include "vamos-buffers/core/source.h"
@@ -80,6 +81,9 @@ int main(int argc, char *argv[]) {
     assert(shm);
     free(control);
 
+    struct vsrc_stats_page *stats = vsrc_stats_create(shmkey, "regex");
+    struct vsrc_stream_stats *stream = vsrc_stats_add_stream(stats, shmkey);
+
     fprintf(stderr, "info: waiting for the monitor to attach... ");
     vms_shm_buffer_wait_for_reader(shm);
     fprintf(stderr, "done\n");
@@ -107,6 +111,9 @@ int main(int argc, char *argv[]) {
             break;
         if (len == 0)
             continue;
+        /* the time when we observed the line */
+        uint64_t observed = vsrc_stats_now_ns();
+        vsrc_stats_add(stream, VSRC_STATS_BYTES, len);
 
 #ifdef WITH_LINES
         ++ev.line;
@@ -126,8 +133,13 @@ int main(int argc, char *argv[]) {
             printf("{");
             int m = 1;
             void *addr;
+            size_t waited = 0;
             while (!(addr = vms_shm_buffer_start_push(shm))) {
-                ++waiting_for_buffer;
+                ++waited;
+            }
+            if (waited > 0) {
+                waiting_for_buffer += waited;
+                vsrc_stats_add(stream, VSRC_STATS_WAITS, waited);
             }
             /* push the base info about event */
             ++ev.base.id;
@@ -221,6 +233,7 @@ int main(int argc, char *argv[]) {
                 }
             }
             vms_shm_buffer_finish_push(shm);
+            vsrc_stats_published(stream, observed);
             printf("}\n");
         }
     }
@@ -228,6 +241,8 @@ int main(int argc, char *argv[]) {
     /* Free up memory held within the regex memory */
     fprintf(stderr, "info: sent %lu events, busy waited on buffer %lu cycles\n",
             ev.base.id, waiting_for_buffer);
+    vsrc_stats_print(stderr, stats);
+    vsrc_stats_destroy(stats);
     free(tmpline);
     free(line);
     for (int i = 0; i < (int)exprs_num; ++i) {
@@ -0,0 +1,77 @@
+/*
+ * vsrc-stats: print the live statistics of a running source. The source
+ * is not paused or otherwise affected by reading them.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+static void usage_and_exit(int ret) {
+    fprintf(stderr,
+            "Usage: vsrc-stats [-w SEC] shmkey\n"
+            "  -w SEC  print the statistics every SEC seconds until the\n"
+            "          source exits\n");
+    exit(ret);
+}
+
+static volatile sig_atomic_t stop = 0;
+
+static void sig_int(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+    double interval = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:h")) != -1) {
+        switch (opt) {
+            case 'w':
+                interval = atof(optarg);
+                if (interval <= 0)
+                    usage_and_exit(1);
+                break;
+            case 'h':
+                usage_and_exit(0);
+            default:
+                usage_and_exit(1);
+        }
+    }
+    if (optind + 1 != argc) {
+        usage_and_exit(1);
+    }
+
+    const char *shmkey = argv[optind];
+    const struct vsrc_stats_page *page = vsrc_stats_open(shmkey);
+    if (!page) {
+        return 1;
+    }
+
+    vsrc_stats_print(stdout, page);
+    if (interval > 0) {
+        signal(SIGINT, sig_int);
+        struct timespec ts = {.tv_sec = (time_t)interval,
+                              .tv_nsec = (interval - (time_t)interval) * 1e9};
+        /* the source unlinks the page when it exits, we still have it
+         * mapped but it is not updated anymore */
+        while (!stop && nanosleep(&ts, NULL) == 0) {
+            if (kill(page->pid, 0) != 0) {
+                printf("the source exited\n");
+                break;
+            }
+            printf("\n");
+            vsrc_stats_print(stdout, page);
+            fflush(stdout);
+        }
+    }
+
+    vsrc_stats_close(page);
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include "stats.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATS_KEY_SUFFIX ".stats"
+
+/* the stream returned when the page is full, it is not visible to readers */
+static struct vsrc_stream_stats overflow_stream;
+
+/* the key of the page we created (empty if the page is not shared) */
+static char created_key[256];
+
+uint64_t vsrc_stats_now_ns(void) {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static int stats_key(const char *shmkey, char *key, size_t size) {
+    int ret = snprintf(key, size, "%s" STATS_KEY_SUFFIX, shmkey);
+    if (ret < 0 || (size_t)ret >= size) {
+        return -1;
+    }
+    return 0;
+}
+
+static struct vsrc_stats_page *map_page(const char *key) {
+    int fd = shm_open(key, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        fprintf(stderr, "warning: failed creating stats page '%s': %s\n", key,
+                strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(struct vsrc_stats_page)) != 0) {
+        fprintf(stderr, "warning: failed resizing stats page '%s': %s\n", key,
+                strerror(errno));
+        close(fd);
+        shm_unlink(key);
+        return NULL;
+    }
+
+    void *mem = mmap(NULL, sizeof(struct vsrc_stats_page),
+                     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "warning: failed mapping stats page '%s': %s\n", key,
+                strerror(errno));
+        shm_unlink(key);
+        return NULL;
+    }
+    return mem;
+}
+
+struct vsrc_stats_page *vsrc_stats_create(const char *shmkey,
+                                          const char *source) {
+    struct vsrc_stats_page *page = NULL;
+    char key[sizeof(created_key)];
+
+    assert(created_key[0] == '\0' && "Only one stats page per process");
+    if (stats_key(shmkey, key, sizeof(key)) == 0) {
+        page = map_page(key);
+    }
+    if (page) {
+        strcpy(created_key, key);
+    } else {
+        /* keep collecting the statistics so that we can print them */
+        page = calloc(1, sizeof(*page));
+        assert(page && "Allocation failed");
+    }
+
+    page->version = VSRC_STATS_VERSION;
+    page->pid = getpid();
+    page->start_time_ns = vsrc_stats_now_ns();
+    strncpy(page->source, source, VSRC_STATS_NAME_LEN - 1);
+    atomic_init(&page->streams_num, 0);
+    atomic_store_explicit(&page->magic, VSRC_STATS_MAGIC,
+                          memory_order_release);
+    return page;
+}
+
+void vsrc_stats_destroy(struct vsrc_stats_page *page) {
+    if (created_key[0] == '\0') {
+        free(page);
+        return;
+    }
+
+    munmap(page, sizeof(*page));
+    shm_unlink(created_key);
+    created_key[0] = '\0';
+}
+
+struct vsrc_stream_stats *vsrc_stats_add_stream(struct vsrc_stats_page *page,
+                                                const char *name) {
+    uint32_t n = atomic_load_explicit(&page->streams_num, memory_order_relaxed);
+    if (n >= VSRC_STATS_MAX_STREAMS) {
+        fprintf(stderr,
+                "warning: too many streams, not showing stats of '%s'\n",
+                name);
+        return &overflow_stream;
+    }
+
+    struct vsrc_stream_stats *s = &page->streams[n];
+    strncpy(s->name, name, VSRC_STATS_NAME_LEN - 1);
+    /* publish the stream once its name is set */
+    atomic_store_explicit(&page->streams_num, n + 1, memory_order_release);
+    return s;
+}
+
+const struct vsrc_stats_page *vsrc_stats_open(const char *shmkey) {
+    char key[sizeof(created_key)];
+    if (stats_key(shmkey, key, sizeof(key)) != 0) {
+        fprintf(stderr, "The key is too long\n");
+        return NULL;
+    }
+
+    int fd = shm_open(key, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed opening '%s': %s\n", key, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(struct vsrc_stats_page)) {
+        fprintf(stderr, "'%s' is not a stats page\n", key);
+        close(fd);
+        return NULL;
+    }
+
+    void *mem = mmap(NULL, sizeof(struct vsrc_stats_page), PROT_READ,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "Failed mapping '%s': %s\n", key, strerror(errno));
+        return NULL;
+    }
+
+    const struct vsrc_stats_page *page = mem;
+    if (atomic_load_explicit(&page->magic, memory_order_acquire) !=
+            VSRC_STATS_MAGIC ||
+        page->version != VSRC_STATS_VERSION) {
+        fprintf(stderr, "'%s' is not initialized or has a wrong version\n",
+                key);
+        munmap(mem, sizeof(struct vsrc_stats_page));
+        return NULL;
+    }
+    return page;
+}
+
+void vsrc_stats_close(const struct vsrc_stats_page *page) {
+    munmap((void *)page, sizeof(*page));
+}
+
+uint64_t vsrc_stats_percentile(const struct vsrc_stream_stats *s, double q) {
+    uint64_t hist[VSRC_STATS_HIST_BUCKETS];
+    uint64_t total = 0;
+    for (unsigned b = 0; b < VSRC_STATS_HIST_BUCKETS; ++b) {
+        hist[b] = atomic_load_explicit(&s->latency[b], memory_order_relaxed);
+        total += hist[b];
+    }
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total)
+        rank = total - 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < VSRC_STATS_HIST_BUCKETS; ++b) {
+        seen += hist[b];
+        if (seen > rank)
+            return 2ULL << b;
+    }
+    return 2ULL << (VSRC_STATS_HIST_BUCKETS - 1);
+}
+
+static uint64_t counter(const struct vsrc_stream_stats *s,
+                        enum vsrc_stats_counter c) {
+    return atomic_load_explicit(&s->counters[c], memory_order_relaxed);
+}
+
+void vsrc_stats_print(FILE *out, const struct vsrc_stats_page *page) {
+    uint32_t n = atomic_load_explicit(&page->streams_num, memory_order_acquire);
+    double secs = (vsrc_stats_now_ns() - page->start_time_ns) / 1e9;
+
+    fprintf(out, "%s (pid %" PRIu32 "), running %.1f s\n", page->source,
+            page->pid, secs);
+    for (uint32_t i = 0; i < n; ++i) {
+        const struct vsrc_stream_stats *s = &page->streams[i];
+        uint64_t events = counter(s, VSRC_STATS_EVENTS);
+        fprintf(out,
+                "  %s: %" PRIu64 " events (%.0f/s), %" PRIu64
+                " bytes, %" PRIu64 " waits, %" PRIu64 " drops\n",
+                s->name, events, secs > 0 ? events / secs : 0.0,
+                counter(s, VSRC_STATS_BYTES), counter(s, VSRC_STATS_WAITS),
+                counter(s, VSRC_STATS_DROPS));
+
+        uint64_t measured = 0;
+        for (unsigned b = 0; b < VSRC_STATS_HIST_BUCKETS; ++b) {
+            measured +=
+                atomic_load_explicit(&s->latency[b], memory_order_relaxed);
+        }
+        if (measured == 0)
+            continue;
+        uint64_t sum =
+            atomic_load_explicit(&s->latency_sum_ns, memory_order_relaxed);
+        fprintf(out,
+                "    time in source (ns): mean %" PRIu64 ", p50 < %" PRIu64
+                ", p99 < %" PRIu64 ", p99.9 < %" PRIu64 "\n",
+                sum / measured, vsrc_stats_percentile(s, 0.5),
+                vsrc_stats_percentile(s, 0.99),
+                vsrc_stats_percentile(s, 0.999));
+    }
+}
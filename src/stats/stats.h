@@ -0,0 +1,136 @@
+#ifndef VSRC_STATS_H
+#define VSRC_STATS_H
+
+/*
+ * Live statistics of a source.
+ *
+ * Every source creates a stats page in shared memory under the key
+ * `<shmkey>.stats` and registers its event streams there. The source
+ * updates the counters of a stream with plain relaxed atomic stores (or
+ * atomic additions if the stream is shared by several threads), so the
+ * hot path is not slowed down by any synchronization. An external tool
+ * (vsrc-stats) maps the page read-only and can read it at any time without
+ * pausing the source.
+ *
+ * The histogram of time-in-source counts how long it took from the moment
+ * the source observed the input (a line was read, a syscall happened,
+ * an input event was generated...) until the event was published in the
+ * shared buffer. Bucket `i` counts the latencies in [2^i, 2^(i+1)) ns
+ * (bucket 0 has also the latency 0).
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define VSRC_STATS_MAGIC 0x3153544154535356ULL /* "VSSTATS1" */
+#define VSRC_STATS_VERSION 1
+#define VSRC_STATS_MAX_STREAMS 64
+#define VSRC_STATS_NAME_LEN 48
+/* 2^40 ns is more than 18 minutes */
+#define VSRC_STATS_HIST_BUCKETS 40
+
+enum vsrc_stats_counter {
+    /* the number of published events */
+    VSRC_STATS_EVENTS = 0,
+    /* the number of bytes of input (lines, messages...) that were read,
+     * sources that do not read a byte stream (libinput) leave it 0 */
+    VSRC_STATS_BYTES,
+    /* how many times the source found the shared buffer full */
+    VSRC_STATS_WAITS,
+    /* the number of events that were lost */
+    VSRC_STATS_DROPS,
+    VSRC_STATS_COUNTERS_NUM
+};
+
+struct vsrc_stream_stats {
+    char name[VSRC_STATS_NAME_LEN];
+    _Atomic uint64_t counters[VSRC_STATS_COUNTERS_NUM];
+    _Atomic uint64_t latency_sum_ns;
+    _Atomic uint64_t latency[VSRC_STATS_HIST_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct vsrc_stats_page {
+    /* VSRC_STATS_MAGIC, written last when the page is initialized */
+    _Atomic uint64_t magic;
+    uint32_t version;
+    uint32_t pid;
+    /* CLOCK_MONOTONIC time when the page was created */
+    uint64_t start_time_ns;
+    char source[VSRC_STATS_NAME_LEN];
+    /* the number of registered streams, a stream is fully initialized
+     * before this number is increased */
+    _Atomic uint32_t streams_num;
+    struct vsrc_stream_stats streams[VSRC_STATS_MAX_STREAMS];
+};
+
+/* Create the stats page for the source `source` that has the shared buffer
+ * `shmkey`. If the shared memory cannot be created, the page is allocated
+ * privately, so the statistics are still collected (and can be printed).
+ * Never returns NULL. */
+struct vsrc_stats_page *vsrc_stats_create(const char *shmkey,
+                                          const char *source);
+/* Unmap (or free) the page and remove it from the shared memory */
+void vsrc_stats_destroy(struct vsrc_stats_page *page);
+
+/* Register a new stream. If there are too many streams, the returned
+ * stream is valid but not visible in the page. Never returns NULL. */
+struct vsrc_stream_stats *vsrc_stats_add_stream(struct vsrc_stats_page *page,
+                                                const char *name);
+
+/* Open the stats page of the source with the shared buffer `shmkey`
+ * for reading. Returns NULL on error. */
+const struct vsrc_stats_page *vsrc_stats_open(const char *shmkey);
+void vsrc_stats_close(const struct vsrc_stats_page *page);
+
+/* Print the summary of all streams in the page */
+void vsrc_stats_print(FILE *out, const struct vsrc_stats_page *page);
+
+/* Get the latency (in ns) under which `q` (in [0, 1]) of the events
+ * were published (the upper bound of the histogram bucket) */
+uint64_t vsrc_stats_percentile(const struct vsrc_stream_stats *s, double q);
+
+/* CLOCK_MONOTONIC time in nanoseconds */
+uint64_t vsrc_stats_now_ns(void);
+
+/* Add `n` to the counter of a stream that has a single writer */
+static inline void vsrc_stats_add(struct vsrc_stream_stats *s,
+                                  enum vsrc_stats_counter c, uint64_t n) {
+    uint64_t v = atomic_load_explicit(&s->counters[c], memory_order_relaxed);
+    atomic_store_explicit(&s->counters[c], v + n, memory_order_relaxed);
+}
+
+/* Add `n` to the counter of a stream that is written by several threads */
+static inline void vsrc_stats_add_shared(struct vsrc_stream_stats *s,
+                                         enum vsrc_stats_counter c,
+                                         uint64_t n) {
+    atomic_fetch_add_explicit(&s->counters[c], n, memory_order_relaxed);
+}
+
+static inline unsigned vsrc_stats_bucket(uint64_t ns) {
+    unsigned b = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+    return b < VSRC_STATS_HIST_BUCKETS ? b : VSRC_STATS_HIST_BUCKETS - 1;
+}
+
+/* Record that an event was published `ns` nanoseconds after the source
+ * observed its input (single writer) */
+static inline void vsrc_stats_latency(struct vsrc_stream_stats *s,
+                                      uint64_t ns) {
+    _Atomic uint64_t *b = &s->latency[vsrc_stats_bucket(ns)];
+    atomic_store_explicit(b, atomic_load_explicit(b, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    uint64_t sum =
+        atomic_load_explicit(&s->latency_sum_ns, memory_order_relaxed);
+    atomic_store_explicit(&s->latency_sum_ns, sum + ns, memory_order_relaxed);
+}
+
+/* Record a published event that was observed at `observed_ns`
+ * (as returned by vsrc_stats_now_ns) */
+static inline void vsrc_stats_published(struct vsrc_stream_stats *s,
+                                        uint64_t observed_ns) {
+    uint64_t now = vsrc_stats_now_ns();
+    vsrc_stats_add(s, VSRC_STATS_EVENTS, 1);
+    vsrc_stats_latency(s, now > observed_ns ? now - observed_ns : 0);
+}
+
+#endif /* VSRC_STATS_H */
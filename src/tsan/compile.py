@@ -9,6 +9,7 @@ import config
 
 DIR = abspath(dirname(sys.argv[0]))
 LLVM_PASS_DIR = f"{DIR}/../llvm"
+STATS_DIR = f"{DIR}/../stats"
 CFLAGS = ["-std=c11"]
 SHAMON_INCLUDES = [f"-I{config.vamos_buffers_INCLUDE_DIR}"]
 SHAMON_LIBS = [
@@ -51,6 +52,7 @@ class CompileOptions:
         self.asan = False
         self.ubsan = False
         self.dbg_events = False
+        self.loop_summary = True
 
 
 def get_opts(argv):
@@ -93,6 +95,8 @@ def get_opts(argv):
             opts.ubsan = True
         elif argv[i] == "-dbg-events":
             opts.dbg_events = True
+        elif argv[i] == "-no-loop-summary":
+            opts.loop_summary = False
         elif argv[i] == "-omp":
             i += 1
             opts.link_and_instrument.append(argv[i])
@@ -171,12 +175,17 @@ def main(argv):
             opts.optcmd,
             "-load",
             f"{LLVM_PASS_DIR}/race-instrumentation.so",
+        ]
+        # summarizing loops needs SSA form and loops with preheaders
+        + (["-mem2reg", "-loop-simplify"] if opts.loop_summary else [])
+        + [
             "-vamos-race-instrumentation",
             f"{output}.tmp2.bc",
             "-o",
             f"{output}.tmp3.bc",
         ]
         + (["-vamos-print-vars-addr"] if opts.dbg else [])
+        + ([] if opts.loop_summary else ["-vamos-summarize-loops=0"])
         + opt_args
     )
 
@@ -189,6 +198,7 @@ def main(argv):
             f"{DIR}/tsan_impl.c",
             "-o",
             f"{DIR}/tsan_impl.bc",
+            f"-I{DIR}/..",
         ]
         + (["-DDBGBUF"] if opts.dbg else [])
         + (["-DDEBUG_STDOUT"] if opts.dbg_events else [])
@@ -197,6 +207,21 @@ def main(argv):
         + CFLAGS
         + SHAMON_INCLUDES
     )
+    cmd(
+        [
+            opts.clang,
+            "-std=c11",
+            "-D_POSIX_C_SOURCE=200809L",
+            "-emit-llvm",
+            "-c",
+            f"{STATS_DIR}/stats.c",
+            "-o",
+            f"{DIR}/stats.bc",
+        ]
+        + (["-fsanitize=address"] if opts.asan else [])
+        + (["-fsanitize=undefined"] if opts.ubsan else [])
+        + CFLAGS
+    )
     compiled_files_link = [f"{file}.bc" for file in opts.files_noinst]
     for f, out in zip(opts.files_noinst, compiled_files_link):
         cmd(
@@ -210,6 +235,7 @@ def main(argv):
         [
             opts.linkcmd,
             f"{DIR}/tsan_impl.bc",
+            f"{DIR}/stats.bc",
             f"{output}.tmp3.bc",
             "-o",
             f"{output}.tmp4.bc",
@@ -226,7 +252,7 @@ def main(argv):
         + CFLAGS
     )
     cmd(
-        [opts.cc, "-pthread", f"{output}.tmp5.o", "-o", output]
+        [opts.cc, "-pthread", f"{output}.tmp5.o", "-o", output, "-lrt"]
         + (["-fsanitize=address"] if opts.asan else [])
         + (["-fsanitize=undefined"] if opts.ubsan else [])
         + opts.cflags
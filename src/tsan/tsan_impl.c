@@ -1,7 +1,9 @@
 #include <assert.h>
+#include <malloc.h>
 #include <signal.h>
 #include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <threads.h>
 #include <time.h>
@@ -19,6 +21,7 @@
     "[\033[37;2m%lu\033[0m] thread \033[36m%lu\033[0m: ts \033[31m%3lu\033[0m"
 #endif
 
+#include "stats/stats.h"
 #include "vamos-buffers/core/list-embedded.h"
 #include "vamos-buffers/core/source.h"
 #include "vamos-buffers/core/utils.h"
@@ -32,6 +35,22 @@ static CACHELINE_ALIGNED _Atomic size_t timestamp = 1;
 static vms_shm_buffer *top_shmbuf;
 static struct vms_source_control *top_control;
 
+/* Every running thread has its own stream that it updates on every push
+ * (with relaxed stores, it is the only writer), so the live page is up to
+ * date. The streams cannot be removed from the page, so a thread returns its
+ * stream when it exits and a new thread reuses it. If the page is full,
+ * the events of the thread are added to the shared `threads_stats` stream
+ * when the thread exits. */
+static struct vsrc_stats_page *stats;
+static struct vsrc_stream_stats *threads_stats;
+
+static struct {
+    CACHELINE_ALIGNED _Atomic bool lock;
+    struct vsrc_stream_stats *free[VSRC_STATS_MAX_STREAMS];
+    size_t free_num;
+    size_t created;
+} thread_streams;
+
 struct __vrd_thread_data {
     /* The original data and function passed to thrd_create */
     void *orig_data;
@@ -44,6 +63,10 @@ struct __vrd_thread_data {
     uint64_t std_thread_id;
     /* SHM buffer */
     vms_shm_buffer *shmbuf;
+    /* the last event ID pushed into shmbuf */
+    vms_eventid last_id;
+    /* shmbuf was used by another (exited) thread before */
+    bool recycled;
     /* the thread exited? */
     bool exited;
     /* a sync variable for syncronizing the startup with parent */
@@ -56,9 +79,13 @@ struct __vrd_thread_data {
 static CACHELINE_ALIGNED _Thread_local struct _thread_data {
     size_t thread_id;
     vms_eventid last_id;
+    /* last_id when the thread started (the buffer may be recycled) */
+    vms_eventid first_id;
     vms_shm_buffer *shmbuf;
     struct __vrd_thread_data *data;
     size_t waited_for_buffer;
+    /* the stream of this thread or NULL if the stats page is full */
+    struct vsrc_stream_stats *stats;
 } thread_data;
 
 #ifdef DEBUG_STDOUT
@@ -76,7 +103,7 @@ static const size_t dbgbuf_value_size = 24;
 static vms_shm_dbg_buffer *dbgbuf;
 #endif
 
-#define EVENTS_NUM 12
+#define EVENTS_NUM 16
 enum {
     EV_READ = 0,
     EV_WRITE = 1,
@@ -89,24 +116,18 @@ enum {
     EV_FORK = 8,
     EV_JOIN = 9,
     EV_WRITE_N = 10,
-    EV_READ_N = 11
+    EV_READ_N = 11,
+    EV_READ_RANGE = 12,
+    EV_WRITE_RANGE = 13,
+    EV_THREAD_START = 14,
+    EV_FENCE = 15
 };
 
 /* local cache */
 uint64_t event_kinds[EVENTS_NUM];
 
-vms_list_embedded data_list = {&data_list, &data_list};
-
-#ifdef LIST_LOCK_MTX
-static mtx_t list_mtx;
-static inline void lock() { mtx_lock(&list_mtx); }
-static inline bool try_lock() { mtx_try_lock(&list_mtx); }
-static inline void unlock() { mtx_unlock(&list_mtx); }
-#else
 /* An atomic spin lock (well, not exactly spin, we use _mm_pause() to wait
  * a tiny while). Similarly as mtx_t, it is not signal safe. */
-static CACHELINE_ALIGNED _Atomic bool __locked = false;
-
 static inline void _lock(_Atomic bool *_lock) {
     while (atomic_exchange_explicit(_lock, true, memory_order_acquire)) {
         _mm_pause();
@@ -117,15 +138,335 @@ static inline bool _try_lock(_Atomic bool *_lock) {
     return !atomic_exchange_explicit(_lock, true, memory_order_acquire);
 }
 
+/* Try to get the lock, but give up after a while. Used in the signal handler
+ * where the lock may be held by the interrupted thread. */
+static inline bool _try_lock_bounded(_Atomic bool *_lock) {
+    size_t n = 0;
+    while (!_try_lock(_lock)) {
+        if (++n > 1000000) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static inline void _unlock(_Atomic bool *_lock) {
     atomic_store_explicit(_lock, false, memory_order_release);
 }
 
+/* Get a stream for a new thread, NULL if there is no stream left */
+static struct vsrc_stream_stats *take_thread_stream(void) {
+    struct vsrc_stream_stats *s = NULL;
+
+    _lock(&thread_streams.lock);
+    if (thread_streams.free_num > 0) {
+        s = thread_streams.free[--thread_streams.free_num];
+    } else if (atomic_load_explicit(&stats->streams_num,
+                                    memory_order_relaxed) <
+               VSRC_STATS_MAX_STREAMS) {
+        char name[VSRC_STATS_NAME_LEN];
+        snprintf(name, sizeof(name), "%s.thread%lu", shmkey,
+                 thread_streams.created++);
+        s = vsrc_stats_add_stream(stats, name);
+    }
+    _unlock(&thread_streams.lock);
+
+    return s;
+}
+
+/* Give the stream of the current thread to another thread, or add its
+ * events to the shared stream if it has no stream */
+static void account_thread(void) {
+    if (thread_data.stats) {
+        _lock(&thread_streams.lock);
+        thread_streams.free[thread_streams.free_num++] = thread_data.stats;
+        _unlock(&thread_streams.lock);
+        thread_data.stats = NULL;
+        return;
+    }
+
+    vsrc_stats_add_shared(threads_stats, VSRC_STATS_EVENTS,
+                          thread_data.last_id - thread_data.first_id);
+    vsrc_stats_add_shared(threads_stats, VSRC_STATS_WAITS,
+                          thread_data.waited_for_buffer);
+}
+
+#ifdef LIST_LOCK_MTX
+static mtx_t list_mtx;
+static inline void lock() { mtx_lock(&list_mtx); }
+static inline bool try_lock() { mtx_try_lock(&list_mtx); }
+static inline void unlock() { mtx_unlock(&list_mtx); }
+#else
+static CACHELINE_ALIGNED _Atomic bool __locked = false;
+
 static inline void lock() { _lock(&__locked); }
 static inline bool try_lock() { return _try_lock(&__locked); }
 static inline void unlock() { _unlock(&__locked); }
 #endif /* LIST_LOCK_MTX */
 
+/*
+ * Registry of running (and not yet joined) threads.
+ *
+ * The registry is a hash table keyed by the std_thread_id (the ID that we get
+ * from thrd_create/pthread_create). The bucket `i` is guarded by the lock
+ * `i % REGISTRY_LOCKS`, so that creating, exiting and joining threads does
+ * not serialize on a single lock. The table doubles its size when there are
+ * more than REGISTRY_MAX_LOAD threads per bucket, so joining a thread walks
+ * only a few entries however many threads are running. Resizing the table
+ * takes all the locks (in the increasing order).
+ */
+#define REGISTRY_LOCKS_BITS 6
+#define REGISTRY_LOCKS (1 << REGISTRY_LOCKS_BITS)
+#define REGISTRY_MAX_LOAD 2
+
+static vms_list_embedded registry_initial_buckets[REGISTRY_LOCKS];
+
+static struct {
+    struct {
+        CACHELINE_ALIGNED _Atomic bool lock;
+    } locks[REGISTRY_LOCKS];
+    /* a power of 2 that is at least REGISTRY_LOCKS, the buckets and their
+     * number change only when all the locks are held */
+    vms_list_embedded *buckets;
+    _Atomic size_t buckets_num;
+    _Atomic size_t threads_num;
+} registry;
+
+static inline uint64_t registry_hash(uint64_t std_tid) {
+    /* Fibonacci hashing, thread IDs are often pointers or small numbers.
+     * Fold the high bits that are mixed the best into the low bits that
+     * pick the bucket. */
+    uint64_t h = std_tid * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 32);
+}
+
+/* The lock does not depend on the size of the table */
+static inline _Atomic bool *registry_lock(uint64_t hash) {
+    return &registry.locks[hash % REGISTRY_LOCKS].lock;
+}
+
+/* Must be called with the lock of `hash` held */
+static inline vms_list_embedded *registry_bucket(uint64_t hash) {
+    size_t num =
+        atomic_load_explicit(&registry.buckets_num, memory_order_relaxed);
+    return &registry.buckets[hash & (num - 1)];
+}
+
+static void registry_init(void) {
+    for (unsigned i = 0; i < REGISTRY_LOCKS; ++i) {
+        registry.locks[i].lock = false;
+        vms_list_embedded_init(&registry_initial_buckets[i]);
+    }
+    registry.buckets = registry_initial_buckets;
+    registry.buckets_num = REGISTRY_LOCKS;
+    registry.threads_num = 0;
+}
+
+/* Double the number of buckets if there are too many threads */
+static void registry_grow(void) {
+    for (unsigned i = 0; i < REGISTRY_LOCKS; ++i) {
+        _lock(&registry.locks[i].lock);
+    }
+
+    size_t num =
+        atomic_load_explicit(&registry.buckets_num, memory_order_relaxed);
+    /* someone else may have resized the table in the meantime */
+    if (atomic_load_explicit(&registry.threads_num, memory_order_relaxed) >
+        REGISTRY_MAX_LOAD * num) {
+        size_t new_num = 2 * num;
+        vms_list_embedded *buckets = malloc(new_num * sizeof *buckets);
+        /* if the allocation fails, we just keep the old table */
+        if (buckets) {
+            for (size_t i = 0; i < new_num; ++i) {
+                vms_list_embedded_init(&buckets[i]);
+            }
+            struct __vrd_thread_data *data, *tmp;
+            for (size_t i = 0; i < num; ++i) {
+                vms_list_embedded_foreach_safe(data, tmp, &registry.buckets[i],
+                                               list) {
+                    vms_list_embedded_remove(&data->list);
+                    uint64_t hash = registry_hash(data->std_thread_id);
+                    vms_list_embedded_insert_after(
+                        &buckets[hash & (new_num - 1)], &data->list);
+                }
+            }
+            if (registry.buckets != registry_initial_buckets) {
+                free(registry.buckets);
+            }
+            registry.buckets = buckets;
+            atomic_store_explicit(&registry.buckets_num, new_num,
+                                  memory_order_relaxed);
+        }
+    }
+
+    for (unsigned i = REGISTRY_LOCKS; i > 0; --i) {
+        _unlock(&registry.locks[i - 1].lock);
+    }
+}
+
+static void registry_insert(struct __vrd_thread_data *tdata) {
+    uint64_t hash = registry_hash(tdata->std_thread_id);
+    _lock(registry_lock(hash));
+    vms_list_embedded_insert_after(registry_bucket(hash), &tdata->list);
+    _unlock(registry_lock(hash));
+
+    size_t n = atomic_fetch_add_explicit(&registry.threads_num, 1,
+                                         memory_order_relaxed) +
+               1;
+    if (n > REGISTRY_MAX_LOAD * atomic_load_explicit(&registry.buckets_num,
+                                                     memory_order_relaxed)) {
+        registry_grow();
+    }
+}
+
+static void registry_remove(struct __vrd_thread_data *tdata) {
+    uint64_t hash = registry_hash(tdata->std_thread_id);
+    _lock(registry_lock(hash));
+    vms_list_embedded_remove(&tdata->list);
+    _unlock(registry_lock(hash));
+    atomic_fetch_sub_explicit(&registry.threads_num, 1, memory_order_relaxed);
+}
+
+/*
+ * SHM buffers of exited threads that can be re-used by new threads.
+ * Creating a sub-buffer is expensive (shm_open, mmap, the handshake with
+ * the monitor), so instead of destroying the buffer when a thread exits,
+ * we keep it and hand it to the next created thread. Such a thread then
+ * starts with the `thread_start` event so that the monitor knows that
+ * the stream now belongs to a different thread.
+ *
+ * The pool can be also filled with pre-created buffers on startup.
+ * It is configured by environment variables:
+ *   VRD_BUFFER_POOL_SIZE  the number of pre-created buffers (default 0)
+ *   VRD_BUFFER_POOL_MAX   the maximal number of buffers kept in the pool,
+ *                         0 means unlimited (default)
+ */
+struct __vrd_pooled_buffer {
+    vms_shm_buffer *shmbuf;
+    vms_eventid last_id;
+    vms_list_embedded list;
+};
+
+static struct {
+    CACHELINE_ALIGNED _Atomic bool lock;
+    vms_list_embedded list;
+    size_t size;
+    size_t max_size;
+    /* set in __vrd_fini, then returned buffers are destroyed */
+    bool closed;
+
+    /* statistics */
+    size_t hits;
+    size_t misses;
+    size_t not_drained;
+    size_t returned;
+    size_t discarded;
+} buffer_pool = {.list = {&buffer_pool.list, &buffer_pool.list}};
+
+static vms_shm_buffer *pool_get(vms_eventid *last_id) {
+    struct __vrd_pooled_buffer *entry, *found = NULL;
+
+    _lock(&buffer_pool.lock);
+    /* Buffers are returned to the end of the list, so the first ones are
+     * the most likely to be drained by the monitor. We do not hand out
+     * a buffer that still has unread events of the previous thread. */
+    vms_list_embedded_foreach(entry, &buffer_pool.list, list) {
+        if (vms_shm_buffer_size(entry->shmbuf) == 0) {
+            found = entry;
+            break;
+        }
+    }
+    if (found) {
+        vms_list_embedded_remove(&found->list);
+        --buffer_pool.size;
+        ++buffer_pool.hits;
+    } else {
+        if (buffer_pool.size > 0) {
+            ++buffer_pool.not_drained;
+        }
+        ++buffer_pool.misses;
+    }
+    _unlock(&buffer_pool.lock);
+
+    if (!found) {
+        return NULL;
+    }
+
+    vms_shm_buffer *shmbuf = found->shmbuf;
+    *last_id = found->last_id;
+    free(found);
+    return shmbuf;
+}
+
+static void pool_put(vms_shm_buffer *shmbuf, vms_eventid last_id) {
+    struct __vrd_pooled_buffer *entry = malloc(sizeof *entry);
+    if (entry) {
+        entry->shmbuf = shmbuf;
+        entry->last_id = last_id;
+
+        _lock(&buffer_pool.lock);
+        if (!buffer_pool.closed && (buffer_pool.max_size == 0 ||
+                                    buffer_pool.size < buffer_pool.max_size)) {
+            vms_list_embedded_insert_after(buffer_pool.list.prev,
+                                           &entry->list);
+            ++buffer_pool.size;
+            ++buffer_pool.returned;
+            entry = NULL;
+        } else {
+            ++buffer_pool.discarded;
+        }
+        _unlock(&buffer_pool.lock);
+
+        if (!entry) {
+            return;
+        }
+        free(entry);
+    }
+
+    vms_shm_buffer_destroy_sub_buffer(shmbuf);
+}
+
+static size_t env_size(const char *name, size_t dflt) {
+    const char *val = getenv(name);
+    if (!val || *val == '\0') {
+        return dflt;
+    }
+
+    char *end;
+    unsigned long long n = strtoull(val, &end, 10);
+    if (*end != '\0') {
+        fprintf(stderr, "[vamos] warning: invalid value of %s: '%s'\n", name,
+                val);
+        return dflt;
+    }
+    return (size_t)n;
+}
+
+static void pool_init(void) {
+    buffer_pool.max_size = env_size("VRD_BUFFER_POOL_MAX", 0);
+    size_t precreate = env_size("VRD_BUFFER_POOL_SIZE", 0);
+    if (buffer_pool.max_size > 0 && precreate > buffer_pool.max_size) {
+        precreate = buffer_pool.max_size;
+    }
+
+    for (size_t i = 0; i < precreate; ++i) {
+        vms_shm_buffer *shmbuf =
+            vms_shm_buffer_create_sub_buffer(top_shmbuf, 0, top_control);
+        if (!shmbuf) {
+            fprintf(stderr, "[vamos] warning: pre-created only %lu buffers\n",
+                    i);
+            break;
+        }
+        pool_put(shmbuf, 0);
+    }
+    /* do not count the pre-created buffers as returned */
+    buffer_pool.returned = 0;
+}
+
+/* Do not emit alloc and free events for blocks whose usable size is smaller
+ * than this (VRD_ALLOC_THRESHOLD environment variable) */
+static size_t alloc_threshold;
+
 static void (*old_sigabrt_handler)(int);
 static void (*old_sigiot_handler)(int);
 static void (*old_sigsegv_handler)(int);
@@ -148,10 +489,31 @@ static void sig_handler(int sig) {
         }
     }
 
-    vms_list_embedded_foreach(data, &data_list, list) {
-        if (data->shmbuf) {
-            vms_shm_buffer_set_destroyed(data->shmbuf);
+    for (unsigned i = 0; i < REGISTRY_LOCKS; ++i) {
+        /* If the lock is held by an interrupted thread, we cannot walk
+         * the lists safely. Skip its buckets, this is the best effort
+         * anyway. */
+        if (!_try_lock_bounded(&registry.locks[i].lock)) {
+            continue;
+        }
+        size_t num =
+            atomic_load_explicit(&registry.buckets_num, memory_order_relaxed);
+        for (size_t b = i; b < num; b += REGISTRY_LOCKS) {
+            vms_list_embedded_foreach(data, &registry.buckets[b], list) {
+                if (data->shmbuf) {
+                    vms_shm_buffer_set_destroyed(data->shmbuf);
+                }
+            }
+        }
+        _unlock(&registry.locks[i].lock);
+    }
+
+    if (_try_lock_bounded(&buffer_pool.lock)) {
+        struct __vrd_pooled_buffer *entry;
+        vms_list_embedded_foreach(entry, &buffer_pool.list, list) {
+            vms_shm_buffer_set_destroyed(entry->shmbuf);
         }
+        _unlock(&buffer_pool.lock);
     }
 
     if (top_shmbuf) {
@@ -231,12 +593,15 @@ void __vrd_init() {
 #ifdef LIST_LOCK_MTX
     mtx_init(&list_mtx, mtx_plain);
 #endif
+    registry_init();
+
     /* Initialize the info about this source */
     top_control = vms_source_control_define(
-        EVENTS_NUM, "read", "tl", "write", "tl", "atomicread", "tl",
-        "atomicwrite", "tl", "lock", "tl", "unlock", "tl", "alloc", "tll",
+        EVENTS_NUM, "read", "tl", "write", "tl", "atomicread", "tll",
+        "atomicwrite", "tll", "lock", "tl", "unlock", "tl", "alloc", "tll",
         "free", "tl", "fork", "tl", "join", "tl", "write_n", "tll", "read_n",
-        "tll");
+        "tll", "read_range", "tllll", "write_range", "tllll", "thread_start",
+        "tl", "fence", "tl");
     if (!top_control) {
         fprintf(stderr, "Failed creating source control object\n");
         abort();
@@ -248,6 +613,9 @@ void __vrd_init() {
         abort();
     }
 
+    stats = vsrc_stats_create(shmkey, "tsan");
+    threads_stats = vsrc_stats_add_stream(stats, shmkey);
+
     setup_signals();
 
 #ifdef DBGBUF
@@ -266,6 +634,9 @@ void __vrd_init() {
     for (unsigned i = 0; i < EVENTS_NUM; ++i) {
         event_kinds[i] = events[i].kind;
     }
+
+    pool_init();
+    alloc_threshold = env_size("VRD_ALLOC_THRESHOLD", 0);
 }
 
 static void __vrd_fini(void) __attribute__((destructor));
@@ -276,25 +647,53 @@ void __vrd_fini(void) {
     VEC(running_threads, size_t);
     VEC_INIT(running_threads);
 
-    lock();
-    vms_list_embedded_foreach_safe(data, tmp, &data_list, list) {
-        vms_list_embedded_remove(&data->list);
-
-        VEC_PUSH(leaked_threads, &data->thread_id);
-
-        if (data->shmbuf) {
-            VEC_PUSH(running_threads, &data->thread_id);
-            vms_shm_buffer_destroy_sub_buffer(data->shmbuf);
-            data->shmbuf = NULL;
+    for (unsigned i = 0; i < REGISTRY_LOCKS; ++i) {
+        _lock(&registry.locks[i].lock);
+        size_t num =
+            atomic_load_explicit(&registry.buckets_num, memory_order_relaxed);
+        for (size_t b = i; b < num; b += REGISTRY_LOCKS) {
+            vms_list_embedded_foreach_safe(data, tmp, &registry.buckets[b],
+                                           list) {
+                vms_list_embedded_remove(&data->list);
+                atomic_fetch_sub_explicit(&registry.threads_num, 1,
+                                          memory_order_relaxed);
+
+                VEC_PUSH(leaked_threads, &data->thread_id);
+
+                if (data->shmbuf) {
+                    VEC_PUSH(running_threads, &data->thread_id);
+                    vms_shm_buffer_destroy_sub_buffer(data->shmbuf);
+                    data->shmbuf = NULL;
+                }
+                free(data);
+            }
         }
-        free(data);
+        _unlock(&registry.locks[i].lock);
     }
-    unlock();
+
+    struct __vrd_pooled_buffer *entry, *etmp;
+    _lock(&buffer_pool.lock);
+    buffer_pool.closed = true;
+    vms_list_embedded_foreach_safe(entry, etmp, &buffer_pool.list, list) {
+        vms_list_embedded_remove(&entry->list);
+        vms_shm_buffer_destroy_sub_buffer(entry->shmbuf);
+        free(entry);
+    }
+    buffer_pool.size = 0;
+    _unlock(&buffer_pool.lock);
+
+    fprintf(stderr,
+            "info: buffer pool: %lu hits, %lu misses (%lu with no drained "
+            "buffer), %lu buffers returned, %lu discarded\n",
+            buffer_pool.hits, buffer_pool.misses, buffer_pool.not_drained,
+            buffer_pool.returned, buffer_pool.discarded);
 
     bool print_events_no = false;
     lock();
     if (top_shmbuf) {
         print_events_no = true;
+        /* the main thread */
+        account_thread();
         vms_shm_buffer_destroy(top_shmbuf);
 
         assert(thread_data.shmbuf == top_shmbuf);
@@ -305,7 +704,9 @@ void __vrd_fini(void) {
 
     if (print_events_no) {
         fprintf(stderr, "info: number of emitted events: %lu\n", timestamp - 1);
+        vsrc_stats_print(stderr, stats);
     }
+    vsrc_stats_destroy(stats);
     for (unsigned i = 0; i < VEC_SIZE(leaked_threads); ++i) {
         fprintf(stderr, "[vamos] warning: thread %lu leaked\n",
                 leaked_threads[i]);
@@ -323,23 +724,41 @@ void __vrd_fini(void) {
 #endif
 }
 
-static inline void *start_event(vms_shm_buffer *shm, int type) {
+static inline vms_event *reserve_event(vms_shm_buffer *shm) {
     vms_event *ev;
     while (!(ev = vms_shm_buffer_start_push(shm))) {
         ++thread_data.waited_for_buffer;
+        if (thread_data.stats) {
+            vsrc_stats_add(thread_data.stats, VSRC_STATS_WAITS, 1);
+        }
     }
-    /* push the base info about event */
     ev->id = ++thread_data.last_id;
-    ev->kind = event_kinds[type];
-    /* push the timestamp */
-    uint64_t ts =
-        atomic_fetch_add_explicit(&timestamp, 1, memory_order_acq_rel);
+    if (thread_data.stats) {
+        vsrc_stats_add(thread_data.stats, VSRC_STATS_EVENTS, 1);
+    }
+    return ev;
+}
+
+static inline uint64_t next_timestamp(void) {
+    return atomic_fetch_add_explicit(&timestamp, 1, memory_order_acq_rel);
+}
+
+static inline void *push_timestamp(vms_shm_buffer *shm, vms_event *ev,
+                                   uint64_t ts) {
     return vms_shm_buffer_partial_push(
         shm,
         (void *)(((unsigned char *)ev) + sizeof(ev->id) + sizeof(ev->kind)),
         &ts, sizeof(ts));
 }
 
+static inline void *start_event(vms_shm_buffer *shm, int type) {
+    /* push the base info about event */
+    vms_event *ev = reserve_event(shm);
+    ev->kind = event_kinds[type];
+    /* push the timestamp */
+    return push_timestamp(shm, ev, next_timestamp());
+}
+
 void __tsan_func_entry(void *returnaddress) { (void)returnaddress; }
 void __tsan_func_exit(void) {}
 
@@ -361,17 +780,20 @@ void *__vrd_create_thrd(void *original_fun, void *original_data) {
     data->thread_id = tid;
     data->exited = false;
     data->wait_for_parent = 0;
-    data->shmbuf =
-        vms_shm_buffer_create_sub_buffer(thread_data.shmbuf, 0, top_control);
+    data->last_id = 0;
+    data->shmbuf = pool_get(&data->last_id);
+    data->recycled = data->shmbuf != NULL;
+    if (!data->recycled) {
+        data->shmbuf = vms_shm_buffer_create_sub_buffer(thread_data.shmbuf, 0,
+                                                        top_control);
+    }
     if (!data->shmbuf) {
         assert(data->shmbuf && "Failed creating buffer");
         abort();
     }
 
-    lock();
-    vms_list_embedded_insert_after(&data_list, &data->list);
-    unlock();
-
+    /* the data are put into the registry in __vrd_thrd_created
+     * once we know the std_thread_id */
     return data;
 }
 
@@ -379,14 +801,24 @@ void *__vrd_create_thrd(void *original_fun, void *original_data) {
 void __vrd_thrd_created(void *data, uint64_t std_tid) {
     struct __vrd_thread_data *tdata = (struct __vrd_thread_data *)data;
     vms_shm_buffer *shm = thread_data.shmbuf;
-    assert(shm && "Do not have SHM buffer");
-    void *addr = start_event(shm, EV_FORK);
-    vms_shm_buffer_partial_push(shm, addr, &tdata->thread_id,
-                                sizeof(tdata->thread_id));
 #ifdef DEBUG_STDOUT
-    size_t ts = *(size_t *)(((unsigned char *)addr) - sizeof(size_t));
+    size_t ts = 0;
 #endif
-    vms_shm_buffer_finish_push(shm);
+    /* no buffer if the thread is created after its parent was torn down */
+    if (shm) {
+        void *addr = start_event(shm, EV_FORK);
+        vms_shm_buffer_partial_push(shm, addr, &tdata->thread_id,
+                                    sizeof(tdata->thread_id));
+#ifdef DEBUG_STDOUT
+        ts = *(size_t *)(((unsigned char *)addr) - sizeof(size_t));
+#endif
+        vms_shm_buffer_finish_push(shm);
+    }
+
+    tdata->std_thread_id = std_tid;
+    assert(tdata->thread_id > 0 && "invalid ID");
+
+    registry_insert(tdata);
 
     /* notify the thread that it can proceed
        (we cannot allow the thread to emit any events before the fork event is
@@ -395,9 +827,6 @@ void __vrd_thrd_created(void *data, uint64_t std_tid) {
     */
     atomic_store_explicit(&tdata->wait_for_parent, 1, memory_order_release);
 
-    tdata->std_thread_id = std_tid;
-    assert(tdata->thread_id > 0 && "invalid ID");
-
 #ifdef DEBUG_STDOUT
     fprintf(stderr, PRINT_PREFIX " created thread %lu\n", rt_timestamp(),
             thread_data.thread_id, ts, tdata->thread_id);
@@ -408,10 +837,12 @@ static void setup_thread(struct __vrd_thread_data *tdata) {
     assert(tdata != NULL);
 
     thread_data.waited_for_buffer = 0;
-    thread_data.last_id = 0;
+    thread_data.last_id = tdata->last_id;
+    thread_data.first_id = tdata->last_id;
     thread_data.data = tdata;
     thread_data.thread_id = tdata->thread_id;
     thread_data.shmbuf = tdata->shmbuf;
+    thread_data.stats = take_thread_stream();
 
     while (
         !atomic_load_explicit(&tdata->wait_for_parent, memory_order_acquire)) {
@@ -419,15 +850,36 @@ static void setup_thread(struct __vrd_thread_data *tdata) {
          * which must occur before any event in this thread */
         _mm_pause();
     }
+
+    if (tdata->recycled) {
+        /* tell the monitor that the events in this buffer
+         * now come from this thread */
+        vms_shm_buffer *shm = thread_data.shmbuf;
+        void *addr = start_event(shm, EV_THREAD_START);
+        vms_shm_buffer_partial_push(shm, addr, &tdata->thread_id,
+                                    sizeof(tdata->thread_id));
+        vms_shm_buffer_finish_push(shm);
+    }
 }
 
 static void tear_down_thread(struct __vrd_thread_data *tdata) {
-    lock();
-    if (tdata->shmbuf) {
-        vms_shm_buffer_destroy_sub_buffer(tdata->shmbuf);
-        tdata->shmbuf = NULL;
+    _Atomic bool *lock = registry_lock(registry_hash(tdata->std_thread_id));
+    vms_shm_buffer *shmbuf;
+
+    _lock(lock);
+    shmbuf = tdata->shmbuf;
+    tdata->shmbuf = NULL;
+    _unlock(lock);
+
+    if (shmbuf) {
+        account_thread();
+        /* the buffer may be handed to another thread right away, events of
+         * this thread that come after this point (TLS destructors, cleanup
+         * handlers...) are dropped */
+        thread_data.shmbuf = NULL;
+        thread_data.data = NULL;
+        pool_put(shmbuf, thread_data.last_id);
     }
-    unlock();
 }
 
 /* Called at the beginning of the thread routine (or main) */
@@ -453,22 +905,31 @@ int __vrd_run_thread_c11(void *data) {
     return ret;
 }
 
-void __vrd_thrd_exit(void) { tear_down_thread(thread_data.data); }
+void __vrd_thrd_exit(void) {
+    /* the data are gone if the thread was torn down already */
+    if (thread_data.data) {
+        tear_down_thread(thread_data.data);
+    }
+}
 
 void __vrd_setup_main_thread(void) {
     thread_data.waited_for_buffer = 0;
     thread_data.last_id = 0;
+    thread_data.first_id = 0;
     thread_data.data = NULL;
     thread_data.thread_id = 0;
     thread_data.shmbuf = top_shmbuf;
+    thread_data.stats = take_thread_stream();
 }
 
 void __vrd_exit_main_thread(void) {
     fprintf(stderr, "info: number of emitted events: %lu\n", timestamp - 1);
     lock();
     if (top_shmbuf) {
+        account_thread();
         vms_shm_buffer_destroy(top_shmbuf);
         top_shmbuf = NULL;
+        thread_data.shmbuf = NULL;
     }
 #ifdef DBGBUF
     if (dbgbuf) {
@@ -479,9 +940,10 @@ void __vrd_exit_main_thread(void) {
     unlock();
 }
 
-static inline struct __vrd_thread_data *_get_data(uint64_t std_tid) {
+static inline struct __vrd_thread_data *_get_data(vms_list_embedded *bucket,
+                                                  uint64_t std_tid) {
     struct __vrd_thread_data *data;
-    vms_list_embedded_foreach(data, &data_list, list) {
+    vms_list_embedded_foreach(data, bucket, list) {
         if (data->std_thread_id == std_tid) {
             return data;
         }
@@ -490,9 +952,10 @@ static inline struct __vrd_thread_data *_get_data(uint64_t std_tid) {
 }
 
 struct __vrd_thread_data *get_data(uint64_t std_tid) {
-    lock();
-    struct __vrd_thread_data *data = _get_data(std_tid);
-    unlock();
+    uint64_t hash = registry_hash(std_tid);
+    _lock(registry_lock(hash));
+    struct __vrd_thread_data *data = _get_data(registry_bucket(hash), std_tid);
+    _unlock(registry_lock(hash));
     return data;
 }
 
@@ -513,18 +976,21 @@ void *__vrd_thrd_join(uint64_t tid) {
 void __vrd_thrd_joined(void *dataptr) {
     struct __vrd_thread_data *data = (struct __vrd_thread_data *)dataptr;
     vms_shm_buffer *shm = thread_data.shmbuf;
-    void *addr = start_event(shm, EV_JOIN);
 #ifdef DEBUG_STDOUT
-    size_t ts = *(size_t *)(((unsigned char *)addr) - sizeof(size_t));
+    size_t ts = 0;
     size_t tid = data->thread_id;
 #endif
-    vms_shm_buffer_partial_push(shm, addr, &data->thread_id,
-                                sizeof(&data->thread_id));
-    vms_shm_buffer_finish_push(shm);
+    if (shm) {
+        void *addr = start_event(shm, EV_JOIN);
+#ifdef DEBUG_STDOUT
+        ts = *(size_t *)(((unsigned char *)addr) - sizeof(size_t));
+#endif
+        vms_shm_buffer_partial_push(shm, addr, &data->thread_id,
+                                    sizeof(&data->thread_id));
+        vms_shm_buffer_finish_push(shm);
+    }
 
-    lock();
-    vms_list_embedded_remove(&data->list);
-    unlock();
+    registry_remove(data);
     free(data);
 
 #ifdef DEBUG_STDOUT
@@ -535,6 +1001,9 @@ void __vrd_thrd_joined(void *dataptr) {
 
 void __tsan_read1(void *addr) {
     vms_shm_buffer *shm = thread_data.shmbuf;
+    if (!shm) {
+        return;
+    }
     void *mem = start_event(shm, EV_READ);
 #ifdef DEBUG_STDOUT
     size_t ts = *(size_t *)(((unsigned char *)mem) - sizeof(size_t));
@@ -550,6 +1019,9 @@ void __tsan_read1(void *addr) {
 
 void read_N(void *addr, size_t N) {
     vms_shm_buffer *shm = thread_data.shmbuf;
+    if (!shm) {
+        return;
+    }
     void *mem = start_event(shm, EV_READ_N);
 #ifdef DEBUG_STDOUT
     size_t ts = *(size_t *)(((unsigned char *)mem) - sizeof(size_t));
@@ -576,6 +1048,9 @@ void __tsan_unaligned_read1(void *addr) { __tsan_read1(addr); }
 
 void __tsan_write1(void *addr) {
     vms_shm_buffer *shm = thread_data.shmbuf;
+    if (!shm) {
+        return;
+    }
     void *mem = start_event(shm, EV_WRITE);
 #ifdef DEBUG_STDOUT
     size_t ts = *(size_t *)(((unsigned char *)mem) - sizeof(size_t));
@@ -591,6 +1066,9 @@ void __tsan_write1(void *addr) {
 
 void write_N(void *addr, size_t N) {
     vms_shm_buffer *shm = thread_data.shmbuf;
+    if (!shm) {
+        return;
+    }
     void *mem = start_event(shm, EV_WRITE_N);
 #ifdef DEBUG_STDOUT
     size_t ts = *(size_t *)(((unsigned char *)mem) - sizeof(size_t));
@@ -619,8 +1097,121 @@ void *__tsan_memset(void *addr, char c, size_t n) {
     return memset(addr, c, n);
 }
 
+/*
+ * Summarized accesses of a loop.
+ *
+ * The instrumentation replaces `count` accesses of `size` bytes at addresses
+ * `addr`, `addr + stride`, ..., `addr + (count - 1)*stride` (performed by a
+ * loop without any synchronization in its body) with a single event that is
+ * emitted before the loop.
+ */
+static inline void range_N(int type, void *addr, int64_t stride,
+                           uint64_t count, uint64_t size) {
+    if (count == 0) {
+        /* the loop did not iterate */
+        return;
+    }
+
+    vms_shm_buffer *shm = thread_data.shmbuf;
+    if (!shm) {
+        return;
+    }
+    void *mem = start_event(shm, type);
+#ifdef DEBUG_STDOUT
+    size_t ts = *(size_t *)(((unsigned char *)mem) - sizeof(size_t));
+#endif
+    mem = vms_shm_buffer_partial_push(shm, mem, &addr, sizeof(addr));
+    mem = vms_shm_buffer_partial_push(shm, mem, &stride, sizeof(stride));
+    mem = vms_shm_buffer_partial_push(shm, mem, &count, sizeof(count));
+    vms_shm_buffer_partial_push(shm, mem, &size, sizeof(size));
+    vms_shm_buffer_finish_push(shm);
+
+#ifdef DEBUG_STDOUT
+    fprintf(stderr, PRINT_PREFIX " %s%lu(%p, stride %ld, count %lu)\n",
+            rt_timestamp(), thread_data.thread_id, ts,
+            type == EV_READ_RANGE ? "read" : "write", size, addr, stride,
+            count);
+#endif
+}
+
+void __vrd_range_read(void *addr, int64_t stride, uint64_t count,
+                      uint64_t size) {
+    range_N(EV_READ_RANGE, addr, stride, count, size);
+}
+
+void __vrd_range_write(void *addr, int64_t stride, uint64_t count,
+                       uint64_t size) {
+    range_N(EV_WRITE_RANGE, addr, stride, count, size);
+}
+
+/* Is the block at `addr` smaller than VRD_ALLOC_THRESHOLD? The free event
+ * does not know the size that was requested, so both the alloc and the free
+ * event are filtered by the usable size of the block. */
+static inline bool below_alloc_threshold(void *addr) {
+    return alloc_threshold > 0 && malloc_usable_size(addr) < alloc_threshold;
+}
+
+/*
+ * Called after malloc/calloc/new. The monitor can forget everything it knows
+ * about the memory [addr, addr + size).
+ */
+void __vrd_alloc(void *addr, uint64_t size) {
+    vms_shm_buffer *shm = thread_data.shmbuf;
+    /* allocations in constructors that run before __vrd_setup_main_thread
+     * are not reported */
+    if (!addr || !shm || below_alloc_threshold(addr)) {
+        return;
+    }
+
+    void *mem = start_event(shm, EV_ALLOC);
+#ifdef DEBUG_STDOUT
+    size_t ts = *(size_t *)(((unsigned char *)mem) - sizeof(size_t));
+#endif
+    mem = vms_shm_buffer_partial_push(shm, mem, &addr, sizeof(addr));
+    vms_shm_buffer_partial_push(shm, mem, &size, sizeof(size));
+    vms_shm_buffer_finish_push(shm);
+
+#ifdef DEBUG_STDOUT
+    fprintf(stderr, PRINT_PREFIX " alloc(%p, %lu)\n", rt_timestamp(),
+            thread_data.thread_id, ts, addr, size);
+#endif
+}
+
+/* Called before free/delete (and realloc) */
+void __vrd_free(void *addr) {
+    vms_shm_buffer *shm = thread_data.shmbuf;
+    if (!addr || !shm || below_alloc_threshold(addr)) {
+        return;
+    }
+
+    void *mem = start_event(shm, EV_FREE);
+#ifdef DEBUG_STDOUT
+    size_t ts = *(size_t *)(((unsigned char *)mem) - sizeof(size_t));
+#endif
+    vms_shm_buffer_partial_push(shm, mem, &addr, sizeof(addr));
+    vms_shm_buffer_finish_push(shm);
+
+#ifdef DEBUG_STDOUT
+    fprintf(stderr, PRINT_PREFIX " free(%p)\n", rt_timestamp(),
+            thread_data.thread_id, ts, addr);
+#endif
+}
+
+/* Called after realloc, __vrd_free(oldaddr) was called before it */
+void __vrd_realloc(void *oldaddr, void *addr, uint64_t size) {
+    if (addr) {
+        __vrd_alloc(addr, size);
+    } else if (oldaddr && size > 0) {
+        /* realloc failed and the old memory is still there */
+        __vrd_alloc(oldaddr, malloc_usable_size(oldaddr));
+    }
+}
+
 void __vrd_mutex_lock(void *addr) {
     vms_shm_buffer *shm = thread_data.shmbuf;
+    if (!shm) {
+        return;
+    }
     void *mem = start_event(shm, EV_LOCK);
 #ifdef DEBUG_STDOUT
     size_t ts = *(size_t *)(((unsigned char *)mem) - sizeof(size_t));
@@ -636,6 +1227,9 @@ void __vrd_mutex_lock(void *addr) {
 
 void __vrd_mutex_unlock(void *addr) {
     vms_shm_buffer *shm = thread_data.shmbuf;
+    if (!shm) {
+        return;
+    }
     void *mem = start_event(shm, EV_UNLOCK);
 #ifdef DEBUG_STDOUT
     size_t ts = *(size_t *)(((unsigned char *)mem) - sizeof(size_t));
@@ -649,7 +1243,153 @@ void __vrd_mutex_unlock(void *addr) {
 #endif
 }
 
-int __tsan_atomic32_fetch_add(_Atomic int *x, int val, int memory_order) {
-    int tmp = atomic_fetch_add_explicit(x, val, memory_order);
-    return tmp;
+/*
+ * Atomic operations.
+ *
+ * Loads and failed compare-exchanges emit the `atomicread` event,
+ * stores and read-modify-write operations emit the `atomicwrite` event.
+ * Apart from the address, the events carry one word with the memory order
+ * (bits 0-7), the size of the access (bits 8-15) and a flag that the access
+ * was a read-modify-write operation (bit 16).
+ *
+ * No lock is taken, so the atomics keep their progress guarantees and stay
+ * async-signal-safe. Instead, a store takes its timestamp before the
+ * operation and a load after it (the timestamp counter is an acq_rel RMW,
+ * so the operation cannot move over it), which means that a load never has
+ * a smaller timestamp than the store whose value it read. Read-modify-write
+ * operations take the timestamp after the operation. The timestamps of
+ * concurrent writes (stores and RMWs) to the same location may not follow
+ * the order in which the writes happened, and the monitor must tolerate it.
+ */
+
+typedef char __tsan_atomic8;
+typedef short __tsan_atomic16;
+typedef int __tsan_atomic32;
+typedef long __tsan_atomic64;
+
+#define ATOMIC_INFO(T, mo, rmw) \
+    ((uint64_t)(mo) | ((uint64_t)sizeof(T) << 8) | ((uint64_t)(rmw) << 16))
+
+static inline void push_atomic(vms_shm_buffer *shm, vms_event *ev, int type,
+                               uint64_t ts, const volatile void *addr,
+                               uint64_t info) {
+    ev->kind = event_kinds[type];
+    void *mem = push_timestamp(shm, ev, ts);
+    mem = vms_shm_buffer_partial_push(shm, mem, &addr, sizeof(addr));
+    vms_shm_buffer_partial_push(shm, mem, &info, sizeof(info));
+    vms_shm_buffer_finish_push(shm);
+
+#ifdef DEBUG_STDOUT
+    fprintf(stderr, PRINT_PREFIX " atomic %s%lu(%p, mo %lu%s)\n",
+            rt_timestamp(), thread_data.thread_id, ts,
+            type == EV_ATOMIC_READ ? "read" : "write", (info >> 8) & 0xff,
+            addr, info & 0xff, (info >> 16) ? ", rmw" : "");
+#endif
 }
+
+#define DEFINE_ATOMIC_RMW(bits, T, name, OP)                                 \
+    T __tsan_atomic##bits##_##name(volatile T *a, T v, int mo) {           \
+        vms_shm_buffer *shm = thread_data.shmbuf;                          \
+        if (!shm)                                                          \
+            return OP(a, v, mo);                                           \
+        vms_event *ev = reserve_event(shm);                                \
+        T ret = OP(a, v, mo);                                              \
+        uint64_t ts = next_timestamp();                                    \
+        push_atomic(shm, ev, EV_ATOMIC_WRITE, ts, a, ATOMIC_INFO(T, mo, 1)); \
+        return ret;                                                        \
+    }
+
+#define DEFINE_ATOMICS(bits, T)                                              \
+    T __tsan_atomic##bits##_load(const volatile T *a, int mo) {            \
+        vms_shm_buffer *shm = thread_data.shmbuf;                          \
+        if (!shm)                                                          \
+            return __atomic_load_n(a, mo);                                 \
+        vms_event *ev = reserve_event(shm);                                \
+        T ret = __atomic_load_n(a, mo);                                    \
+        uint64_t ts = next_timestamp();                                    \
+        push_atomic(shm, ev, EV_ATOMIC_READ, ts, a, ATOMIC_INFO(T, mo, 0)); \
+        return ret;                                                        \
+    }                                                                      \
+                                                                           \
+    void __tsan_atomic##bits##_store(volatile T *a, T v, int mo) {         \
+        vms_shm_buffer *shm = thread_data.shmbuf;                          \
+        if (!shm) {                                                        \
+            __atomic_store_n(a, v, mo);                                    \
+            return;                                                        \
+        }                                                                  \
+        vms_event *ev = reserve_event(shm);                                \
+        uint64_t ts = next_timestamp();                                    \
+        __atomic_store_n(a, v, mo);                                        \
+        push_atomic(shm, ev, EV_ATOMIC_WRITE, ts, a, ATOMIC_INFO(T, mo, 0)); \
+    }                                                                      \
+                                                                           \
+    DEFINE_ATOMIC_RMW(bits, T, exchange, __atomic_exchange_n)              \
+    DEFINE_ATOMIC_RMW(bits, T, fetch_add, __atomic_fetch_add)              \
+    DEFINE_ATOMIC_RMW(bits, T, fetch_sub, __atomic_fetch_sub)              \
+    DEFINE_ATOMIC_RMW(bits, T, fetch_and, __atomic_fetch_and)              \
+    DEFINE_ATOMIC_RMW(bits, T, fetch_or, __atomic_fetch_or)                \
+    DEFINE_ATOMIC_RMW(bits, T, fetch_xor, __atomic_fetch_xor)              \
+    DEFINE_ATOMIC_RMW(bits, T, fetch_nand, __atomic_fetch_nand)            \
+                                                                           \
+    static inline int atomic##bits##_cas(volatile T *a, T *c, T v, int mo, \
+                                         int fmo, bool weak) {             \
+        vms_shm_buffer *shm = thread_data.shmbuf;                          \
+        if (!shm)                                                          \
+            return __atomic_compare_exchange_n(a, c, v, weak, mo, fmo);    \
+        vms_event *ev = reserve_event(shm);                                \
+        int ret = __atomic_compare_exchange_n(a, c, v, weak, mo, fmo);     \
+        uint64_t ts = next_timestamp();                                    \
+        if (ret) {                                                         \
+            push_atomic(shm, ev, EV_ATOMIC_WRITE, ts, a,                   \
+                        ATOMIC_INFO(T, mo, 1));                            \
+        } else {                                                           \
+            push_atomic(shm, ev, EV_ATOMIC_READ, ts, a,                    \
+                        ATOMIC_INFO(T, fmo, 0));                           \
+        }                                                                  \
+        return ret;                                                        \
+    }                                                                      \
+                                                                           \
+    int __tsan_atomic##bits##_compare_exchange_strong(                     \
+        volatile T *a, T *c, T v, int mo, int fmo) {                       \
+        return atomic##bits##_cas(a, c, v, mo, fmo, false);                \
+    }                                                                      \
+                                                                           \
+    int __tsan_atomic##bits##_compare_exchange_weak(                       \
+        volatile T *a, T *c, T v, int mo, int fmo) {                       \
+        return atomic##bits##_cas(a, c, v, mo, fmo, true);                 \
+    }                                                                      \
+                                                                           \
+    T __tsan_atomic##bits##_compare_exchange_val(volatile T *a, T c, T v,  \
+                                                 int mo, int fmo) {        \
+        atomic##bits##_cas(a, &c, v, mo, fmo, false);                      \
+        return c;                                                          \
+    }
+
+DEFINE_ATOMICS(8, __tsan_atomic8)
+DEFINE_ATOMICS(16, __tsan_atomic16)
+DEFINE_ATOMICS(32, __tsan_atomic32)
+DEFINE_ATOMICS(64, __tsan_atomic64)
+
+void __tsan_atomic_thread_fence(int mo) {
+    vms_shm_buffer *shm = thread_data.shmbuf;
+    if (!shm) {
+        __atomic_thread_fence(mo);
+        return;
+    }
+    void *mem = start_event(shm, EV_FENCE);
+#ifdef DEBUG_STDOUT
+    size_t ts = *(size_t *)(((unsigned char *)mem) - sizeof(size_t));
+#endif
+    uint64_t order = mo;
+    vms_shm_buffer_partial_push(shm, mem, &order, sizeof(order));
+    vms_shm_buffer_finish_push(shm);
+
+    __atomic_thread_fence(mo);
+
+#ifdef DEBUG_STDOUT
+    fprintf(stderr, PRINT_PREFIX " fence(mo %d)\n", rt_timestamp(),
+            thread_data.thread_id, ts, mo);
+#endif
+}
+
+void __tsan_atomic_signal_fence(int mo) { __atomic_signal_fence(mo); }
@@ -36,13 +36,17 @@
  */
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
 #include <wayland-client-protocol.h>
 #include <wldbg.h>
 
+#include "stats/stats.h"
 #include "vamos-buffers/core/event.h"
 #include "vamos-buffers/core/signatures.h"
 #include "vamos-buffers/core/source.h"
@@ -59,16 +63,9 @@
 #define print_message(m)
 #endif
 
-static void send_event(struct wldbg_message *message);
+static void send_event(struct wldbg_message *message, bool from_server);
 
 
-// milisec. precise time
-static inline double get_mono_time() {
-    struct timespec tp;
-    clock_gettime(CLOCK_MONOTONIC, &tp);
-    return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
-}
-
 struct pass_data {
     unsigned int incoming_number;
     unsigned int outcoming_number;
@@ -88,66 +85,326 @@ vms_eventid top_buffer_eventid;
 
 static size_t waiting_for_buffer = 0;
 
-/* To add a new traced event,
- *   1) add its index into this enum here,
- *   2) add an entry into `vamos_events`,
- *   3) add it into `sub_control`
- *   4) register it in `connection_data` function.
- *   5) add a handler to it
- * Remember that in steps 1)-2) the order of the events does matter,
- * meaning that POINTER_MOTION _is_ the index of "pointer_motion" entry
- * in `vamos_events`.
- */
-enum vamos_event_idx {
-    /* IMPORTANT: these are indices of an array, so they must be 0, 1, ... */
-    POINTER_MOTION = 0,
-    POINTER_BUTTON = 1,
-    POINTER_ENTRY  = 2,
-    POINTER_LEAVE  = 3,
-    KEYBOARD_KEY   = 4,
-    LAST_IDX = KEYBOARD_KEY,
-    INVALID_IDX = 0xffff
+/* the events of all clients are counted in one stream */
+static struct vsrc_stats_page *stats;
+static struct vsrc_stream_stats *stream_stats;
+
+/* The number of argument words of a message in the `raw_message` event */
+#define RAW_WORDS 8
+
+/* The events of a connection are collected in a batch that is published
+ * into the sub-buffer at once when wldbg starts forwarding messages in the
+ * other direction (i.e., it is done with the data it read from one side),
+ * when the batch is full, or when its oldest event is older than
+ * BATCH_MAX_DELAY_MS. The last case does not wait for more messages: the
+ * batch timer is armed when a batch is started and it flushes the batches
+ * of all connections from the wldbg event loop. If the timer cannot be set
+ * up, every batch is published once its message is processed. */
+#define BATCH_SIZE 32
+#define BATCH_ARGS_SIZE 64
+#define BATCH_MAX_DELAY_MS 5
+
+struct batched_event {
+    /* the size of the event including the header */
+    size_t size;
+    /* when we got the message of the event (for stats) */
+    uint64_t observed_ns;
+    vms_event base;
+    unsigned char args[BATCH_ARGS_SIZE];
 };
 
-struct kind_mapping {
-    const char *name;
+struct connection_data;
+
+typedef int (*write_event_fn)(struct connection_data *data,
+                              struct wldbg_resolved_message *rm,
+                              size_t event_idx, double time);
+
+static int write_event_args32(struct connection_data *data,
+                              struct wldbg_resolved_message *rm,
+                              size_t event_idx, double time);
+
+/* The Wayland messages that are turned into events, one event per message.
+ * To trace a new message, add a row here: the sub-buffer event, the lookup
+ * table and the kind of the event are all derived from this table.
+ * The index of the row is the index of its event in `sub_control`
+ * and in `connection_data.kinds`. */
+static const struct traced_message {
+    /* the event */
+    const char *event_name;
     const char *sig;
-    vms_kind kind;
-} vamos_events[] = {
-    /* the order of events must match the indices
-     * in the enum vamos_event_idx */
-    {"pointer_motion", "diii", 0},
-    {"pointer_button", "diiii", 0},
-    {"pointer_entry", "diiii", 0},
-    {"pointer_leave", "dii", 0},
-    {"keyboard_key", "diiii", 0},
+    /* the message */
+    const struct wl_interface *interface;
+    /* an event (from the server) or a request (from the client) */
+    bool from_server;
+    const char *name;
+    write_event_fn write;
+} traced_messages[] = {
+    {"pointer_motion", "diii", &wl_pointer_interface, true, "motion",
+     write_event_args32},
+    {"pointer_button", "diiii", &wl_pointer_interface, true, "button",
+     write_event_args32},
+    {"pointer_entry", "diiii", &wl_pointer_interface, true, "enter",
+     write_event_args32},
+    {"pointer_leave", "dii", &wl_pointer_interface, true, "leave",
+     write_event_args32},
+    {"keyboard_key", "diiii", &wl_keyboard_interface, true, "key",
+     write_event_args32},
 };
 
+#define TRACED_MESSAGES_NUM (sizeof traced_messages / sizeof traced_messages[0])
+
+/* The messages that are not traced are forwarded in the `raw_message` event
+ * that comes after the traced ones: time, from server, object id, opcode,
+ * size in bytes and the first RAW_WORDS words of the arguments (padded with
+ * zeros) */
+#define RAW_MESSAGE TRACED_MESSAGES_NUM
+#define RAW_MESSAGE_NAME "raw_message"
+#define RAW_MESSAGE_SIG "dciiiiiiiiiii"
+
+#define EVENTS_NUM (TRACED_MESSAGES_NUM + 1)
+
+static const char *event_name(size_t event_idx) {
+    return event_idx == RAW_MESSAGE ? RAW_MESSAGE_NAME
+                                    : traced_messages[event_idx].event_name;
+}
+
+static const char *event_sig(size_t event_idx) {
+    return event_idx == RAW_MESSAGE ? RAW_MESSAGE_SIG
+                                    : traced_messages[event_idx].sig;
+}
+
+/* Messages with a bigger opcode are never traced */
+#define MAX_OPCODE 32
+
+/* The ids of the objects created by the server start here */
+#define SERVER_ID_START 0xff000000
+/* We do not remember the interfaces of objects with a bigger id (the client
+ * reuses the ids of deleted objects, so they stay small) */
+#define MAX_OBJECT_ID (1 << 20)
+/* The opcode of the wl_display.delete_id event */
+#define DISPLAY_DELETE_ID 1
+
 struct connection_data {
     vms_eventid next_id;
     vms_shm_buffer *buffer;
     size_t waiting_for_buffer;
 
-    struct kind_mapping events[sizeof vamos_events / sizeof vamos_events[0]];
+    /* The lookup table built from the events that the monitor wants.
+     * `message_table[from_server][opcode]` are the indices into
+     * `traced_messages` of the wanted messages with this opcode, terminated
+     * by -1. The messages with an empty entry are rejected without resolving
+     * them. There are only a few traced messages, so we only compare
+     * the interface of the message with the listed ones. */
+    signed char message_table[2][MAX_OPCODE][TRACED_MESSAGES_NUM + 1];
+    /* The interfaces of the objects created by the client indexed by their
+     * ids, NULL if we do not know it. It is filled from the requests that
+     * create new objects (e.g., wl_seat.get_pointer) and from the resolved
+     * messages, so that the messages of objects with an interface that is
+     * not traced are rejected without resolving them. */
+    const struct wl_interface **objects;
+    size_t objects_num;
+    /* the direction of the last message */
+    bool last_from_server;
+    /* the time of the first event in the batch */
+    double batch_start;
+    /* when we got the message that is being processed */
+    uint64_t observed_ns;
+    size_t batch_len;
+    struct batched_event batch[BATCH_SIZE];
+    /* all connections are linked, so that the timer can flush them */
+    struct connection_data *next;
+    struct connection_data **prev;
+
+    /* the kinds of the events indexed as `traced_messages`
+     * (0 if the monitor does not want the event) */
+    vms_kind kinds[EVENTS_NUM];
 };
 
-static int handle_keyboard_message(struct wldbg_resolved_message *rm,
-                                   struct connection_data *data);
+static struct connection_data *connections;
 
-static int handle_pointer_message(struct wldbg_resolved_message *rm,
-                                  struct connection_data *data);
+/* the timer that flushes the batches, -1 if there is none */
+static int batch_timer_fd = -1;
+static bool batch_timer_armed = false;
+static struct wldbg *batch_timer_wldbg;
+static struct wldbg_fd_callback *batch_timer_cb;
 
 static unsigned char *data_ptr(struct connection_data *data) {
     unsigned char *addr;
     while (!(addr = vms_shm_buffer_start_push(data->buffer))) {
         ++data->waiting_for_buffer;
+        vsrc_stats_add(stream_stats, VSRC_STATS_WAITS, 1);
     }
 
     return addr;
 }
 
+static void flush_batch(struct connection_data *data) {
+    for (size_t i = 0; i < data->batch_len; ++i) {
+        struct batched_event *ev = &data->batch[i];
+        unsigned char *addr = data_ptr(data);
+        vms_shm_buffer_partial_push(data->buffer, addr, &ev->base, ev->size);
+        vms_shm_buffer_finish_push(data->buffer);
+        vsrc_stats_published(stream_stats, ev->observed_ns);
+    }
+    data->batch_len = 0;
+}
+
+static void arm_batch_timer(void) {
+    if (batch_timer_fd < 0 || batch_timer_armed)
+        return;
+
+    struct itimerspec its = {
+        .it_value = {.tv_nsec = BATCH_MAX_DELAY_MS * 1000000L}};
+    if (timerfd_settime(batch_timer_fd, 0, &its, NULL) == 0)
+        batch_timer_armed = true;
+}
+
+/* The timer expired, publish the batches of all connections. They are at
+ * most BATCH_MAX_DELAY_MS old, as the timer was armed with the oldest one. */
+static int dispatch_batch_timer(int fd, void *user_data) {
+    (void)user_data;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0)
+        return 0;
+
+    batch_timer_armed = false;
+    for (struct connection_data *data = connections; data; data = data->next)
+        flush_batch(data);
+    return 0;
+}
+
+static void init_batch_timer(struct wldbg *wldbg) {
+    batch_timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (batch_timer_fd < 0) {
+        fprintf(stderr, "warning: failed creating the batch timer, "
+                        "batches are published after every message\n");
+        return;
+    }
+
+    batch_timer_cb =
+        wldbg_monitor_fd(wldbg, batch_timer_fd, dispatch_batch_timer, NULL);
+    if (!batch_timer_cb) {
+        fprintf(stderr, "warning: failed monitoring the batch timer, "
+                        "batches are published after every message\n");
+        close(batch_timer_fd);
+        batch_timer_fd = -1;
+        return;
+    }
+    batch_timer_wldbg = wldbg;
+}
+
+static void destroy_batch_timer(void) {
+    if (batch_timer_fd < 0)
+        return;
+    wldbg_remove_callback(batch_timer_wldbg, batch_timer_cb);
+    close(batch_timer_fd);
+    batch_timer_fd = -1;
+}
+
+/* Start a new event in the batch and write its header and time.
+ * Returns the address where the rest of the arguments go. */
+static unsigned char *batch_start_event(struct connection_data *data,
+                                        size_t event_idx, double time) {
+    if (data->batch_len == BATCH_SIZE)
+        flush_batch(data);
+    if (data->batch_len == 0) {
+        data->batch_start = time;
+        arm_batch_timer();
+    }
+
+    struct batched_event *ev = &data->batch[data->batch_len];
+    ev->base.kind = data->kinds[event_idx];
+    ev->base.id = ++data->next_id;
+    ev->observed_ns = data->observed_ns;
+    memcpy(ev->args, &time, sizeof(time));
+    return ev->args + sizeof(time);
+}
+
+static unsigned char *batch_push(unsigned char *addr, const void *elem,
+                                 size_t size) {
+    memcpy(addr, elem, size);
+    return addr + size;
+}
+
+static void batch_finish_event(struct connection_data *data,
+                               unsigned char *end) {
+    struct batched_event *ev = &data->batch[data->batch_len++];
+    ev->size = end - (unsigned char *)&ev->base;
+}
+
 struct vms_source_control *sub_control;
 
+/* Creating a sub-buffer takes a while and a new client waits for it before
+ * its first message gets through. So we keep a pool of sub-buffers that
+ * were created ahead and give them to new clients in the order they were
+ * created. Released sub-buffers cannot be reused, the monitor ties each
+ * one to a single client. The pool is filled lazily when a client
+ * disconnects, which is when short-lived clients typically come and go,
+ * and nobody waits for us. */
+#define SUB_BUFFER_CAPACITY 100
+
+static struct {
+    vms_shm_buffer **buffers;
+    /* the maximal number of ready sub-buffers, 0 disables the pool */
+    size_t size;
+    size_t head;
+    size_t len;
+
+    /* statistics */
+    size_t hits;
+    size_t misses;
+    size_t created;
+} sub_pool = {.size = 4};
+
+static vms_shm_buffer *create_sub_buffer(void) {
+    assert(top_buffer && "No top-level SHM buffer");
+    assert(sub_control);
+    return vms_shm_buffer_create_sub_buffer(top_buffer, SUB_BUFFER_CAPACITY,
+                                            sub_control);
+}
+
+static void fill_sub_pool(void) {
+    while (sub_pool.len < sub_pool.size) {
+        vms_shm_buffer *buffer = create_sub_buffer();
+        if (!buffer) {
+            fprintf(stderr, "Failed creating shm buffer for the pool\n");
+            return;
+        }
+        sub_pool.buffers[(sub_pool.head + sub_pool.len) % sub_pool.size] =
+            buffer;
+        ++sub_pool.len;
+        ++sub_pool.created;
+    }
+}
+
+static vms_shm_buffer *take_sub_buffer(void) {
+    if (sub_pool.len > 0) {
+        vms_shm_buffer *buffer = sub_pool.buffers[sub_pool.head];
+        sub_pool.head = (sub_pool.head + 1) % sub_pool.size;
+        --sub_pool.len;
+        ++sub_pool.hits;
+        return buffer;
+    }
+
+    ++sub_pool.misses;
+    return create_sub_buffer();
+}
+
+static void destroy_sub_pool(void) {
+    fprintf(stderr,
+            "info: sub-buffer pool: %zu clients got a ready sub-buffer, %zu "
+            "waited for creating one, %zu sub-buffers created ahead, %zu "
+            "unused\n",
+            sub_pool.hits, sub_pool.misses, sub_pool.created, sub_pool.len);
+
+    for (; sub_pool.len > 0; --sub_pool.len) {
+        vms_shm_buffer_release_sub_buffer(sub_pool.buffers[sub_pool.head]);
+        sub_pool.head = (sub_pool.head + 1) % sub_pool.size;
+    }
+    free(sub_pool.buffers);
+}
+
 static vms_shm_buffer *init_vamos(const char *shmkey) {
     struct vms_source_control *top_control =
         vms_source_control_define(2, "client_new", "i", "client_exit", "i");
@@ -157,19 +414,23 @@ static vms_shm_buffer *init_vamos(const char *shmkey) {
         return NULL;
     }
 
-    sub_control = vms_source_control_define(
-        sizeof vamos_events / sizeof vamos_events[0],
-        vamos_events[POINTER_MOTION].name, vamos_events[POINTER_MOTION].sig,
-        vamos_events[POINTER_BUTTON].name, vamos_events[POINTER_BUTTON].sig,
-        vamos_events[POINTER_ENTRY].name, vamos_events[POINTER_ENTRY].sig,
-        vamos_events[POINTER_LEAVE].name, vamos_events[POINTER_LEAVE].sig,
-        vamos_events[KEYBOARD_KEY].name, vamos_events[KEYBOARD_KEY].sig);
+    const char *names[EVENTS_NUM];
+    const char *signatures[EVENTS_NUM];
+    for (size_t i = 0; i < EVENTS_NUM; ++i) {
+        names[i] = event_name(i);
+        signatures[i] = event_sig(i);
+    }
+    sub_control =
+        vms_source_control_define_pairwise(EVENTS_NUM, names, signatures);
     if (!sub_control) {
         fprintf(stderr, "%s:%d: Failed defining source control\n", __FILE__,
                 __LINE__);
         free(top_control);
         return NULL;
     }
+    assert(source_control_max_event_size(sub_control) <=
+               sizeof(vms_event) + BATCH_ARGS_SIZE &&
+           "Events do not fit into the batch");
 
     const size_t capacity = 128;
     top_buffer = vms_shm_buffer_create(shmkey, capacity, top_control);
@@ -180,10 +441,14 @@ static vms_shm_buffer *init_vamos(const char *shmkey) {
         return NULL;
     }
 
+    stats = vsrc_stats_create(shmkey, "wldbg");
+    stream_stats = vsrc_stats_add_stream(stats, shmkey);
+
     fprintf(stderr, "info: waiting for the monitor to attach... ");
     if (vms_shm_buffer_wait_for_reader(top_buffer) < 0) {
         fprintf(stderr, "Failed waiting for the monitor to attach...\n");
         vms_shm_buffer_destroy(top_buffer);
+        vsrc_stats_destroy(stats);
         free(top_control);
         free(sub_control);
         return NULL;
@@ -207,10 +472,142 @@ static vms_shm_buffer *init_vamos(const char *shmkey) {
     return top_buffer;
 }
 
+static int find_opcode(const struct wl_message *messages, int count,
+                       const char *name) {
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(messages[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void build_message_table(struct connection_data *data) {
+    size_t table_len[2][MAX_OPCODE] = {0};
+
+    for (size_t i = 0; i < TRACED_MESSAGES_NUM; ++i) {
+        const struct traced_message *msg = &traced_messages[i];
+        if (data->kinds[i] == 0)
+            continue;
+
+        const struct wl_interface *iface = msg->interface;
+        int opcode = msg->from_server
+                         ? find_opcode(iface->events, iface->event_count,
+                                       msg->name)
+                         : find_opcode(iface->methods, iface->method_count,
+                                       msg->name);
+        assert(opcode >= 0 && "Unknown message");
+        if (opcode < 0 || opcode >= MAX_OPCODE)
+            continue;
+
+        size_t *len = &table_len[msg->from_server][opcode];
+        data->message_table[msg->from_server][opcode][(*len)++] = i;
+    }
+
+    for (int from = 0; from < 2; ++from) {
+        for (int opcode = 0; opcode < MAX_OPCODE; ++opcode)
+            data->message_table[from][opcode][table_len[from][opcode]] = -1;
+    }
+}
+
+/* Get the index of the traced message with this interface and opcode or -1 */
+static int lookup_message(struct connection_data *data,
+                          const struct wl_interface *iface, bool from_server,
+                          uint32_t opcode) {
+    if (opcode >= MAX_OPCODE)
+        return -1;
+    const signed char *idx = data->message_table[from_server][opcode];
+    for (; *idx >= 0; ++idx) {
+        if (traced_messages[*idx].interface == iface)
+            return *idx;
+    }
+    return -1;
+}
+
+static const struct wl_interface *object_interface(
+    struct connection_data *data, uint32_t id) {
+    return id < data->objects_num ? data->objects[id] : NULL;
+}
+
+static void set_object_interface(struct connection_data *data, uint32_t id,
+                                 const struct wl_interface *iface) {
+    if (id >= MAX_OBJECT_ID)
+        return;
+    if (id >= data->objects_num) {
+        if (!iface)
+            return;
+        size_t num = data->objects_num ? data->objects_num : 64;
+        while (num <= id)
+            num *= 2;
+        const struct wl_interface **objects =
+            realloc(data->objects, num * sizeof *objects);
+        if (!objects) {
+            fprintf(stderr, "Failed memory allocation");
+            abort();
+        }
+        memset(objects + data->objects_num, 0,
+               (num - data->objects_num) * sizeof *objects);
+        data->objects = objects;
+        data->objects_num = num;
+    }
+    data->objects[id] = iface;
+}
+
+/* Remember the interfaces of the objects that are created by the request
+ * `opcode` of an object with the interface `iface`. The message is not
+ * resolved, we walk its signature to find the typed new_id arguments. */
+static void record_new_objects(struct connection_data *data,
+                               const struct wl_interface *iface,
+                               uint32_t opcode, const uint32_t *words,
+                               size_t words_num) {
+    if (opcode >= (uint32_t)iface->method_count)
+        return;
+
+    const struct wl_message *m = &iface->methods[opcode];
+    /* skip the object id and opcode/size */
+    size_t w = 2;
+    size_t arg = 0;
+    for (const char *c = m->signature; *c && w <= words_num; ++c) {
+        switch (*c) {
+        case 'n':
+            if (w < words_num && m->types[arg])
+                set_object_interface(data, words[w], m->types[arg]);
+            ++w;
+            break;
+        case 'i':
+        case 'u':
+        case 'f':
+        case 'o':
+            ++w;
+            break;
+        case 's':
+        case 'a':
+            /* the length in bytes and the padded data */
+            if (w >= words_num)
+                return;
+            w += 1 + (words[w] + 3) / 4;
+            break;
+        case 'h':
+            /* file descriptors are not in the data */
+            break;
+        default:
+            /* '?' or the version */
+            continue;
+        }
+        ++arg;
+    }
+}
+
 static void destroy_data(struct wldbg_connection *conn, void *data) {
     struct connection_data *cdata = (struct connection_data *)data;
+    flush_batch(cdata);
+    *cdata->prev = cdata->next;
+    if (cdata->next)
+        cdata->next->prev = cdata->prev;
     vms_shm_buffer_release_sub_buffer(cdata->buffer);
+    free(cdata->objects);
     free(data);
+
+    fill_sub_pool();
 }
 
 struct connection_data *get_connection_data(struct wldbg_message *msg) {
@@ -225,11 +622,7 @@ struct connection_data *get_connection_data(struct wldbg_message *msg) {
     fprintf(stderr, "Creating a new sub-buffer for PID %d\n", pid);
 
     /* TODO new client found */
-    assert(top_buffer && "No top-level SHM buffer");
-    assert(sub_control);
-    const size_t capacity = 100;
-    vms_shm_buffer *buffer =
-        vms_shm_buffer_create_sub_buffer(top_buffer, capacity, sub_control);
+    vms_shm_buffer *buffer = take_sub_buffer();
 
     if (!buffer) {
         fprintf(stderr, "Failed creating shm buffer\n");
@@ -270,44 +663,64 @@ struct connection_data *get_connection_data(struct wldbg_message *msg) {
     size_t events_num;
     struct vms_event_record *events =
         vms_shm_buffer_get_avail_events(buffer, &events_num);
-    assert(events_num <= LAST_IDX + 1);
+    assert(events_num <= EVENTS_NUM);
 
     struct vms_event_record *event = events;
     for (int i = 0; i < events_num; ++i) {
 	printf("REC %s -> %lu\n", event->name, event->kind);
-        if (strcmp(event->name, vamos_events[POINTER_MOTION].name) == 0) {
-            data->events[POINTER_MOTION].kind = event->kind;
-        } else if (strcmp(event->name, vamos_events[POINTER_BUTTON].name) ==
-                   0) {
-            data->events[POINTER_BUTTON].kind = event->kind;
-        } else if (strcmp(event->name, vamos_events[POINTER_ENTRY].name) ==
-                   0) {
-            data->events[POINTER_ENTRY].kind = event->kind;
-        } else if (strcmp(event->name, vamos_events[POINTER_LEAVE].name) ==
-                   0) {
-            data->events[POINTER_LEAVE].kind = event->kind;
-        } else if (strcmp(event->name, vamos_events[KEYBOARD_KEY].name) == 0) {
-            data->events[KEYBOARD_KEY].kind = event->kind;
+        for (size_t idx = 0; idx < EVENTS_NUM; ++idx) {
+            if (strcmp(event->name, event_name(idx)) == 0) {
+                data->kinds[idx] = event->kind;
+                break;
+            }
         }
         ++event;
     }
 
+    build_message_table(data);
+    set_object_interface(data, 1, &wl_display_interface);
+
+    data->next = connections;
+    data->prev = &connections;
+    if (connections)
+        connections->prev = &data->next;
+    connections = data;
     wldbg_connection_set_user_data(msg->connection, data, destroy_data);
 
     return data;
 }
 
-static void help(void *user_data) { (void)user_data; }
+static void help(void *user_data) {
+    (void)user_data;
+    printf(
+        "Usage: wldbg vamos shmkey [--pool-size=N] -- wayland-client\n"
+        "  --pool-size=N  keep up to N sub-buffers created ahead for new\n"
+        "                 clients (default 4, 0 disables the pool)\n");
+}
 
 static int init(struct wldbg *wldbg, struct wldbg_pass *pass, int argc,
                 const char *argv[]) {
-    (void)wldbg;
-
     printf("-- Initializing VAMOS pass --\n\n");
     for (int i = 0; i < argc; ++i) printf("\targument[%d]: %s\n", i, argv[i]);
 
     printf("\n\n");
 
+    for (int i = 2; i < argc; ++i) {
+        if (strncmp(argv[i], "--pool-size=", 12) == 0) {
+            sub_pool.size = strtoul(argv[i] + 12, NULL, 10);
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (sub_pool.size > 0) {
+        sub_pool.buffers = calloc(sub_pool.size, sizeof(*sub_pool.buffers));
+        if (!sub_pool.buffers) {
+            fprintf(stderr, "Memory allocation failed");
+            return -1;
+        }
+    }
+
     if (!init_vamos(argv[1])) {
         fprintf(stderr, "Failed initializing VAMOS");
         return -1;
@@ -320,6 +733,7 @@ static int init(struct wldbg *wldbg, struct wldbg_pass *pass, int argc,
     }
 
     pass->user_data = data;
+    init_batch_timer(wldbg);
 
     return 0;
 }
@@ -334,9 +748,13 @@ static void destroy(void *user_data) {
         data->out_trasfered, data->in_trasfered);
 
     free(data);
+    destroy_batch_timer();
+    destroy_sub_pool();
     free(sub_control);
 
     vms_shm_buffer_destroy(top_buffer);
+    vsrc_stats_print(stderr, stats);
+    vsrc_stats_destroy(stats);
 }
 
 static int message_in(void *user_data, struct wldbg_message *message) {
@@ -350,7 +768,7 @@ static int message_in(void *user_data, struct wldbg_message *message) {
            data->incoming_number, message->size);
            */
 
-    send_event(message);
+    send_event(message, true);
 
     return PASS_NEXT;
 }
@@ -366,7 +784,7 @@ static int message_out(void *user_data, struct wldbg_message *message) {
            data->outcoming_number, message->size);
            */
 
-    send_event(message);
+    send_event(message, false);
 
     return PASS_NEXT;
 }
@@ -379,97 +797,124 @@ struct wldbg_pass wldbg_pass = {
     .help = help,
     .description = "Wldbg pass that sends data into VAMOS"};
 
-void send_event(struct wldbg_message *message) {
-    int is_buggy = 0;
-    uint32_t pos;
-    struct wldbg_connection *conn = message->connection;
+/* forward the message as it is on the wire */
+static void write_raw_event(struct connection_data *data,
+                            struct wldbg_message *message, bool from_server,
+                            double time) {
+    /* monitor does not want this event */
+    if (data->kinds[RAW_MESSAGE] == 0)
+        return;
+
+    const uint32_t *words = message->data;
+    if (message->size < 2 * sizeof(uint32_t))
+        return;
+
+    uint32_t object = words[0];
+    uint32_t opcode = words[1] & 0xffff;
+    uint32_t size = words[1] >> 16;
+    uint32_t args[RAW_WORDS] = {0};
+    size_t nargs = message->size / sizeof(uint32_t) - 2;
+    if (nargs > RAW_WORDS)
+        nargs = RAW_WORDS;
+    memcpy(args, words + 2, nargs * sizeof(uint32_t));
+
+    unsigned char *addr = batch_start_event(data, RAW_MESSAGE, time);
+    unsigned char from = from_server;
+    addr = batch_push(addr, &from, sizeof(from));
+    addr = batch_push(addr, &object, sizeof(object));
+    addr = batch_push(addr, &opcode, sizeof(opcode));
+    addr = batch_push(addr, &size, sizeof(size));
+    addr = batch_push(addr, args, sizeof(args));
+    batch_finish_event(data, addr);
+}
+
+void send_event(struct wldbg_message *message, bool from_server) {
     struct wldbg_resolved_message rm;
+    int handled = 0;
 
     struct connection_data *data = get_connection_data(message);
-
-    if (!wldbg_resolve_message(message, &rm)) {
-        // fprintf(stderr, "Failed resolving message, event lost...\n");
+    if (!data)
         return;
-    }
 
-    if (rm.wl_interface == &wl_pointer_interface) {
-        if (handle_pointer_message(&rm, data))
-            print_message(message);
-    }
+    /* the events have the time in milliseconds */
+    data->observed_ns = vsrc_stats_now_ns();
+    double time = data->observed_ns / 1000000;
+    vsrc_stats_add(stream_stats, VSRC_STATS_BYTES, message->size);
+    if (data->batch_len > 0 &&
+        (from_server != data->last_from_server ||
+         time - data->batch_start >= BATCH_MAX_DELAY_MS))
+        flush_batch(data);
+    data->last_from_server = from_server;
+
+    const uint32_t *words = message->data;
+    size_t words_num = message->size / sizeof(uint32_t);
+    if (words_num >= 2) {
+        uint32_t object = words[0];
+        uint32_t opcode = words[1] & 0xffff;
+        const struct wl_interface *iface = object_interface(data, object);
+        int idx = -1;
+
+        if (iface) {
+            /* no need to resolve the message to know what it is */
+            if (!from_server)
+                record_new_objects(data, iface, opcode, words, words_num);
+            else if (object == 1 && opcode == DISPLAY_DELETE_ID &&
+                     words_num > 2)
+                set_object_interface(data, words[2], NULL);
+            idx = lookup_message(data, iface, from_server, opcode);
+            if (idx >= 0 && !wldbg_resolve_message(message, &rm))
+                idx = -1;
+        } else if ((object < SERVER_ID_START ||
+                    (opcode < MAX_OPCODE &&
+                     data->message_table[from_server][opcode][0] >= 0)) &&
+                   wldbg_resolve_message(message, &rm)) {
+            /* the objects created by the server are not remembered,
+             * so we resolve only their messages that may be traced */
+            if (object < SERVER_ID_START) {
+                set_object_interface(data, object, rm.wl_interface);
+                if (rm.wl_interface && !from_server)
+                    record_new_objects(data, rm.wl_interface, opcode, words,
+                                       words_num);
+            }
+            idx = lookup_message(data, rm.wl_interface, from_server, opcode);
+        }
 
-    if (rm.wl_interface == &wl_keyboard_interface) {
-        if (handle_keyboard_message(&rm, data))
+        if (idx >= 0)
+            handled = traced_messages[idx].write(data, &rm, idx, time);
+        if (handled)
             print_message(message);
     }
 
-    return;
+    if (!handled)
+        write_raw_event(data, message, from_server, time);
+
+    /* without the timer, nothing would publish the batch if no other
+     * message came */
+    if (batch_timer_fd < 0)
+        flush_batch(data);
 }
 
 /* write an event that has all arguments uint32_t */
-int write_event_args32(struct connection_data *data,
-                       struct wldbg_resolved_message *rm,
-                       enum vamos_event_idx event_idx) {
+static int write_event_args32(struct connection_data *data,
+                              struct wldbg_resolved_message *rm,
+                              size_t event_idx, double time) {
     /* monitor does not want this event */
-    if (data->events[event_idx].kind == 0)
+    if (data->kinds[event_idx] == 0)
 	return 0;
 
     struct wldbg_resolved_arg *arg;
-    unsigned char *addr = data_ptr(data);
-    ++data->next_id;
-
-    /* write the header */
-    addr = vms_shm_buffer_partial_push(
-        data->buffer, addr, &data->events[event_idx].kind, sizeof(vms_kind));
-    addr = vms_shm_buffer_partial_push(data->buffer, addr, &data->next_id,
-                                       sizeof(vms_eventid));
-
-    /* write time */
-    double time = get_mono_time();
-    addr = vms_shm_buffer_partial_push(data->buffer, addr, &time, sizeof(time));
+    unsigned char *addr = batch_start_event(data, event_idx, time);
 
     /* write the arguments */
 #ifndef NDEBUG
     size_t n = 0;
 #endif
     while ((arg = wldbg_resolved_message_next_argument(rm))) {
-        addr = vms_shm_buffer_partial_push(data->buffer, addr, arg->data,
-                                           sizeof(uint32_t));
-        assert(n++ <= strlen(vamos_events[event_idx].sig) - 1);
+        addr = batch_push(addr, arg->data, sizeof(uint32_t));
+        assert(n++ <= strlen(event_sig(event_idx)) - 1);
     }
-    assert(n++ == strlen(vamos_events[event_idx].sig) - 1);
+    assert(n++ == strlen(event_sig(event_idx)) - 1);
 
-    vms_shm_buffer_finish_push(data->buffer);
+    batch_finish_event(data, addr);
     return 1;
 }
-
-int handle_keyboard_message(struct wldbg_resolved_message *rm,
-                            struct connection_data *data) {
-    unsigned int pos = 0;
-    const struct wl_message *wl_message = rm->wl_message;
-
-    if (strcmp(wl_message->name, "key") == 0) {
-        return write_event_args32(data, rm, KEYBOARD_KEY);
-    }
-
-    return 0;
-}
-
-int handle_pointer_message(struct wldbg_resolved_message *rm,
-                           struct connection_data *data) {
-    unsigned int pos = 0;
-    const struct wl_message *wl_message = rm->wl_message;
-    struct wldbg_resolved_arg *arg;
-
-    enum vamos_event_idx event_idx = INVALID_IDX;
-    if (strcmp(wl_message->name, "motion") == 0) {
-        return write_event_args32(data, rm, POINTER_MOTION);
-    } else if (strcmp(wl_message->name, "button") == 0) {
-        return write_event_args32(data, rm, POINTER_BUTTON);
-    } else if (strcmp(wl_message->name, "entry") == 0) {
-        return write_event_args32(data, rm, POINTER_ENTRY);
-    } else if (strcmp(wl_message->name, "leave") == 0) {
-        return write_event_args32(data, rm, POINTER_LEAVE);
-    }
-
-    return 0;
-}